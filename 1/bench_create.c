@@ -0,0 +1,84 @@
+#define _POSIX_C_SOURCE 200809
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "libcoro.h"
+#include "coro_arch.h"
+
+/**
+ * Coroutine creation rate benchmark. Build it with different
+ * CORO_BACKEND_* macros to compare the creation backends:
+ *
+ * $> make bench
+ */
+
+#if defined(CORO_BACKEND_SIGNAL)
+#define BACKEND_NAME "signal"
+#elif defined(CORO_BACKEND_UCONTEXT)
+#define BACKEND_NAME "ucontext"
+#else
+#define BACKEND_NAME "trampoline"
+#endif
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_empty_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 10000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	coro_sched_init();
+	double create_best = 0, total_best = 0;
+	for (int r = 0; r < rounds; ++r) {
+		double start = bench_now();
+		for (int i = 0; i < count; ++i)
+			coro_new(bench_empty_f, NULL);
+		double created = bench_now();
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		double finished = bench_now();
+		if (r == 0 || created - start < create_best)
+			create_best = created - start;
+		if (r == 0 || finished - start < total_best)
+			total_best = finished - start;
+	}
+	/* Churn - only one coroutine exists at a time. */
+	double churn_best = 0;
+	for (int r = 0; r < rounds; ++r) {
+		double start = bench_now();
+		for (int i = 0; i < count; ++i) {
+			coro_new(bench_empty_f, NULL);
+			coro_delete(coro_sched_wait());
+		}
+		double duration = bench_now() - start;
+		if (r == 0 || duration < churn_best)
+			churn_best = duration;
+	}
+	printf("%-10s create: %8.0f ns/coro, %10.0f coro/s; "
+	       "create+run+delete: %8.0f ns/coro; churn: %6.0f ns/coro\n",
+	       BACKEND_NAME, create_best * 1e9 / count, count / create_best,
+	       total_best * 1e9 / count, churn_best * 1e9 / count);
+	struct coro_stack_stats stats;
+	coro_stack_pool_stats(&stats);
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-10s stack pool: %lld hits, %lld misses, %lld unguarded; "
+	       "max RSS %ld KiB\n", "", stats.hits, stats.misses,
+	       stats.unguarded, ru.ru_maxrss);
+	return 0;
+}
@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+/**
+ * Tail latency of a mixed workload under each scheduling policy.
+ * Bulk coroutines crunch numbers and yield once per quantum, like
+ * the sorting ones do. Interactive coroutines sleep in a queue,
+ * and the bulk ones wake them up periodically, as if a request
+ * came. The time from the wakeup till the interactive coroutine
+ * gets the CPU is its latency.
+ *
+ * $> make bench
+ */
+
+enum {
+	BULK_COUNT = 8,
+	INTERACTIVE_COUNT = 4,
+	QUANTUM_USEC = 50,
+	PERIOD_USEC = 500,
+	/** Target latency of the interactive coroutines for EDF. */
+	INTERACTIVE_LATENCY_USEC = 100,
+	BULK_LATENCY_USEC = 10000,
+	SAMPLES_MAX = 1 << 16,
+};
+
+static double bench_end;
+static double bench_next_event;
+static double bench_event_time;
+static struct coro_queue bench_events;
+static int bench_bulk_alive;
+static double bench_samples[SAMPLES_MAX];
+static int bench_sample_count;
+static long bench_chunks;
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_bulk_f(void *arg)
+{
+	(void)arg;
+	volatile long sum = 0;
+	double now;
+	while ((now = bench_now()) < bench_end) {
+		for (long i = 0; i < 100; ++i)
+			sum += i * i;
+		++bench_chunks;
+		if (now >= bench_next_event) {
+			bench_event_time = now;
+			bench_next_event = now + PERIOD_USEC / 1e6;
+			coro_wakeup_all(&bench_events);
+		}
+		coro_yield_if_expired();
+	}
+	/* The last one lets the interactive coroutines exit. */
+	if (--bench_bulk_alive == 0)
+		coro_wakeup_all(&bench_events);
+	return 0;
+}
+
+static int
+bench_interactive_f(void *arg)
+{
+	(void)arg;
+	while (true) {
+		coro_wait(&bench_events);
+		if (bench_bulk_alive == 0)
+			break;
+		if (bench_sample_count < SAMPLES_MAX) {
+			bench_samples[bench_sample_count++] =
+				bench_now() - bench_event_time;
+		}
+		/* Handle the request. */
+		volatile long sum = 0;
+		for (long i = 0; i < 1000; ++i)
+			sum += i;
+	}
+	return 0;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	return da < db ? -1 : da > db;
+}
+
+static double
+bench_percentile(double p)
+{
+	if (bench_sample_count == 0)
+		return 0;
+	int i = (int)(p * (bench_sample_count - 1));
+	return bench_samples[i] * 1e6;
+}
+
+static int
+bench_run(const char *name, enum coro_policy policy, double duration)
+{
+	if (coro_sched_set_policy(policy) != 0) {
+		printf("Can't set the policy\n");
+		return -1;
+	}
+	coro_queue_create(&bench_events);
+	bench_sample_count = 0;
+	bench_chunks = 0;
+	bench_bulk_alive = BULK_COUNT;
+	double start = bench_now();
+	bench_end = start + duration;
+	bench_next_event = start;
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = CORO_STACK_SIZE_MIN;
+	attr.priority = CORO_PRIORITY_MAX;
+	attr.latency = INTERACTIVE_LATENCY_USEC;
+	for (int i = 0; i < INTERACTIVE_COUNT; ++i) {
+		if (coro_new_ex(bench_interactive_f, NULL, &attr) == NULL)
+			goto error;
+	}
+	attr.priority = CORO_PRIORITY_DEFAULT;
+	attr.latency = BULK_LATENCY_USEC;
+	for (int i = 0; i < BULK_COUNT; ++i) {
+		if (coro_new_ex(bench_bulk_f, NULL, &attr) == NULL)
+			goto error;
+	}
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double elapsed = bench_now() - start;
+	qsort(bench_samples, bench_sample_count, sizeof(bench_samples[0]),
+	      bench_cmp);
+	printf("%-8s: latency us p50 %7.1f, p99 %7.1f, p99.9 %7.1f, "
+	       "max %7.1f; %d wakeups, bulk %5.1f Mchunks/s\n", name,
+	       bench_percentile(0.5), bench_percentile(0.99),
+	       bench_percentile(0.999), bench_percentile(1),
+	       bench_sample_count, bench_chunks / elapsed / 1e6);
+	return 0;
+error:
+	printf("Can't create a coroutine\n");
+	return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	double duration = argc > 1 ? atof(argv[1]) : 0.5;
+	coro_sched_init();
+	coro_sched_set_quantum(QUANTUM_USEC);
+	printf("%d bulk and %d interactive coroutines, quantum %d us, "
+	       "a request every %d us\n", BULK_COUNT, INTERACTIVE_COUNT,
+	       QUANTUM_USEC, PERIOD_USEC);
+	if (bench_run("rr", CORO_POLICY_RR, duration) != 0 ||
+	    bench_run("priority", CORO_POLICY_PRIORITY, duration) != 0 ||
+	    bench_run("edf", CORO_POLICY_EDF, duration) != 0)
+		return -1;
+	return 0;
+}
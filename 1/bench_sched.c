@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+
+/**
+ * Scheduler scalability benchmark. N coroutines yield in a round,
+ * and the run time including waiting is divided by the number of
+ * switches. The scheduling cost should stay flat when N grows.
+ * What still grows is the cache misses, because each switch
+ * touches another stack.
+ *
+ * $> make bench
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_yield_f(void *arg)
+{
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	long total = argc > 1 ? atol(argv[1]) : 4000000;
+	coro_sched_init();
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = CORO_STACK_SIZE_MIN;
+	for (long n = 10; n <= 100000; n *= 10) {
+		long yields = total / n;
+		double start = bench_now();
+		for (long i = 0; i < n; ++i) {
+			if (coro_new_ex(bench_yield_f, &yields, &attr) == NULL) {
+				printf("Can't create a coroutine\n");
+				return -1;
+			}
+		}
+		double created = bench_now();
+		long long switches = 0;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL) {
+			switches += coro_switch_count(c);
+			coro_delete(c);
+		}
+		double finished = bench_now();
+		printf("coroutines %6ld: %6.1f ns/switch, %lld switches, "
+		       "%6.0f ns/create\n", n, (finished - created) * 1e9 /
+		       switches, switches, (created - start) * 1e9 / n);
+	}
+	return 0;
+}
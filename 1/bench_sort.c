@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcoro.h"
+#include "coro_util.h"
+#include "sort_kernel.h"
+
+/**
+ * The sorts of coro_util.c on random numbers of different counts
+ * and ranges. The small ranges are like the ones of generator.py
+ * -m, the biggest one is its default. Each sort is run on the same
+ * input a few times, the best time is printed. quick_sort() is
+ * quadratic on the runs of equal numbers, so it is skipped, where
+ * a number repeats too many times, and on the presorted inputs. The
+ * merge sort is run with the vectors of the CPU and without them.
+ * The presorted inputs are sorted, reversed, and sorted with a tail
+ * of random numbers, where tim_sort() should win.
+ *
+ * $> make bench
+ * $> ./bench_sort [runs]
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_scalar_merge_sort(long arr[], long size)
+{
+	enum sort_isa isa = sort_get_isa();
+	sort_set_isa(SORT_ISA_SCALAR);
+	iter_merge_sort(arr, size);
+	sort_set_isa(isa);
+}
+
+static void
+bench_quick_sort(long arr[], long size)
+{
+	quick_sort(arr, 0, size - 1);
+}
+
+static const struct {
+	const char *name;
+	void (*sort)(long arr[], long size);
+	/** Skip, when a number repeats more times on average. */
+	long max_repeats;
+} bench_sorts[] = {
+	{"merge", iter_merge_sort, 0},
+	{"scalar", bench_scalar_merge_sort, 0},
+	{"quick", bench_quick_sort, 100},
+	{"tim", tim_sort, 0},
+	{"radix", radix_sort, 0},
+};
+
+enum {
+	bench_sort_count = sizeof(bench_sorts) / sizeof(bench_sorts[0]),
+};
+
+enum bench_order {
+	BENCH_RANDOM,
+	BENCH_SORTED,
+	BENCH_REVERSED,
+	/** The last 10% are random. */
+	BENCH_TAIL,
+};
+
+static const char *bench_order_names[] = {
+	"random", "sorted", "reversed", "tail",
+};
+
+static void
+bench_fill(long *input, long size, long range, enum bench_order order)
+{
+	long sorted = order == BENCH_TAIL ? size / 10 * 9 :
+		      order == BENCH_RANDOM ? 0 : size;
+	for (long i = 0; i < size; ++i) {
+		long v = (long)rand() << 16 ^ rand();
+		if (i >= sorted)
+			input[i] = v % (range + 1);
+		else if (order == BENCH_REVERSED)
+			input[i] = (size - i) * range / size;
+		else
+			input[i] = i * range / size;
+	}
+}
+
+/** Best ns per element of the sort over @a runs runs. */
+static double
+bench_run(void (*sort)(long arr[], long size), const long *input,
+	  long *arr, long size, int runs)
+{
+	double best = 0;
+	for (int i = 0; i < runs; ++i) {
+		memcpy(arr, input, sizeof(long) * size);
+		double start = bench_now();
+		sort(arr, size);
+		double ns = (bench_now() - start) * 1e9 / size;
+		if (i == 0 || ns < best)
+			best = ns;
+		for (long j = 1; j < size; ++j) {
+			if (arr[j - 1] > arr[j]) {
+				printf("the result is not sorted\n");
+				exit(-1);
+			}
+		}
+	}
+	return best;
+}
+
+int
+main(int argc, char **argv)
+{
+	int runs = argc > 1 ? atoi(argv[1]) : 3;
+	if (runs <= 0) {
+		printf("Usage: %s [runs]\n", argv[0]);
+		return -1;
+	}
+	coro_sched_init();
+	const long counts[] = {1000, 10000, 100000, 1000000};
+	const long ranges[] = {100, 10000, 1000000, 1L << 31};
+	long max_count = counts[sizeof(counts) / sizeof(counts[0]) - 1];
+	long *input = malloc(sizeof(long) * max_count);
+	long *arr = malloc(sizeof(long) * max_count);
+	srand(1);
+	for (int o = BENCH_RANDOM; o <= BENCH_TAIL; ++o) {
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+		for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); ++r) {
+			long size = counts[c];
+			/* The presorted ones only in the default range. */
+			if (o != BENCH_RANDOM && r + 1 < sizeof(ranges) /
+						sizeof(ranges[0]))
+				continue;
+			bench_fill(input, size, ranges[r], o);
+			printf("%-8s %7ld numbers of 0..%-10ld ns/number:",
+			       bench_order_names[o], size, ranges[r]);
+			for (int s = 0; s < bench_sort_count; ++s) {
+				long max = bench_sorts[s].max_repeats;
+				if (max != 0 && (o != BENCH_RANDOM ||
+						 size / (ranges[r] + 1) > max)) {
+					printf(" %s %6s", bench_sorts[s].name,
+					       "-");
+					continue;
+				}
+				printf(" %s %6.1f", bench_sorts[s].name,
+				       bench_run(bench_sorts[s].sort, input,
+						 arr, size, runs));
+			}
+			printf("\n");
+		}
+	}
+	}
+	free(input);
+	free(arr);
+	return 0;
+}
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include "libcoro.h"
+
+/**
+ * Stackless against stackful coroutines at a million tasks. Each
+ * task yields a few times. The memory per task is the resident
+ * set growth, when all of them have run once, so the stacks are
+ * touched. The stackful ones are tried with fewer tasks, if the
+ * million of stacks doesn't fit into the memory.
+ *
+ * $> make bench
+ * $> ./bench_stackless [tasks [yields]]
+ */
+
+enum {
+	/** Resident pages of a fresh stackful coroutine, roughly. */
+	BENCH_STACK_PAGES = 2,
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+bench_rss(void)
+{
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static long bench_yields;
+
+static int
+bench_stackful_f(void *arg)
+{
+	(void)arg;
+	for (long i = 0; i < bench_yields; ++i)
+		coro_yield();
+	return 0;
+}
+
+static enum coro_step
+bench_stackless_f(struct coro *c, void *arg)
+{
+	(void)arg;
+	CORO_BEGIN(c);
+	/* Each step is a switch, no state of its own is needed. */
+	while (coro_switch_count(c) < bench_yields)
+		CORO_YIELD(c);
+	CORO_END(c);
+}
+
+/**
+ * Run @a count tasks of one kind.
+ * @retval 0 Success.
+ * @retval -1 Could not create them all.
+ */
+static int
+bench_run(bool is_stackless, long count, const char *note)
+{
+	const char *kind = is_stackless ? "stackless" : "stackful";
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = CORO_STACK_SIZE_MIN;
+	malloc_trim(0);
+	long rss = bench_rss();
+	double start = bench_now();
+	for (long i = 0; i < count; ++i) {
+		struct coro *c = is_stackless ?
+			coro_new_stackless(bench_stackless_f, NULL, &attr) :
+			coro_new_ex(bench_stackful_f, NULL, &attr);
+		if (c == NULL) {
+			printf("%-9s %7ld: can't create a coroutine\n", kind,
+			       count);
+			return -1;
+		}
+	}
+	double created = bench_now();
+	/* Let everyone run once and touch its memory. */
+	coro_yield();
+	long rss_per_task = (bench_rss() - rss) / count;
+	long long switches = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	double finished = bench_now();
+	printf("%-9s %7ld: %6.0f ns/create, %6ld B/task, %6.1f ns/switch%s\n",
+	       kind, count, (created - start) * 1e9 / count, rss_per_task,
+	       (finished - created) * 1e9 / switches, note);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	long count = argc > 1 ? atol(argv[1]) : 1000000;
+	bench_yields = argc > 2 ? atol(argv[2]) : 10;
+	if (count <= 0 || bench_yields < 0) {
+		printf("Usage: %s [tasks [yields]]\n", argv[0]);
+		return -1;
+	}
+	coro_sched_init();
+	if (bench_run(true, count, "") != 0)
+		return -1;
+	/* Don't let the stacks push the machine into the OOM killer. */
+	long page = sysconf(_SC_PAGESIZE);
+	long avail = sysconf(_SC_AVPHYS_PAGES) / 2;
+	long stackful = count;
+	while (stackful > 1 && stackful * BENCH_STACK_PAGES > avail)
+		stackful /= 10;
+	char note[128] = "";
+	if (stackful != count) {
+		snprintf(note, sizeof(note), " (%ld stacks don't fit into "
+			 "%ld MiB)", count, avail * page >> 20);
+	}
+	if (bench_run(false, stackful, note) != 0)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,701 @@
+#define _GNU_SOURCE
+/* longjmp() between the alloca() coroutines goes down the stack. */
+#undef _FORTIFY_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <alloca.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <malloc.h>
+#include "libcoro.h"
+
+/**
+ * libcoro microbenchmarks against ucontext, threads, and the
+ * setjmp() + alloca() coroutines of examples/coro_alloca.c. Each
+ * number is measured in several runs, and min/median/max of them
+ * are printed as CSV, to be compared between the versions:
+ *
+ *     metric,impl,count,unit,runs,min,median,max
+ *
+ * Metrics, count is the number of coroutines or threads:
+ * - create: create, run to the end, and delete one;
+ * - yield_rtt: round trip of a yield in a ring - how soon the
+ *   yielding one gets the CPU back;
+ * - memory: resident memory of one, which has run a bit. Each run
+ *   is in a new process, so nothing is reused from the previous;
+ * - wait: coro_sched_wait() of an already finished coroutine, or
+ *   pthread_join() of an exited thread.
+ *
+ * All the stacks are 16 KiB.
+ *
+ * $> make bench_suite
+ * $> ./bench_suite [runs]
+ */
+
+enum {
+	BENCH_STACK = CORO_STACK_SIZE_MIN,
+	BENCH_RUNS_DEFAULT = 5,
+	/** Switches per run of a coroutine ring. */
+	BENCH_SWITCHES = 1000000,
+	/** Threads switch through the kernel, much slower. */
+	BENCH_THREAD_SWITCHES = 20000,
+};
+
+typedef double (*bench_f)(long count);
+
+static void
+bench_fail(const char *what)
+{
+	printf("Can't %s\n", what);
+	exit(-1);
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+bench_rss(void)
+{
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/** Yields per member of a ring of @a count, to make @a switches. */
+static long
+bench_ring_yields(long count, long switches)
+{
+	long yields = switches / count;
+	return yields > 0 ? yields : 1;
+}
+
+/* ---------------------------- libcoro ---------------------------- */
+
+static struct coro_attr bench_attr;
+static long bench_yields;
+
+static int
+bench_coro_nop_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static int
+bench_coro_yield_f(void *arg)
+{
+	(void)arg;
+	for (long i = 0; i < bench_yields; ++i)
+		coro_yield();
+	return 0;
+}
+
+static enum coro_step
+bench_step_f(struct coro *c, void *arg)
+{
+	(void)arg;
+	CORO_BEGIN(c);
+	while (coro_switch_count(c) < bench_yields)
+		CORO_YIELD(c);
+	CORO_END(c);
+}
+
+static struct coro *
+bench_coro_new(bool is_stackless, coro_f func)
+{
+	struct coro *c = is_stackless ?
+			 coro_new_stackless(bench_step_f, NULL, &bench_attr) :
+			 coro_new_ex(func, NULL, &bench_attr);
+	if (c == NULL)
+		bench_fail("create a coroutine");
+	return c;
+}
+
+static void
+bench_coro_delete_all(void)
+{
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+}
+
+static double
+bench_coro_create_in(long count, bool is_stackless)
+{
+	bench_yields = 0;
+	double start = bench_now();
+	for (long i = 0; i < count; ++i)
+		bench_coro_new(is_stackless, bench_coro_nop_f);
+	bench_coro_delete_all();
+	return (bench_now() - start) * 1e9 / count;
+}
+
+static double
+bench_coro_yield_in(long count, bool is_stackless)
+{
+	bench_yields = bench_ring_yields(count, BENCH_SWITCHES);
+	struct coro **all = malloc(count * sizeof(all[0]));
+	if (all == NULL)
+		bench_fail("allocate");
+	for (long i = 0; i < count; ++i)
+		bench_coro_new(is_stackless, bench_coro_yield_f);
+	double start = bench_now();
+	for (long i = 0; i < count; ++i)
+		all[i] = coro_sched_wait();
+	double end = bench_now();
+	for (long i = 0; i < count; ++i)
+		coro_delete(all[i]);
+	free(all);
+	return (end - start) * 1e9 / bench_yields;
+}
+
+static double
+bench_coro_memory_in(long count, bool is_stackless)
+{
+	bench_yields = 1;
+	long rss = bench_rss();
+	for (long i = 0; i < count; ++i)
+		bench_coro_new(is_stackless, bench_coro_yield_f);
+	/* Round-robin runs everyone once, until the yield. */
+	coro_yield();
+	double size = (double)(bench_rss() - rss) / count;
+	bench_coro_delete_all();
+	return size;
+}
+
+static double
+bench_coro_create(long count)
+{
+	return bench_coro_create_in(count, false);
+}
+
+static double
+bench_step_create(long count)
+{
+	return bench_coro_create_in(count, true);
+}
+
+static double
+bench_coro_yield(long count)
+{
+	return bench_coro_yield_in(count, false);
+}
+
+static double
+bench_step_yield(long count)
+{
+	return bench_coro_yield_in(count, true);
+}
+
+static double
+bench_coro_memory(long count)
+{
+	return bench_coro_memory_in(count, false);
+}
+
+static double
+bench_step_memory(long count)
+{
+	return bench_coro_memory_in(count, true);
+}
+
+static double
+bench_coro_wait(long count)
+{
+	struct coro **all = malloc(count * sizeof(all[0]));
+	if (all == NULL)
+		bench_fail("allocate");
+	for (long i = 0; i < count; ++i)
+		bench_coro_new(false, bench_coro_nop_f);
+	/* All of them finish, while this one is in the queue. */
+	coro_yield();
+	double start = bench_now();
+	for (long i = 0; i < count; ++i)
+		all[i] = coro_sched_wait();
+	double end = bench_now();
+	for (long i = 0; i < count; ++i)
+		coro_delete(all[i]);
+	free(all);
+	return (end - start) * 1e9 / count;
+}
+
+/* ---------------------------- ucontext --------------------------- */
+
+static ucontext_t bench_uc_main;
+static ucontext_t *bench_ucs;
+static long bench_uc_count;
+
+static void
+bench_uc_nop_f(void)
+{
+}
+
+/** Member @a i of a ring, the first one to finish ends it. */
+static void
+bench_uc_ring_f(int i)
+{
+	ucontext_t *next = &bench_ucs[(i + 1) % bench_uc_count];
+	for (long k = 0; k < bench_yields; ++k)
+		swapcontext(&bench_ucs[i], next);
+}
+
+static void
+bench_uc_prepare(ucontext_t *uc, void *stack)
+{
+	if (getcontext(uc) != 0)
+		bench_fail("get a context");
+	uc->uc_stack.ss_sp = stack;
+	uc->uc_stack.ss_size = BENCH_STACK;
+	uc->uc_link = &bench_uc_main;
+}
+
+static double
+bench_uc_create(long count)
+{
+	ucontext_t uc;
+	double start = bench_now();
+	for (long i = 0; i < count; ++i) {
+		void *stack = malloc(BENCH_STACK);
+		if (stack == NULL)
+			bench_fail("allocate");
+		bench_uc_prepare(&uc, stack);
+		makecontext(&uc, bench_uc_nop_f, 0);
+		swapcontext(&bench_uc_main, &uc);
+		free(stack);
+	}
+	return (bench_now() - start) * 1e9 / count;
+}
+
+/**
+ * Create a ring of @a count and run it.
+ * @param[out] rss Resident memory, when it has ended.
+ * @return Time of the run.
+ */
+static double
+bench_uc_ring(long count, long yields, long *rss)
+{
+	bench_yields = yields;
+	bench_uc_count = count;
+	bench_ucs = malloc(count * sizeof(bench_ucs[0]));
+	char *stacks = malloc(count * BENCH_STACK);
+	if (bench_ucs == NULL || stacks == NULL)
+		bench_fail("allocate");
+	for (long i = 0; i < count; ++i) {
+		bench_uc_prepare(&bench_ucs[i], stacks + i * BENCH_STACK);
+		makecontext(&bench_ucs[i], (void (*)(void))bench_uc_ring_f, 1,
+			    (int)i);
+	}
+	double start = bench_now();
+	swapcontext(&bench_uc_main, &bench_ucs[0]);
+	double time = bench_now() - start;
+	*rss = bench_rss();
+	free(stacks);
+	free(bench_ucs);
+	return time;
+}
+
+static double
+bench_uc_yield(long count)
+{
+	long yields = bench_ring_yields(count, BENCH_SWITCHES);
+	long rss;
+	return bench_uc_ring(count, yields, &rss) * 1e9 / yields;
+}
+
+static double
+bench_uc_memory(long count)
+{
+	long start = bench_rss();
+	long rss;
+	bench_uc_ring(count, 1, &rss);
+	return (double)(rss - start) / count;
+}
+
+/* ---------------------------- threads ---------------------------- */
+
+struct bench_thread {
+	sem_t sem;
+	sem_t *next;
+	/** Posted by the last member of a ring, when it is done. */
+	sem_t *done;
+	pthread_t thread;
+};
+
+static atomic_long bench_thread_exited;
+
+static void *
+bench_thread_nop_f(void *arg)
+{
+	(void)arg;
+	atomic_fetch_add(&bench_thread_exited, 1);
+	return NULL;
+}
+
+static void *
+bench_thread_ring_f(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *)arg;
+	for (long k = 0; k < bench_yields; ++k) {
+		sem_wait(&t->sem);
+		sem_post(t->next);
+	}
+	if (t->done != NULL)
+		sem_post(t->done);
+	return NULL;
+}
+
+static void
+bench_thread_new(pthread_t *thread, void *(*func)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, BENCH_STACK);
+	if (pthread_create(thread, &attr, func, arg) != 0)
+		bench_fail("create a thread");
+	pthread_attr_destroy(&attr);
+}
+
+static double
+bench_thread_create(long count)
+{
+	double start = bench_now();
+	for (long i = 0; i < count; ++i) {
+		pthread_t thread;
+		bench_thread_new(&thread, bench_thread_nop_f, NULL);
+		pthread_join(thread, NULL);
+	}
+	return (bench_now() - start) * 1e9 / count;
+}
+
+/**
+ * Start a ring of @a count threads. With @a rss measure the
+ * memory, when all of them have started, instead of the time.
+ */
+static double
+bench_thread_ring(long count, long yields, bool is_rss)
+{
+	bench_yields = yields;
+	struct bench_thread *all = malloc(count * sizeof(all[0]));
+	if (all == NULL)
+		bench_fail("allocate");
+	sem_t done;
+	sem_init(&done, 0, 0);
+	long rss = bench_rss();
+	for (long i = 0; i < count; ++i) {
+		sem_init(&all[i].sem, 0, 0);
+		all[i].next = &all[(i + 1) % count].sem;
+		all[i].done = i == count - 1 ? &done : NULL;
+	}
+	for (long i = 0; i < count; ++i)
+		bench_thread_new(&all[i].thread, bench_thread_ring_f, &all[i]);
+	double result;
+	if (is_rss) {
+		/* Let everyone reach the semaphore. */
+		usleep(100000);
+		result = (double)(bench_rss() - rss) / count;
+		sem_post(&all[0].sem);
+		sem_wait(&done);
+	} else {
+		double start = bench_now();
+		sem_post(&all[0].sem);
+		sem_wait(&done);
+		result = (bench_now() - start) * 1e9 / yields;
+	}
+	for (long i = 0; i < count; ++i) {
+		pthread_join(all[i].thread, NULL);
+		sem_destroy(&all[i].sem);
+	}
+	sem_destroy(&done);
+	free(all);
+	return result;
+}
+
+static double
+bench_thread_yield(long count)
+{
+	long yields = bench_ring_yields(count, BENCH_THREAD_SWITCHES);
+	return bench_thread_ring(count, yields, false);
+}
+
+static double
+bench_thread_memory(long count)
+{
+	return bench_thread_ring(count, 1, true);
+}
+
+static double
+bench_thread_wait(long count)
+{
+	pthread_t *all = malloc(count * sizeof(all[0]));
+	if (all == NULL)
+		bench_fail("allocate");
+	atomic_store(&bench_thread_exited, 0);
+	for (long i = 0; i < count; ++i)
+		bench_thread_new(&all[i], bench_thread_nop_f, NULL);
+	while (atomic_load(&bench_thread_exited) < count)
+		usleep(1000);
+	/* The last ones could be still on the way out. */
+	usleep(10000);
+	double start = bench_now();
+	for (long i = 0; i < count; ++i)
+		pthread_join(all[i], NULL);
+	double end = bench_now();
+	free(all);
+	return (end - start) * 1e9 / count;
+}
+
+/* ----------------------- setjmp + alloca ------------------------- */
+
+/*
+ * As in examples/coro_alloca.c: the coroutines are carved out of
+ * one stack by alloca(), and switch with longjmp(). It all
+ * happens in a thread with a stack big enough for all of them.
+ */
+
+static jmp_buf *bench_jmps;
+static jmp_buf bench_jmp_main;
+static long bench_jmp_count;
+static long bench_jmp_i;
+/** True, if they run one by one, otherwise in a ring. */
+static bool bench_jmp_is_serial;
+static double bench_jmp_created;
+
+static void
+bench_jmp_yield(void)
+{
+	if (setjmp(bench_jmps[bench_jmp_i]) == 0) {
+		bench_jmp_i = (bench_jmp_i + 1) % bench_jmp_count;
+		longjmp(bench_jmps[bench_jmp_i], 1);
+	}
+}
+
+static void __attribute__((noinline))
+bench_jmp_f(void)
+{
+	for (long k = 0; k < bench_yields; ++k)
+		bench_jmp_yield();
+}
+
+/** Create the coroutines on the current stack and run them. */
+static void __attribute__((noinline))
+bench_jmp_run(void)
+{
+	for (volatile long i = 0; i < bench_jmp_count; ++i) {
+		if (setjmp(bench_jmps[i]) == 0) {
+			void *volatile stack = alloca(BENCH_STACK);
+			(void)stack;
+			continue;
+		}
+		/* A coroutine starts here, on its piece of the stack. */
+		bench_jmp_f();
+		if (bench_jmp_is_serial && ++bench_jmp_i < bench_jmp_count)
+			longjmp(bench_jmps[bench_jmp_i], 1);
+		longjmp(bench_jmp_main, 1);
+	}
+	bench_jmp_created = bench_now();
+	if (setjmp(bench_jmp_main) == 0) {
+		bench_jmp_i = 0;
+		longjmp(bench_jmps[0], 1);
+	}
+}
+
+static void *
+bench_jmp_thread_f(void *arg)
+{
+	long *rss = (long *)arg;
+	bench_jmp_run();
+	*rss = bench_rss();
+	return NULL;
+}
+
+/**
+ * Run @a count coroutines with @a yields each.
+ * @param[out] created When they were created.
+ * @param[out] rss Resident memory, when they have ended.
+ * @return When they have ended.
+ */
+static double
+bench_jmp_start(long count, long yields, bool is_serial, double *created,
+		long *rss)
+{
+	bench_yields = yields;
+	bench_jmp_count = count;
+	bench_jmp_is_serial = is_serial;
+	bench_jmps = malloc(count * sizeof(bench_jmps[0]));
+	if (bench_jmps == NULL)
+		bench_fail("allocate");
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, (count + 64) * BENCH_STACK);
+	pthread_t thread;
+	if (pthread_create(&thread, &attr, bench_jmp_thread_f, rss) != 0)
+		bench_fail("create a thread");
+	pthread_attr_destroy(&attr);
+	pthread_join(thread, NULL);
+	double end = bench_now();
+	free(bench_jmps);
+	*created = bench_jmp_created;
+	return end;
+}
+
+static double
+bench_jmp_create(long count)
+{
+	double created;
+	long rss;
+	double start = bench_now();
+	double end = bench_jmp_start(count, 0, true, &created, &rss);
+	return (end - start) * 1e9 / count;
+}
+
+static double
+bench_jmp_yield_rtt(long count)
+{
+	long yields = bench_ring_yields(count, BENCH_SWITCHES);
+	double created;
+	long rss;
+	double end = bench_jmp_start(count, yields, false, &created, &rss);
+	return (end - created) * 1e9 / yields;
+}
+
+static double
+bench_jmp_memory(long count)
+{
+	double created;
+	long rss;
+	long start = bench_rss();
+	bench_jmp_start(count, 1, false, &created, &rss);
+	return (double)(rss - start) / count;
+}
+
+/* ----------------------------- runner ---------------------------- */
+
+struct bench {
+	const char *metric;
+	const char *impl;
+	const char *unit;
+	bench_f func;
+	long count;
+	/** Run in a new process each time. */
+	bool is_forked;
+};
+
+static const struct bench bench_all[] = {
+	{"create", "libcoro", "ns", bench_coro_create, 10000, false},
+	{"create", "libcoro_stackless", "ns", bench_step_create, 10000, false},
+	{"create", "ucontext", "ns", bench_uc_create, 10000, false},
+	{"create", "pthread", "ns", bench_thread_create, 1000, false},
+	{"create", "alloca", "ns", bench_jmp_create, 10000, false},
+
+	{"yield_rtt", "libcoro", "ns", bench_coro_yield, 2, false},
+	{"yield_rtt", "libcoro", "ns", bench_coro_yield, 100, false},
+	{"yield_rtt", "libcoro", "ns", bench_coro_yield, 10000, false},
+	{"yield_rtt", "libcoro_stackless", "ns", bench_step_yield, 2, false},
+	{"yield_rtt", "libcoro_stackless", "ns", bench_step_yield, 100, false},
+	{"yield_rtt", "libcoro_stackless", "ns", bench_step_yield, 10000,
+	 false},
+	{"yield_rtt", "ucontext", "ns", bench_uc_yield, 2, false},
+	{"yield_rtt", "ucontext", "ns", bench_uc_yield, 100, false},
+	{"yield_rtt", "ucontext", "ns", bench_uc_yield, 10000, false},
+	{"yield_rtt", "pthread", "ns", bench_thread_yield, 2, false},
+	{"yield_rtt", "pthread", "ns", bench_thread_yield, 100, false},
+	{"yield_rtt", "pthread", "ns", bench_thread_yield, 10000, false},
+	{"yield_rtt", "alloca", "ns", bench_jmp_yield_rtt, 2, false},
+	{"yield_rtt", "alloca", "ns", bench_jmp_yield_rtt, 100, false},
+	{"yield_rtt", "alloca", "ns", bench_jmp_yield_rtt, 10000, false},
+
+	{"memory", "libcoro", "bytes", bench_coro_memory, 10000, true},
+	{"memory", "libcoro_stackless", "bytes", bench_step_memory, 10000,
+	 true},
+	{"memory", "ucontext", "bytes", bench_uc_memory, 10000, true},
+	{"memory", "pthread", "bytes", bench_thread_memory, 10000, true},
+	{"memory", "alloca", "bytes", bench_jmp_memory, 10000, true},
+
+	{"wait", "libcoro", "ns", bench_coro_wait, 10000, false},
+	{"wait", "pthread", "ns", bench_thread_wait, 1000, false},
+};
+
+/** Run @a func in a child process, to start from a clean state. */
+static double
+bench_fork(bench_f func, long count)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		bench_fail("create a pipe");
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+		bench_fail("fork");
+	if (pid == 0) {
+		/* Free memory of the parent should not be reused. */
+		coro_stack_pool_set_max_idle(0);
+		malloc_trim(0);
+		double result = func(count);
+		if (write(fds[1], &result, sizeof(result)) != sizeof(result))
+			_exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	double result;
+	if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+		bench_fail("get a result from a child");
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	return result;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char **argv)
+{
+	int runs = argc > 1 ? atoi(argv[1]) : BENCH_RUNS_DEFAULT;
+	if (runs <= 0) {
+		printf("Usage: %s [runs]\n", argv[0]);
+		return -1;
+	}
+	coro_sched_init();
+	coro_attr_create(&bench_attr);
+	bench_attr.stack_size = BENCH_STACK;
+	double *samples = malloc(runs * sizeof(samples[0]));
+	if (samples == NULL)
+		bench_fail("allocate");
+	printf("metric,impl,count,unit,runs,min,median,max\n");
+	for (size_t i = 0; i < sizeof(bench_all) / sizeof(bench_all[0]); ++i) {
+		const struct bench *b = &bench_all[i];
+		for (int r = 0; r < runs; ++r) {
+			samples[r] = b->is_forked ? bench_fork(b->func, b->count) :
+				     b->func(b->count);
+		}
+		qsort(samples, runs, sizeof(samples[0]), bench_cmp);
+		printf("%s,%s,%ld,%s,%d,%.1f,%.1f,%.1f\n", b->metric, b->impl,
+		       b->count, b->unit, runs, samples[0], samples[runs / 2],
+		       samples[runs - 1]);
+		fflush(stdout);
+	}
+	free(samples);
+	return 0;
+}
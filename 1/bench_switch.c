@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libcoro.h"
+#include "coro_arch.h"
+
+/**
+ * Context switch cost benchmark. Two coroutines yield to each
+ * other, and the time is divided by the number of switches. Build
+ * it with CORO_SWITCH_ASM or CORO_SWITCH_SIGJMP to compare:
+ *
+ * $> make bench
+ *
+ * The yield is a scheduler round trip. With CORO_SWITCH_ASM the
+ * bare coro_arch_switch() is measured too, as a ping-pong between
+ * two prepared contexts.
+ */
+
+#if defined(CORO_SWITCH_ASM)
+#define SWITCH_NAME "asm"
+#else
+#define SWITCH_NAME "sigjmp"
+#endif
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_yield_f(void *arg)
+{
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+#ifdef CORO_SWITCH_ASM
+
+static struct coro_arch_ctx bench_main_ctx;
+static struct coro_arch_ctx bench_peer_ctx;
+
+static void
+bench_peer_f(void *arg)
+{
+	(void)arg;
+	while (true)
+		coro_arch_switch(&bench_peer_ctx, &bench_main_ctx);
+}
+
+/** Best ns per coro_arch_switch() of @a rounds. */
+static double
+bench_raw_switch(long count, int rounds)
+{
+	size_t stack_size = 64 * 1024;
+	char *stack = malloc(stack_size);
+	coro_arch_prepare(&bench_peer_ctx, stack + stack_size, bench_peer_f,
+			  NULL);
+	double best = 0;
+	for (int r = 0; r < rounds; ++r) {
+		double start = bench_now();
+		for (long i = 0; i < count; ++i)
+			coro_arch_switch(&bench_main_ctx, &bench_peer_ctx);
+		double duration = bench_now() - start;
+		if (r == 0 || duration < best)
+			best = duration;
+	}
+	/* The peer is left suspended, its stack is not used anymore. */
+	free(stack);
+	/* Two switches in each round trip. */
+	return best * 1e9 / (2 * count);
+}
+
+#endif
+
+int
+main(int argc, char **argv)
+{
+	long count = argc > 1 ? atol(argv[1]) : 10000000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	coro_sched_init();
+	double best = 0;
+	long long best_switches = 0;
+	for (int r = 0; r < rounds; ++r) {
+		coro_new(bench_yield_f, &count);
+		coro_new(bench_yield_f, &count);
+		/* The scheduler switches are counted too. */
+		long long switches = -coro_switch_count(coro_this());
+		double start = bench_now();
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL) {
+			switches += coro_switch_count(c);
+			coro_delete(c);
+		}
+		double duration = bench_now() - start;
+		switches += coro_switch_count(coro_this());
+		if (r == 0 || duration / switches < best / best_switches) {
+			best = duration;
+			best_switches = switches;
+		}
+	}
+	printf("%-10s switch: %6.1f ns, %6.1f M switch/s\n", SWITCH_NAME,
+	       best * 1e9 / best_switches, best_switches / best / 1e6);
+#ifdef CORO_SWITCH_ASM
+	double raw = bench_raw_switch(count, rounds);
+	printf("%-10s switch: %6.1f ns, %6.1f M switch/s\n", "raw asm", raw,
+	       1e3 / raw);
+#endif
+	return 0;
+}
@@ -0,0 +1,338 @@
+#define _POSIX_C_SOURCE 200809
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "coro_arch.h"
+
+/** Cached result of the tick counter calibration. */
+static double coro_arch_tick_ns = 0;
+
+static inline uint64_t
+coro_arch_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double
+coro_arch_ns_per_tick(void)
+{
+	if (coro_arch_tick_ns != 0)
+		return coro_arch_tick_ns;
+#if defined(__aarch64__)
+	uint64_t freq;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+	coro_arch_tick_ns = 1e9 / freq;
+#elif defined(__x86_64__)
+	uint64_t ns_start = coro_arch_monotonic_ns();
+	uint64_t ticks_start = coro_arch_ticks();
+	uint64_t ns_end;
+	do {
+		ns_end = coro_arch_monotonic_ns();
+	} while (ns_end - ns_start < 1000000);
+	uint64_t ticks_end = coro_arch_ticks();
+	coro_arch_tick_ns = (double)(ns_end - ns_start) /
+			    (ticks_end - ticks_start);
+#else
+	coro_arch_tick_ns = 1;
+#endif
+	return coro_arch_tick_ns;
+}
+
+#if defined(CORO_BACKEND_TRAMPOLINE)
+
+#if defined(__x86_64__)
+
+/*
+ * rdi - stack top, rsi - function, rdx - argument. The stack is
+ * aligned to 16 bytes, so after 'call' pushes the return address
+ * the callee sees exactly the alignment required by the SysV ABI.
+ * Zero frame pointer terminates backtraces in debuggers.
+ */
+__asm__(
+	"	.text\n"
+	"	.globl	coro_arch_start\n"
+	"	.type	coro_arch_start, @function\n"
+	"coro_arch_start:\n"
+	"	.cfi_startproc\n"
+	"	.cfi_undefined rip\n"
+	"	andq	$-16, %rdi\n"
+	"	movq	%rdi, %rsp\n"
+	"	xorl	%ebp, %ebp\n"
+	"	movq	%rdx, %rdi\n"
+	"	callq	*%rsi\n"
+	"	ud2\n"
+	"	.cfi_endproc\n"
+	"	.size	coro_arch_start, .-coro_arch_start\n"
+);
+
+#ifdef CORO_SWITCH_ASM
+
+/*
+ * rdi - from, rsi - to. Only the registers preserved across calls
+ * by the SysV ABI are saved, the compiler already spilled the
+ * rest around the call. The control bits of MXCSR and the x87
+ * control word are callee-saved too, so a coroutine, which changes
+ * the rounding mode, keeps it to itself. They are in one zeroed
+ * word, so the two contexts are compared at once. The frame is the
+ * same on both stacks, so the CFA offsets are the same after the
+ * swap.
+ */
+__asm__(
+	"	.text\n"
+	"	.globl	coro_arch_switch\n"
+	"	.type	coro_arch_switch, @function\n"
+	"coro_arch_switch:\n"
+	"	.cfi_startproc\n"
+	"	pushq	%rbp\n"
+	"	.cfi_adjust_cfa_offset 8\n"
+	"	pushq	%rbx\n"
+	"	.cfi_adjust_cfa_offset 8\n"
+	"	pushq	%r12\n"
+	"	.cfi_adjust_cfa_offset 8\n"
+	"	pushq	%r13\n"
+	"	.cfi_adjust_cfa_offset 8\n"
+	"	pushq	%r14\n"
+	"	.cfi_adjust_cfa_offset 8\n"
+	"	pushq	%r15\n"
+	"	.cfi_adjust_cfa_offset 8\n"
+	"	pushq	$0\n"
+	"	.cfi_adjust_cfa_offset 8\n"
+	"	fnstcw	(%rsp)\n"
+	"	stmxcsr	4(%rsp)\n"
+	"	movq	(%rsp), %rax\n"
+	"	movq	%rsp, (%rdi)\n"
+	"	movq	(%rsi), %rsp\n"
+	"	cmpq	(%rsp), %rax\n"
+	"	jne	2f\n"
+	"1:\n"
+	"	addq	$8, %rsp\n"
+	"	.cfi_adjust_cfa_offset -8\n"
+	"	popq	%r15\n"
+	"	.cfi_adjust_cfa_offset -8\n"
+	"	popq	%r14\n"
+	"	.cfi_adjust_cfa_offset -8\n"
+	"	popq	%r13\n"
+	"	.cfi_adjust_cfa_offset -8\n"
+	"	popq	%r12\n"
+	"	.cfi_adjust_cfa_offset -8\n"
+	"	popq	%rbx\n"
+	"	.cfi_adjust_cfa_offset -8\n"
+	"	popq	%rbp\n"
+	"	.cfi_adjust_cfa_offset -8\n"
+	"	retq\n"
+	/* The loads are slow, they are skipped, when nothing changed. */
+	"2:\n"
+	"	.cfi_adjust_cfa_offset 56\n"
+	"	fldcw	(%rsp)\n"
+	"	ldmxcsr	4(%rsp)\n"
+	"	jmp	1b\n"
+	"	.cfi_endproc\n"
+	"	.size	coro_arch_switch, .-coro_arch_switch\n"
+);
+
+/*
+ * The first coro_arch_switch() to a prepared context returns
+ * here. r13 - function, r12 - argument.
+ */
+__asm__(
+	"	.text\n"
+	"	.type	coro_arch_entry, @function\n"
+	"coro_arch_entry:\n"
+	"	.cfi_startproc\n"
+	"	.cfi_undefined rip\n"
+	"	movq	%r12, %rdi\n"
+	"	callq	*%r13\n"
+	"	ud2\n"
+	"	.cfi_endproc\n"
+	"	.size	coro_arch_entry, .-coro_arch_entry\n"
+);
+
+enum {
+	/**
+	 * The x87 control word and MXCSR in one word, six
+	 * callee-saved registers and a return address.
+	 */
+	CORO_ARCH_FRAME_WORDS = 8,
+	CORO_ARCH_FRAME_FPU = 0,
+	CORO_ARCH_FRAME_R13 = 3,
+	CORO_ARCH_FRAME_R12 = 4,
+	CORO_ARCH_FRAME_RET = 7,
+};
+
+#endif /* CORO_SWITCH_ASM */
+
+#elif defined(__aarch64__)
+
+/* x0 - stack top, x1 - function, x2 - argument. */
+__asm__(
+	"	.text\n"
+	"	.globl	coro_arch_start\n"
+	"	.type	coro_arch_start, %function\n"
+	"coro_arch_start:\n"
+	"	.cfi_startproc\n"
+	"	.cfi_undefined x30\n"
+	"	and	x0, x0, #~15\n"
+	"	mov	sp, x0\n"
+	"	mov	x29, xzr\n"
+	"	mov	x30, xzr\n"
+	"	mov	x0, x2\n"
+	"	blr	x1\n"
+	"	brk	#0\n"
+	"	.cfi_endproc\n"
+	"	.size	coro_arch_start, .-coro_arch_start\n"
+);
+
+#ifdef CORO_SWITCH_ASM
+
+/*
+ * x0 - from, x1 - to. x19-x30 and the low halves of d8-d15 are
+ * callee-saved in AAPCS64.
+ */
+__asm__(
+	"	.text\n"
+	"	.globl	coro_arch_switch\n"
+	"	.type	coro_arch_switch, %function\n"
+	"coro_arch_switch:\n"
+	"	.cfi_startproc\n"
+	"	sub	sp, sp, #160\n"
+	"	stp	x19, x20, [sp, #0]\n"
+	"	stp	x21, x22, [sp, #16]\n"
+	"	stp	x23, x24, [sp, #32]\n"
+	"	stp	x25, x26, [sp, #48]\n"
+	"	stp	x27, x28, [sp, #64]\n"
+	"	stp	x29, x30, [sp, #80]\n"
+	"	stp	d8, d9, [sp, #96]\n"
+	"	stp	d10, d11, [sp, #112]\n"
+	"	stp	d12, d13, [sp, #128]\n"
+	"	stp	d14, d15, [sp, #144]\n"
+	"	mov	x9, sp\n"
+	"	str	x9, [x0]\n"
+	"	ldr	x9, [x1]\n"
+	"	mov	sp, x9\n"
+	"	ldp	x19, x20, [sp, #0]\n"
+	"	ldp	x21, x22, [sp, #16]\n"
+	"	ldp	x23, x24, [sp, #32]\n"
+	"	ldp	x25, x26, [sp, #48]\n"
+	"	ldp	x27, x28, [sp, #64]\n"
+	"	ldp	x29, x30, [sp, #80]\n"
+	"	ldp	d8, d9, [sp, #96]\n"
+	"	ldp	d10, d11, [sp, #112]\n"
+	"	ldp	d12, d13, [sp, #128]\n"
+	"	ldp	d14, d15, [sp, #144]\n"
+	"	add	sp, sp, #160\n"
+	"	ret\n"
+	"	.cfi_endproc\n"
+	"	.size	coro_arch_switch, .-coro_arch_switch\n"
+);
+
+/*
+ * The first coro_arch_switch() to a prepared context returns
+ * here. x19 - function, x20 - argument.
+ */
+__asm__(
+	"	.text\n"
+	"	.type	coro_arch_entry, %function\n"
+	"coro_arch_entry:\n"
+	"	.cfi_startproc\n"
+	"	.cfi_undefined x30\n"
+	"	mov	x0, x20\n"
+	"	blr	x19\n"
+	"	brk	#0\n"
+	"	.cfi_endproc\n"
+	"	.size	coro_arch_entry, .-coro_arch_entry\n"
+);
+
+enum {
+	/** x19-x30 and d8-d15. */
+	CORO_ARCH_FRAME_WORDS = 20,
+	CORO_ARCH_FRAME_X19 = 0,
+	CORO_ARCH_FRAME_X20 = 1,
+	CORO_ARCH_FRAME_X30 = 11,
+};
+
+#endif /* CORO_SWITCH_ASM */
+
+#endif
+
+#ifdef CORO_SWITCH_ASM
+
+extern char coro_arch_entry[];
+
+void
+coro_arch_prepare(struct coro_arch_ctx *ctx, void *stack_top,
+		  coro_arch_f func, void *arg)
+{
+	uintptr_t top = (uintptr_t)stack_top & ~(uintptr_t)15;
+	uintptr_t *frame = (uintptr_t *)top - CORO_ARCH_FRAME_WORDS;
+	for (int i = 0; i < CORO_ARCH_FRAME_WORDS; ++i)
+		frame[i] = 0;
+#if defined(__x86_64__)
+	/* The new coroutine starts with the modes of its creator. */
+	uint16_t fpu_cw;
+	uint32_t mxcsr;
+	__asm__ __volatile__("fnstcw %0\n\tstmxcsr %1"
+			     : "=m"(fpu_cw), "=m"(mxcsr));
+	frame[CORO_ARCH_FRAME_FPU] = (uintptr_t)mxcsr << 32 | fpu_cw;
+	frame[CORO_ARCH_FRAME_R13] = (uintptr_t)func;
+	frame[CORO_ARCH_FRAME_R12] = (uintptr_t)arg;
+	frame[CORO_ARCH_FRAME_RET] = (uintptr_t)coro_arch_entry;
+#else
+	frame[CORO_ARCH_FRAME_X19] = (uintptr_t)func;
+	frame[CORO_ARCH_FRAME_X20] = (uintptr_t)arg;
+	frame[CORO_ARCH_FRAME_X30] = (uintptr_t)coro_arch_entry;
+#endif
+	ctx->sp = frame;
+}
+
+#endif /* CORO_SWITCH_ASM */
+
+#elif defined(CORO_BACKEND_UCONTEXT)
+
+#include <ucontext.h>
+
+/**
+ * makecontext() accepts only int arguments, so the pointers are
+ * passed as halves.
+ */
+static void
+coro_arch_trampoline(unsigned func_hi, unsigned func_lo, unsigned arg_hi,
+		     unsigned arg_lo)
+{
+	coro_arch_f func = (coro_arch_f)(uintptr_t)
+		(((uint64_t)func_hi << 32) | func_lo);
+	void *arg = (void *)(uintptr_t)(((uint64_t)arg_hi << 32) | arg_lo);
+	func(arg);
+	abort();
+}
+
+void
+coro_arch_start(void *stack_top, coro_arch_f func, void *arg)
+{
+	/*
+	 * The context is needed only until setcontext() loads it,
+	 * so it can live on the current stack.
+	 */
+	ucontext_t uc;
+	if (getcontext(&uc) != 0)
+		abort();
+	/*
+	 * Stack bottom is not known here, but makecontext() only
+	 * needs the top. Give it a small fake size below the top -
+	 * the coroutine is free to grow further down.
+	 */
+	const size_t reserve = 4096;
+	uc.uc_stack.ss_sp = (char *)stack_top - reserve;
+	uc.uc_stack.ss_size = reserve;
+	uc.uc_link = NULL;
+	uint64_t f = (uint64_t)(uintptr_t)func;
+	uint64_t a = (uint64_t)(uintptr_t)arg;
+	makecontext(&uc, (void (*)(void))coro_arch_trampoline, 4,
+		    (unsigned)(f >> 32), (unsigned)f, (unsigned)(a >> 32),
+		    (unsigned)a);
+	setcontext(&uc);
+	abort();
+}
+
+#endif
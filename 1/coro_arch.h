@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#elif !defined(__aarch64__)
+#include <time.h>
+#endif
+
+/**
+ * Architecture dependent part of libcoro. It knows how to start
+ * a function on a fresh stack and how to switch between stacks
+ * without any syscalls.
+ */
+
+/**
+ * Coroutine creation backend. Can be chosen at build time with
+ * one of the macros:
+ *
+ * - CORO_BACKEND_TRAMPOLINE - a tiny assembly trampoline switches
+ *   the stack pointer and calls the coroutine body. Zero
+ *   syscalls. Available on x86-64 and aarch64;
+ *
+ * - CORO_BACKEND_UCONTEXT - makecontext()/setcontext(). Portable,
+ *   but setcontext() restores the signal mask - one syscall;
+ *
+ * - CORO_BACKEND_SIGNAL - the original sigaltstack() + raise()
+ *   trick. About ten syscalls per coroutine.
+ *
+ * When nothing is specified, the fastest available one is used.
+ */
+#if !defined(CORO_BACKEND_TRAMPOLINE) && \
+    !defined(CORO_BACKEND_UCONTEXT) && \
+    !defined(CORO_BACKEND_SIGNAL)
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CORO_BACKEND_TRAMPOLINE
+#else
+#define CORO_BACKEND_UCONTEXT
+#endif
+#endif
+
+#if defined(CORO_BACKEND_TRAMPOLINE) && \
+    !defined(__x86_64__) && !defined(__aarch64__)
+#error "CORO_BACKEND_TRAMPOLINE is supported on x86-64 and aarch64 only"
+#endif
+
+/**
+ * Context switch method. Can be chosen at build time with one of
+ * the macros:
+ *
+ * - CORO_SWITCH_ASM - save callee-saved registers and the stack
+ *   pointer, load another set, return. Only what a cooperative
+ *   switch needs, a few nanoseconds. Requires the trampoline
+ *   backend;
+ *
+ * - CORO_SWITCH_SIGJMP - sigsetjmp()/siglongjmp(). Saves much
+ *   more state, but works everywhere.
+ */
+#if !defined(CORO_SWITCH_ASM) && !defined(CORO_SWITCH_SIGJMP)
+#ifdef CORO_BACKEND_TRAMPOLINE
+#define CORO_SWITCH_ASM
+#else
+#define CORO_SWITCH_SIGJMP
+#endif
+#endif
+
+#if defined(CORO_SWITCH_ASM) && !defined(CORO_BACKEND_TRAMPOLINE)
+#error "CORO_SWITCH_ASM requires CORO_BACKEND_TRAMPOLINE"
+#endif
+
+typedef void (*coro_arch_f)(void *);
+
+/**
+ * Switch the stack pointer to @a stack_top and call @a func with
+ * @a arg there. The function must never return, because there is
+ * no caller frame on the new stack.
+ * @param stack_top End of the stack memory. It is aligned down
+ *        to 16 bytes inside.
+ * @param func Function to call on the new stack.
+ * @param arg Argument for @a func.
+ */
+void
+coro_arch_start(void *stack_top, coro_arch_f func, void *arg)
+	__attribute__((noreturn));
+
+#ifdef CORO_SWITCH_ASM
+
+/**
+ * Saved context of a suspended coroutine. All the registers are
+ * stored on its own stack, so only the stack pointer is left.
+ */
+struct coro_arch_ctx {
+	void *sp;
+};
+
+/**
+ * Build an initial context on a fresh stack. The first switch to
+ * it calls @a func with @a arg. As with coro_arch_start(), the
+ * function must never return.
+ */
+void
+coro_arch_prepare(struct coro_arch_ctx *ctx, void *stack_top,
+		  coro_arch_f func, void *arg);
+
+/**
+ * Save the callee-saved registers into @a from and load them from
+ * @a to. Returns, when something switches back to @a from.
+ */
+void
+coro_arch_switch(struct coro_arch_ctx *from, struct coro_arch_ctx *to);
+
+#endif /* CORO_SWITCH_ASM */
+
+/**
+ * Read a cheap monotonic tick counter: TSC on x86-64, the virtual
+ * counter on aarch64, clock_gettime() in nanoseconds elsewhere.
+ * It costs a few nanoseconds and no syscalls, so can be read on
+ * every context switch and in hot loops.
+ */
+static inline uint64_t
+coro_arch_ticks(void)
+{
+#if defined(__x86_64__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Nanoseconds in one tick of coro_arch_ticks(). TSC frequency is
+ * not reported by the CPU, so the first call measures it against
+ * CLOCK_MONOTONIC for a millisecond.
+ */
+double
+coro_arch_ns_per_tick(void);
@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+#include "coro_io.h"
+#include "libcoro.h"
+#include "coro_arch.h"
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+enum {
+	/** Submission queue size. The completion one is twice larger. */
+	CORO_URING_ENTRIES = 256,
+	/** Events taken from epoll at once. */
+	CORO_EPOLL_EVENTS = 64,
+	/** How often epoll is checked without blocking. */
+	CORO_EPOLL_PERIOD_USEC = 50,
+};
+
+/** An operation, a coroutine waits for. Lives on its stack. */
+struct coro_io_op {
+	/** Result of the syscall for io_uring, events for epoll. */
+	int res;
+	bool is_done;
+	/** The waiting coroutine. */
+	struct coro_queue waiters;
+};
+
+/** Rings of io_uring, mapped from the kernel. */
+struct coro_uring {
+	int fd;
+	/** The kernel takes the submissions from the head. */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	/** Indexes of the SQEs in the order of submission. */
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	/** Filled, but not submitted yet SQEs. */
+	unsigned to_submit;
+	/** The kernel adds the completions at the tail. */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	/** The same as sq_ptr, if the kernel maps both at once. */
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+/** I/O engine of a scheduler. */
+struct coro_io {
+	/** Is polled by the scheduler. */
+	struct coro_poller base;
+	enum coro_io_engine engine;
+	struct coro_uring uring;
+	int epoll_fd;
+	/** When epoll can be checked without blocking again. */
+	uint64_t epoll_next_poll;
+	/** CORO_EPOLL_PERIOD_USEC in ticks. */
+	uint64_t epoll_period;
+};
+
+static inline void
+coro_io_op_create(struct coro_io_op *op)
+{
+	op->res = 0;
+	op->is_done = false;
+	coro_queue_create(&op->waiters);
+}
+
+/** Sleep until the scheduler reaps the completion of @a op. */
+static int
+coro_io_wait(struct coro_io *io, struct coro_io_op *op)
+{
+	++io->base.pending;
+	while (! op->is_done)
+		coro_wait(&op->waiters);
+	return op->res;
+}
+
+static void
+coro_io_complete(struct coro_io *io, struct coro_io_op *op, int res)
+{
+	op->res = res;
+	op->is_done = true;
+	--io->base.pending;
+	coro_wakeup(&op->waiters);
+}
+
+static void
+coro_uring_destroy(struct coro_uring *r)
+{
+	if (r->sqes != NULL)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	if (r->sq_ptr != NULL)
+		munmap(r->sq_ptr, r->sq_size);
+	close(r->fd);
+}
+
+/**
+ * Set up io_uring with raw syscalls, there is no liburing.
+ * @retval 0 Success.
+ * @retval -1 The kernel does not support it, errno is set.
+ */
+static int
+coro_uring_create(struct coro_uring *r)
+{
+	memset(r, 0, sizeof(*r));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, CORO_URING_ENTRIES, &p);
+	if (r->fd < 0)
+		return -1;
+	/*
+	 * Offset -1 should mean the current file position, and the
+	 * wait should take a timeout for the timers of the scheduler.
+	 */
+	if ((p.features & IORING_FEAT_RW_CUR_POS) == 0 ||
+	    (p.features & IORING_FEAT_EXT_ARG) == 0) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes +
+		     p.cq_entries * sizeof(struct io_uring_cqe);
+	bool is_single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (is_single_mmap && r->cq_size > r->sq_size)
+		r->sq_size = r->cq_size;
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto error;
+	}
+	if (is_single_mmap) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto error;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe *)
+		mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto error;
+	}
+	char *sq = (char *)r->sq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	char *cq = (char *)r->cq_ptr;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+error:
+	coro_uring_destroy(r);
+	return -1;
+}
+
+/** Wake up the coroutines of the completions. Returns how many. */
+static int
+coro_uring_reap(struct coro_io *io)
+{
+	struct coro_uring *r = &io->uring;
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	int count = 0;
+	for (; head != tail; ++head, ++count) {
+		struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+		coro_io_complete(io, (struct coro_io_op *)(uintptr_t)
+				 cqe->user_data, cqe->res);
+	}
+	/* The kernel can reuse the entries after that. */
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/**
+ * Submit the new SQEs and reap the completions. The completions
+ * are in the shared memory, so the syscall is needed only to
+ * submit or to sleep.
+ */
+static void
+coro_uring_poll(struct coro_io *io, uint64_t timeout)
+{
+	struct coro_uring *r = &io->uring;
+	if (coro_uring_reap(io) > 0)
+		timeout = 0;
+	if (r->to_submit == 0 && timeout == 0)
+		return;
+	unsigned flags = 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (timeout != 0) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout != CORO_TIMEOUT_INFINITE) {
+			ts.tv_sec = timeout / 1000000;
+			ts.tv_nsec = timeout % 1000000 * 1000;
+			arg.ts = (uintptr_t)&ts;
+		}
+	}
+	int rc = syscall(__NR_io_uring_enter, r->fd, r->to_submit,
+			 timeout != 0 ? 1 : 0, flags, &arg, sizeof(arg));
+	if (rc >= 0)
+		r->to_submit -= rc;
+	else if (errno != EINTR && errno != EAGAIN && errno != EBUSY &&
+		 errno != ETIME)
+		handle_error();
+	/* On EBUSY the completions should be reaped to retry. */
+	coro_uring_reap(io);
+}
+
+static inline void
+coro_uring_prep(struct io_uring_sqe *sqe, int opcode, int fd)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+}
+
+/** Queue a copy of @a sqe and wait for its completion. */
+static int
+coro_uring_submit_wait(struct coro_io *io, struct io_uring_sqe *sqe)
+{
+	struct coro_uring *r = &io->uring;
+	struct coro_io_op op;
+	coro_io_op_create(&op);
+	sqe->user_data = (uintptr_t)&op;
+	unsigned tail;
+	while (true) {
+		tail = *r->sq_tail;
+		unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head <= r->sq_mask)
+			break;
+		/* Only if the kernel refuses to take them, retry later. */
+		coro_uring_poll(io, 0);
+		coro_yield();
+	}
+	unsigned idx = tail & r->sq_mask;
+	r->sqes[idx] = *sqe;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++r->to_submit;
+	return coro_io_wait(io, &op);
+}
+
+/**
+ * Queue a copy of @a sqe and wait for its completion. It is
+ * submitted by the scheduler, when the coroutine is switched out,
+ * together with the others queued meanwhile.
+ *
+ * An operation, which doesn't complete at once, goes to a worker
+ * thread of io_uring. It is canceled, if the worker can't be
+ * created, because a signal, like the preemption one, is pending.
+ * Then nothing is done yet, and it is submitted again.
+ * @return The syscall result, or -1 with errno.
+ */
+static int
+coro_uring_call(struct coro_io *io, struct io_uring_sqe *sqe)
+{
+	int res;
+	do
+		res = coro_uring_submit_wait(io, sqe);
+	while (res == -ECANCELED || res == -EINTR);
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+/**
+ * Wait until @a fd is ready for @a events. Returns without waiting,
+ * if it can't be waited for. Then the syscall is done anyway and
+ * reports the error, or blocks, if it is a regular file.
+ */
+static void
+coro_epoll_wait(struct coro_io *io, int fd, uint32_t events)
+{
+	struct coro_io_op op;
+	coro_io_op_create(&op);
+	struct epoll_event ev;
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = &op;
+	while (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		if (errno != EEXIST)
+			return;
+		/* Another coroutine waits for it, let it finish. */
+		coro_yield();
+	}
+	coro_io_wait(io, &op);
+	epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void
+coro_epoll_poll(struct coro_io *io, uint64_t timeout)
+{
+	/* Unlike io_uring each check is a syscall, don't do it often. */
+	if (timeout == 0) {
+		uint64_t now = coro_arch_ticks();
+		if (now < io->epoll_next_poll)
+			return;
+		io->epoll_next_poll = now + io->epoll_period;
+	}
+	struct epoll_event events[CORO_EPOLL_EVENTS];
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000000;
+	ts.tv_nsec = timeout % 1000000 * 1000;
+	int count = epoll_pwait2(io->epoll_fd, events, CORO_EPOLL_EVENTS,
+				 timeout == CORO_TIMEOUT_INFINITE ? NULL : &ts,
+				 NULL);
+	if (count < 0 && errno == ENOSYS) {
+		/* Before Linux 5.11, in milliseconds. */
+		int ms = -1;
+		if (timeout != CORO_TIMEOUT_INFINITE)
+			ms = timeout / 1000 >= INT_MAX ? INT_MAX :
+			     (int)((timeout + 999) / 1000);
+		count = epoll_wait(io->epoll_fd, events, CORO_EPOLL_EVENTS,
+				   ms);
+	}
+	if (count < 0 && errno != EINTR)
+		handle_error();
+	for (int i = 0; i < count; ++i) {
+		coro_io_complete(io, (struct coro_io_op *)events[i].data.ptr,
+				 events[i].events);
+	}
+}
+
+static void
+coro_io_poll(struct coro_poller *p, uint64_t timeout)
+{
+	struct coro_io *io = (struct coro_io *)p;
+	if (io->engine == CORO_IO_URING)
+		coro_uring_poll(io, timeout);
+	else
+		coro_epoll_poll(io, timeout);
+}
+
+static void
+coro_io_delete(struct coro_poller *p)
+{
+	struct coro_io *io = (struct coro_io *)p;
+	if (io->engine == CORO_IO_URING)
+		coro_uring_destroy(&io->uring);
+	else if (io->engine == CORO_IO_EPOLL)
+		close(io->epoll_fd);
+	free(io);
+}
+
+/** Create the best engine the kernel supports. */
+static struct coro_io *
+coro_io_new(void)
+{
+	struct coro_io *io = (struct coro_io *) calloc(1, sizeof(*io));
+	if (io == NULL)
+		return NULL;
+	io->base.poll = coro_io_poll;
+	io->base.destroy = coro_io_delete;
+	io->base.pending = 0;
+#ifdef CORO_IO_NO_URING
+	bool use_uring = false;
+#else
+	bool use_uring = true;
+#endif
+	if (use_uring && coro_uring_create(&io->uring) == 0) {
+		io->engine = CORO_IO_URING;
+		return io;
+	}
+	io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (io->epoll_fd >= 0) {
+		io->engine = CORO_IO_EPOLL;
+		io->epoll_period = (uint64_t)(CORO_EPOLL_PERIOD_USEC * 1000.0 /
+					      coro_arch_ns_per_tick());
+		return io;
+	}
+	io->engine = CORO_IO_BLOCKING;
+	return io;
+}
+
+/**
+ * Engine of the current scheduler. NULL, if the calls should just
+ * block: with worker threads, or if the scheduler polls something
+ * else.
+ */
+static struct coro_io *
+coro_io_current(void)
+{
+	if (coro_sched_workers() > 0)
+		return NULL;
+	struct coro_poller *p = coro_sched_poller();
+	if (p != NULL)
+		return p->poll == coro_io_poll ? (struct coro_io *)p : NULL;
+	struct coro_io *io = coro_io_new();
+	if (io != NULL)
+		coro_sched_set_poller(&io->base);
+	return io;
+}
+
+void
+coro_io_destroy(void)
+{
+	struct coro_poller *p = coro_sched_poller();
+	if (p == NULL || p->poll != coro_io_poll)
+		return;
+	assert(p->pending == 0);
+	coro_sched_set_poller(NULL);
+	coro_io_delete(p);
+}
+
+enum coro_io_engine
+coro_io_engine(void)
+{
+	struct coro_io *io = coro_io_current();
+	return io != NULL ? io->engine : CORO_IO_BLOCKING;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	struct coro_io *io = coro_io_current();
+	if (io == NULL || io->engine == CORO_IO_BLOCKING)
+		return read(fd, buf, size);
+	if (io->engine == CORO_IO_EPOLL) {
+		coro_epoll_wait(io, fd, EPOLLIN);
+		return read(fd, buf, size);
+	}
+	struct io_uring_sqe sqe;
+	coro_uring_prep(&sqe, IORING_OP_READ, fd);
+	sqe.addr = (uintptr_t)buf;
+	/* read(2) does not return more anyway. */
+	sqe.len = size > INT_MAX ? INT_MAX : size;
+	sqe.off = (uint64_t)-1;
+	return coro_uring_call(io, &sqe);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	struct coro_io *io = coro_io_current();
+	if (io == NULL || io->engine == CORO_IO_BLOCKING)
+		return write(fd, buf, size);
+	if (io->engine == CORO_IO_EPOLL) {
+		coro_epoll_wait(io, fd, EPOLLOUT);
+		return write(fd, buf, size);
+	}
+	struct io_uring_sqe sqe;
+	coro_uring_prep(&sqe, IORING_OP_WRITE, fd);
+	sqe.addr = (uintptr_t)buf;
+	sqe.len = size > INT_MAX ? INT_MAX : size;
+	sqe.off = (uint64_t)-1;
+	return coro_uring_call(io, &sqe);
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct coro_io *io = coro_io_current();
+	if (io == NULL || io->engine == CORO_IO_BLOCKING)
+		return accept(fd, addr, addrlen);
+	if (io->engine == CORO_IO_EPOLL) {
+		coro_epoll_wait(io, fd, EPOLLIN);
+		return accept(fd, addr, addrlen);
+	}
+	struct io_uring_sqe sqe;
+	coro_uring_prep(&sqe, IORING_OP_ACCEPT, fd);
+	sqe.addr = (uintptr_t)addr;
+	sqe.addr2 = (uintptr_t)addrlen;
+	return coro_uring_call(io, &sqe);
+}
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct coro_io *io = coro_io_current();
+	if (io == NULL || io->engine == CORO_IO_BLOCKING)
+		return connect(fd, addr, addrlen);
+	if (io->engine == CORO_IO_URING) {
+		struct io_uring_sqe sqe;
+		coro_uring_prep(&sqe, IORING_OP_CONNECT, fd);
+		sqe.addr = (uintptr_t)addr;
+		sqe.off = addrlen;
+		return coro_uring_call(io, &sqe);
+	}
+	if (connect(fd, addr, addrlen) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+	coro_epoll_wait(io, fd, EPOLLOUT);
+	int err;
+	socklen_t len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+		return -1;
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**
+ * I/O, which blocks only the calling coroutine. The operation is
+ * submitted to io_uring, and the coroutine waits until the
+ * scheduler reaps its completion, while the others run. Without
+ * io_uring the coroutine waits for the descriptor readiness in
+ * epoll, and then does the syscall. Regular files are always
+ * ready for epoll, so there they block the whole thread, like
+ * with worker threads, where all the calls are plain syscalls.
+ *
+ * Build with CORO_IO_NO_URING to use epoll even if io_uring works.
+ *
+ * The results are as of the syscalls: -1 and errno on error. A
+ * coroutine can't be deleted while it waits for I/O.
+ */
+
+/** How the current scheduler does I/O. */
+enum coro_io_engine {
+	/** Plain blocking syscalls. */
+	CORO_IO_BLOCKING,
+	CORO_IO_URING,
+	CORO_IO_EPOLL,
+};
+
+/**
+ * The engine the I/O of the current coroutine goes through. It is
+ * created per scheduler on the first call.
+ */
+enum coro_io_engine
+coro_io_engine(void);
+
+/**
+ * Free the engine of the current scheduler. No coroutine should
+ * wait for I/O. A new one is created on the next call. Is done by
+ * coro_sched_delete() too.
+ */
+void
+coro_io_destroy(void);
+
+/** read(2) from the current file position. */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** write(2) at the current file position. */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/** accept(2) a connection on a listening socket. */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * connect(2) a socket. With epoll only a non-blocking socket is
+ * connected without blocking the thread.
+ */
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Run queue of a worker thread. Only the owner adds coroutines,
+ * at the tail, but anybody can take them from the head with a
+ * CAS: the owner - to run them, idle workers - to steal. So there
+ * are no locks, and the owner keeps the FIFO order, which yield
+ * relies on. A Chase-Lev deque would give the owner the LIFO end,
+ * and a yielding coroutine would be taken back right away.
+ *
+ * The queue is bounded. When it is full, the owner puts the
+ * coroutine into a shared queue under a lock instead.
+ */
+
+struct coro;
+
+enum {
+	/** Power of 2, so the indexes can wrap around. */
+	CORO_RUNQ_SIZE = 256,
+};
+
+struct coro_runq {
+	/** Next to take. Moved by everybody. */
+	_Atomic uint32_t head;
+	/** Next free slot. Moved only by the owner. */
+	_Atomic uint32_t tail;
+	_Atomic(struct coro *) buf[CORO_RUNQ_SIZE];
+};
+
+static inline void
+coro_runq_create(struct coro_runq *q)
+{
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+static inline bool
+coro_runq_is_empty(struct coro_runq *q)
+{
+	return atomic_load_explicit(&q->head, memory_order_relaxed) ==
+	       atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
+
+/**
+ * Add a coroutine to the tail. Only for the owner.
+ * @retval true Success.
+ * @retval false The queue is full.
+ */
+static inline bool
+coro_runq_push(struct coro_runq *q, struct coro *c)
+{
+	uint32_t h = atomic_load_explicit(&q->head, memory_order_acquire);
+	uint32_t t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	if (t - h >= CORO_RUNQ_SIZE)
+		return false;
+	atomic_store_explicit(&q->buf[t % CORO_RUNQ_SIZE], c,
+			      memory_order_relaxed);
+	/* Publish the coroutine together with its saved context. */
+	atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+	return true;
+}
+
+/** Take a coroutine from the head. NULL, if empty. Thread-safe. */
+static inline struct coro *
+coro_runq_pop(struct coro_runq *q)
+{
+	uint32_t h = atomic_load_explicit(&q->head, memory_order_acquire);
+	while (true) {
+		uint32_t t = atomic_load_explicit(&q->tail,
+						  memory_order_acquire);
+		if (h == t)
+			return NULL;
+		struct coro *c = atomic_load_explicit(
+			&q->buf[h % CORO_RUNQ_SIZE], memory_order_relaxed);
+		/*
+		 * If the slot was reused meanwhile, the head has moved
+		 * too, and the CAS fails.
+		 */
+		if (atomic_compare_exchange_weak_explicit(
+			&q->head, &h, h + 1, memory_order_acq_rel,
+			memory_order_acquire))
+			return c;
+	}
+}
+
+/**
+ * Move a half of the @a victim coroutines into the empty queue
+ * @a q of the caller. Moving many at once makes stealing rare.
+ * @return One of the stolen coroutines to run right away, or NULL,
+ *         if the victim had nothing.
+ */
+static inline struct coro *
+coro_runq_steal(struct coro_runq *q, struct coro_runq *victim)
+{
+	uint32_t qt = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	while (true) {
+		uint32_t h = atomic_load_explicit(&victim->head,
+						  memory_order_acquire);
+		uint32_t t = atomic_load_explicit(&victim->tail,
+						  memory_order_acquire);
+		uint32_t n = t - h;
+		n -= n / 2;
+		if (n == 0)
+			return NULL;
+		/* The head and the tail were read at different times. */
+		if (n > CORO_RUNQ_SIZE / 2)
+			continue;
+		for (uint32_t i = 0; i < n; ++i) {
+			struct coro *c = atomic_load_explicit(
+				&victim->buf[(h + i) % CORO_RUNQ_SIZE],
+				memory_order_relaxed);
+			atomic_store_explicit(
+				&q->buf[(qt + i) % CORO_RUNQ_SIZE], c,
+				memory_order_relaxed);
+		}
+		if (! atomic_compare_exchange_strong_explicit(
+			&victim->head, &h, h + n, memory_order_acq_rel,
+			memory_order_acquire))
+			continue;
+		/* The last one is not published - it runs now. */
+		struct coro *c = atomic_load_explicit(
+			&q->buf[(qt + n - 1) % CORO_RUNQ_SIZE],
+			memory_order_relaxed);
+		if (n > 1) {
+			atomic_store_explicit(&q->tail, qt + n - 1,
+					      memory_order_release);
+		}
+		return c;
+	}
+}
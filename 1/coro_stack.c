@@ -0,0 +1,221 @@
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "coro_stack.h"
+#include "libcoro.h"
+
+enum {
+	/**
+	 * Stacks are pooled by size classes, each class is a power
+	 * of 2 number of pages.
+	 */
+	CORO_STACK_CLASS_COUNT = 32,
+	/** By default that many idle stacks can be kept per class. */
+	CORO_STACK_POOL_MAX_IDLE = 1024,
+	/** Byte to paint the stacks with. */
+	CORO_STACK_PAINT = 0xa5,
+};
+
+/**
+ * Link of an idle stack in the pool. It is stored in the top of
+ * the stack itself, so the pool needs no memory of its own. Only
+ * that last page stays resident while the stack is idle.
+ */
+struct coro_stack_idle {
+	struct coro_stack_idle *next;
+	struct coro_stack stack;
+};
+
+/** Idle stacks of one size class. */
+struct coro_stack_class {
+	struct coro_stack_idle *head;
+	int count;
+};
+
+static struct coro_stack_class coro_stack_classes[CORO_STACK_CLASS_COUNT];
+static int coro_stack_max_idle = CORO_STACK_POOL_MAX_IDLE;
+static struct coro_stack_stats coro_stack_stat;
+static size_t coro_page_size = 0;
+/** The stacks are created and freed by the worker threads too. */
+static pthread_mutex_t coro_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Guard page of the last stack mapped with a guard. */
+static char *coro_stack_last_guard = NULL;
+
+static size_t
+coro_stack_page_size(void)
+{
+	if (coro_page_size == 0)
+		coro_page_size = sysconf(_SC_PAGESIZE);
+	return coro_page_size;
+}
+
+/**
+ * Round @a size up to a size class and return its index.
+ * @param[in][out] size Requested size, becomes the class size.
+ */
+static int
+coro_stack_class(size_t *size)
+{
+	size_t page = coro_stack_page_size();
+	size_t class_size = page;
+	int i = 0;
+	while (class_size < *size && i < CORO_STACK_CLASS_COUNT - 1) {
+		class_size *= 2;
+		++i;
+	}
+	if (class_size < *size)
+		return -1;
+	*size = class_size;
+	return i;
+}
+
+int
+coro_stack_create(struct coro_stack *stack, size_t size)
+{
+	int cls = coro_stack_class(&size);
+	if (cls < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct coro_stack_class *c = &coro_stack_classes[cls];
+	pthread_mutex_lock(&coro_stack_lock);
+	if (c->head != NULL) {
+		struct coro_stack_idle *idle = c->head;
+		c->head = idle->next;
+		--c->count;
+		*stack = idle->stack;
+		++coro_stack_stat.hits;
+		--coro_stack_stat.idle;
+		++coro_stack_stat.used;
+		pthread_mutex_unlock(&coro_stack_lock);
+		return 0;
+	}
+	size_t page = coro_stack_page_size();
+	char *map = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			 MAP_STACK, -1, 0);
+	/*
+	 * Each guard page costs a separate kernel mapping, and their
+	 * count is limited (vm.max_map_count). When the limit is hit,
+	 * the stack still works, but without the guard. The limit can
+	 * be hit by mmap() too - then the new mapping is right below
+	 * the previous guard and can't merge with it. Drop that guard
+	 * to let it merge.
+	 */
+	if (map == MAP_FAILED && errno == ENOMEM &&
+	    coro_stack_last_guard != NULL &&
+	    mprotect(coro_stack_last_guard, page,
+		     PROT_READ | PROT_WRITE) == 0) {
+		coro_stack_last_guard = NULL;
+		++coro_stack_stat.unguarded;
+		map = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			   MAP_STACK, -1, 0);
+	}
+	if (map == MAP_FAILED) {
+		pthread_mutex_unlock(&coro_stack_lock);
+		return -1;
+	}
+	if (mprotect(map, page, PROT_NONE) == 0)
+		coro_stack_last_guard = map;
+	else
+		++coro_stack_stat.unguarded;
+	stack->base = map + page;
+	stack->size = size;
+	++coro_stack_stat.misses;
+	++coro_stack_stat.used;
+	pthread_mutex_unlock(&coro_stack_lock);
+	return 0;
+}
+
+/** Unmap a stack with its guard page. Under the pool lock. */
+static void
+coro_stack_unmap(struct coro_stack *stack)
+{
+	char *map = (char *)stack->base - coro_stack_page_size();
+	if (map == coro_stack_last_guard)
+		coro_stack_last_guard = NULL;
+	munmap(map, stack->size + coro_stack_page_size());
+}
+
+void
+coro_stack_destroy(struct coro_stack *stack)
+{
+	size_t size = stack->size;
+	int cls = coro_stack_class(&size);
+	struct coro_stack_class *c = &coro_stack_classes[cls];
+	size_t page = coro_stack_page_size();
+	pthread_mutex_lock(&coro_stack_lock);
+	--coro_stack_stat.used;
+	if (c->count >= coro_stack_max_idle) {
+		coro_stack_unmap(stack);
+		pthread_mutex_unlock(&coro_stack_lock);
+		return;
+	}
+	pthread_mutex_unlock(&coro_stack_lock);
+	/*
+	 * Everything except the top page is dropped. The next user
+	 * gets zero pages on demand.
+	 */
+	madvise(stack->base, stack->size - page, MADV_DONTNEED);
+	struct coro_stack_idle *idle = (struct coro_stack_idle *)
+		((char *)coro_stack_top(stack) - sizeof(*idle));
+	idle->stack = *stack;
+	pthread_mutex_lock(&coro_stack_lock);
+	idle->next = c->head;
+	c->head = idle;
+	++c->count;
+	++coro_stack_stat.idle;
+	pthread_mutex_unlock(&coro_stack_lock);
+}
+
+void
+coro_stack_paint(struct coro_stack *stack)
+{
+	memset(stack->base, CORO_STACK_PAINT, stack->size);
+}
+
+size_t
+coro_stack_used(const struct coro_stack *stack)
+{
+	const unsigned char *pos = stack->base;
+	const unsigned char *end = pos + stack->size;
+	/*
+	 * The stack grows down, so the first not painted byte
+	 * from the bottom is the deepest one ever written.
+	 */
+	while (pos < end && *pos == CORO_STACK_PAINT)
+		++pos;
+	return end - pos;
+}
+
+void
+coro_stack_pool_set_max_idle(int count)
+{
+	pthread_mutex_lock(&coro_stack_lock);
+	coro_stack_max_idle = count < 0 ? 0 : count;
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro_stack_class *c = &coro_stack_classes[i];
+		while (c->count > coro_stack_max_idle) {
+			struct coro_stack_idle *idle = c->head;
+			struct coro_stack stack = idle->stack;
+			c->head = idle->next;
+			--c->count;
+			--coro_stack_stat.idle;
+			coro_stack_unmap(&stack);
+		}
+	}
+	pthread_mutex_unlock(&coro_stack_lock);
+}
+
+void
+coro_stack_pool_stats(struct coro_stack_stats *stats)
+{
+	pthread_mutex_lock(&coro_stack_lock);
+	*stats = coro_stack_stat;
+	pthread_mutex_unlock(&coro_stack_lock);
+}
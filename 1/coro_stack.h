@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Coroutine stacks. They are mapped with mmap() right below a
+ * guard page, so an overflow crashes with SIGSEGV instead of
+ * silently corrupting the neighbour memory. Deleted stacks are
+ * returned into a pool and reused by next coroutines. Memory of
+ * the idle stacks is given back to the kernel with madvise(), but
+ * the mappings are kept.
+ */
+
+struct coro_stack {
+	/** The lowest usable address. */
+	void *base;
+	/** Usable size, without the guard page. */
+	size_t size;
+};
+
+/**
+ * Take a stack of at least @a size bytes from the pool, or map a
+ * new one.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_stack_create(struct coro_stack *stack, size_t size);
+
+/** Return the stack into the pool, or unmap it if the pool is full. */
+void
+coro_stack_destroy(struct coro_stack *stack);
+
+/**
+ * Fill the whole stack with a known pattern. Commits all its
+ * memory, so is supposed to be used for debugging only.
+ */
+void
+coro_stack_paint(struct coro_stack *stack);
+
+/**
+ * How many bytes from the top of a painted stack were ever
+ * touched.
+ */
+size_t
+coro_stack_used(const struct coro_stack *stack);
+
+/** Stack top - the stacks grow down. */
+static inline void *
+coro_stack_top(const struct coro_stack *stack)
+{
+	return (char *)stack->base + stack->size;
+}
@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include "coro_sync.h"
+
+/** Deadline for coro_wait_deadline() in @a usec from now. */
+static inline uint64_t
+coro_sync_deadline(uint64_t usec)
+{
+	if (usec == CORO_TIMEOUT_INFINITE)
+		return UINT64_MAX;
+	return coro_time() + usec;
+}
+
+void
+coro_mutex_create(struct coro_mutex *m)
+{
+	m->owner = NULL;
+	coro_queue_create(&m->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *m)
+{
+	assert(m->owner == NULL);
+	assert(coro_queue_is_empty(&m->waiters));
+	(void)m;
+}
+
+/**
+ * Lock the mutex under the scheduler lock.
+ * @retval true Locked.
+ * @retval false The deadline has passed.
+ */
+static bool
+coro_mutex_lock_locked(struct coro_mutex *m, uint64_t deadline)
+{
+	struct coro *self = coro_this();
+	assert(m->owner != self);
+	if (m->owner == NULL) {
+		m->owner = self;
+		return true;
+	}
+	/*
+	 * The unlocker passes the ownership directly. A timed out
+	 * waiter is not in the queue anymore and can't get it.
+	 */
+	if (! coro_wait_deadline(&m->waiters, deadline))
+		return false;
+	assert(m->owner == self);
+	return true;
+}
+
+/** Unlock the mutex under the scheduler lock. */
+static void
+coro_mutex_unlock_locked(struct coro_mutex *m)
+{
+	assert(m->owner == coro_this());
+	m->owner = m->waiters.first;
+	coro_wakeup(&m->waiters);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	coro_mutex_lock_timeout(m, CORO_TIMEOUT_INFINITE);
+}
+
+bool
+coro_mutex_lock_timeout(struct coro_mutex *m, uint64_t usec)
+{
+	uint64_t deadline = coro_sync_deadline(usec);
+	coro_sched_lock();
+	bool is_locked = coro_mutex_lock_locked(m, deadline);
+	coro_sched_unlock();
+	return is_locked;
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+	coro_sched_lock();
+	bool is_locked = m->owner == NULL;
+	if (is_locked)
+		m->owner = coro_this();
+	coro_sched_unlock();
+	return is_locked;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	coro_sched_lock();
+	coro_mutex_unlock_locked(m);
+	coro_sched_unlock();
+}
+
+void
+coro_cond_create(struct coro_cond *c)
+{
+	coro_queue_create(&c->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *c)
+{
+	assert(coro_queue_is_empty(&c->waiters));
+	(void)c;
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+	coro_cond_wait_timeout(c, m, CORO_TIMEOUT_INFINITE);
+}
+
+bool
+coro_cond_wait_timeout(struct coro_cond *c, struct coro_mutex *m,
+		       uint64_t usec)
+{
+	uint64_t deadline = coro_sync_deadline(usec);
+	coro_sched_lock();
+	coro_mutex_unlock_locked(m);
+	bool is_signaled = coro_wait_deadline(&c->waiters, deadline);
+	/* The mutex is locked back even on timeout. */
+	coro_mutex_lock_locked(m, UINT64_MAX);
+	coro_sched_unlock();
+	return is_signaled;
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+	coro_sched_lock();
+	coro_wakeup(&c->waiters);
+	coro_sched_unlock();
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+	coro_sched_lock();
+	coro_wakeup_all(&c->waiters);
+	coro_sched_unlock();
+}
+
+int
+coro_channel_create(struct coro_channel *ch, int capacity)
+{
+	if (capacity <= 0)
+		return -1;
+	ch->data = malloc(sizeof(ch->data[0]) * capacity);
+	if (ch->data == NULL)
+		return -1;
+	ch->capacity = capacity;
+	ch->head = 0;
+	ch->size = 0;
+	ch->is_closed = false;
+	coro_queue_create(&ch->senders);
+	coro_queue_create(&ch->receivers);
+	return 0;
+}
+
+void
+coro_channel_destroy(struct coro_channel *ch)
+{
+	assert(coro_queue_is_empty(&ch->senders));
+	assert(coro_queue_is_empty(&ch->receivers));
+	free(ch->data);
+}
+
+int
+coro_channel_send(struct coro_channel *ch, void *msg)
+{
+	return coro_channel_send_timeout(ch, msg, CORO_TIMEOUT_INFINITE);
+}
+
+int
+coro_channel_send_timeout(struct coro_channel *ch, void *msg,
+			  uint64_t usec)
+{
+	uint64_t deadline = coro_sync_deadline(usec);
+	coro_sched_lock();
+	while (! ch->is_closed && ch->size == ch->capacity) {
+		if (! coro_wait_deadline(&ch->senders, deadline)) {
+			coro_sched_unlock();
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	if (ch->is_closed) {
+		coro_sched_unlock();
+		errno = EPIPE;
+		return -1;
+	}
+	ch->data[(ch->head + ch->size) % ch->capacity] = msg;
+	++ch->size;
+	coro_wakeup(&ch->receivers);
+	coro_sched_unlock();
+	return 0;
+}
+
+int
+coro_channel_recv(struct coro_channel *ch, void **msg)
+{
+	return coro_channel_recv_timeout(ch, msg, CORO_TIMEOUT_INFINITE);
+}
+
+int
+coro_channel_recv_timeout(struct coro_channel *ch, void **msg,
+			  uint64_t usec)
+{
+	uint64_t deadline = coro_sync_deadline(usec);
+	coro_sched_lock();
+	while (! ch->is_closed && ch->size == 0) {
+		if (! coro_wait_deadline(&ch->receivers, deadline)) {
+			coro_sched_unlock();
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	if (ch->size == 0) {
+		coro_sched_unlock();
+		errno = EPIPE;
+		return -1;
+	}
+	*msg = ch->data[ch->head];
+	ch->head = (ch->head + 1) % ch->capacity;
+	--ch->size;
+	coro_wakeup(&ch->senders);
+	coro_sched_unlock();
+	return 0;
+}
+
+void
+coro_channel_close(struct coro_channel *ch)
+{
+	coro_sched_lock();
+	ch->is_closed = true;
+	coro_wakeup_all(&ch->senders);
+	coro_wakeup_all(&ch->receivers);
+	coro_sched_unlock();
+}
+
+void
+coro_wait_group_create(struct coro_wait_group *wg)
+{
+	wg->count = 0;
+	coro_queue_create(&wg->waiters);
+}
+
+void
+coro_wait_group_destroy(struct coro_wait_group *wg)
+{
+	assert(coro_queue_is_empty(&wg->waiters));
+	(void)wg;
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count)
+{
+	coro_sched_lock();
+	wg->count += count;
+	assert(wg->count >= 0);
+	if (wg->count == 0)
+		coro_wakeup_all(&wg->waiters);
+	coro_sched_unlock();
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *wg)
+{
+	coro_wait_group_add(wg, -1);
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *wg)
+{
+	coro_wait_group_wait_timeout(wg, CORO_TIMEOUT_INFINITE);
+}
+
+bool
+coro_wait_group_wait_timeout(struct coro_wait_group *wg, uint64_t usec)
+{
+	uint64_t deadline = coro_sync_deadline(usec);
+	coro_sched_lock();
+	bool is_done = true;
+	while (wg->count > 0 && is_done)
+		is_done = coro_wait_deadline(&wg->waiters, deadline);
+	/* Could be done right at the deadline. */
+	is_done = wg->count == 0;
+	coro_sched_unlock();
+	return is_done;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <stdbool.h>
+#include "libcoro.h"
+
+/**
+ * Synchronization primitives for coroutines of one scheduler. A
+ * coroutine, blocked on any of them, is removed from the ready
+ * queue and costs nothing until it is woken up. With worker
+ * threads they are protected by coro_sched_lock().
+ */
+
+/** Mutex. Ownership is passed to waiters in FIFO order. */
+struct coro_mutex {
+	/** Owner coroutine. NULL, if the mutex is free. */
+	struct coro *owner;
+	/** Coroutines waiting for the lock. */
+	struct coro_queue waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *m);
+
+/** The mutex should be unlocked and have no waiters. */
+void
+coro_mutex_destroy(struct coro_mutex *m);
+
+/** Lock the mutex. Blocks, if it is owned by another coroutine. */
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/**
+ * Lock the mutex, waiting not longer than @a usec microseconds.
+ * CORO_TIMEOUT_INFINITE waits forever.
+ * @retval true The mutex is locked.
+ * @retval false Timed out.
+ */
+bool
+coro_mutex_lock_timeout(struct coro_mutex *m, uint64_t usec);
+
+/**
+ * Lock the mutex, if it is free.
+ * @retval true The mutex is locked.
+ * @retval false It is owned by somebody.
+ */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+/**
+ * Unlock the mutex. If there are waiters, the first one becomes
+ * the owner right away, so nobody can steal the lock from it.
+ */
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+/** Condition variable. */
+struct coro_cond {
+	struct coro_queue waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *c);
+
+void
+coro_cond_destroy(struct coro_cond *c);
+
+/**
+ * Unlock @a m, wait for a signal, and lock @a m again. As with
+ * any condition variable, the condition should be rechecked in a
+ * loop.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/**
+ * The same as coro_cond_wait(), but for not longer than @a usec
+ * microseconds. @a m is locked again in any case.
+ * @retval true Signaled.
+ * @retval false Timed out.
+ */
+bool
+coro_cond_wait_timeout(struct coro_cond *c, struct coro_mutex *m,
+		       uint64_t usec);
+
+/** Wake up one waiter. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all waiters. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/** Bounded FIFO channel of pointers. */
+struct coro_channel {
+	/** Ring buffer of messages. */
+	void **data;
+	/** Buffer size. */
+	int capacity;
+	/** Index of the oldest message. */
+	int head;
+	/** Message count. */
+	int size;
+	/** True, if no more messages can be sent. */
+	bool is_closed;
+	/** Coroutines waiting for a free slot. */
+	struct coro_queue senders;
+	/** Coroutines waiting for a message. */
+	struct coro_queue receivers;
+};
+
+/**
+ * Create a channel which can keep up to @a capacity messages.
+ * @retval 0 Success.
+ * @retval -1 Invalid capacity or no memory.
+ */
+int
+coro_channel_create(struct coro_channel *ch, int capacity);
+
+/** Free the channel buffer. It should have no waiters. */
+void
+coro_channel_destroy(struct coro_channel *ch);
+
+/**
+ * Send a message. Blocks while the channel is full.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed.
+ */
+int
+coro_channel_send(struct coro_channel *ch, void *msg);
+
+/**
+ * Send a message, waiting for a free slot not longer than @a usec
+ * microseconds.
+ * @retval 0 Success.
+ * @retval -1 errno is ETIMEDOUT on timeout, EPIPE if the channel
+ *         is closed.
+ */
+int
+coro_channel_send_timeout(struct coro_channel *ch, void *msg,
+			  uint64_t usec);
+
+/**
+ * Receive a message. Blocks while the channel is empty.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and has no messages anymore.
+ */
+int
+coro_channel_recv(struct coro_channel *ch, void **msg);
+
+/**
+ * Receive a message, waiting not longer than @a usec microseconds.
+ * @retval 0 Success.
+ * @retval -1 errno is ETIMEDOUT on timeout, EPIPE if the channel
+ *         is closed and empty.
+ */
+int
+coro_channel_recv_timeout(struct coro_channel *ch, void **msg,
+			  uint64_t usec);
+
+/**
+ * Close the channel. All the blocked senders fail, receivers
+ * get the rest of the messages and then fail too.
+ */
+void
+coro_channel_close(struct coro_channel *ch);
+
+/** Wait until a set of coroutines has finished some work. */
+struct coro_wait_group {
+	/** Number of not done jobs. */
+	int count;
+	struct coro_queue waiters;
+};
+
+void
+coro_wait_group_create(struct coro_wait_group *wg);
+
+void
+coro_wait_group_destroy(struct coro_wait_group *wg);
+
+/** Add @a count jobs to wait for. */
+void
+coro_wait_group_add(struct coro_wait_group *wg, int count);
+
+/** Mark one job done. The last one wakes up all the waiters. */
+void
+coro_wait_group_done(struct coro_wait_group *wg);
+
+/** Block until all the jobs are done. */
+void
+coro_wait_group_wait(struct coro_wait_group *wg);
+
+/**
+ * Block until all the jobs are done, but not longer than @a usec
+ * microseconds.
+ * @retval true All done.
+ * @retval false Timed out.
+ */
+bool
+coro_wait_group_wait_timeout(struct coro_wait_group *wg, uint64_t usec);
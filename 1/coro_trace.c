@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "coro_trace.h"
+
+static const char *const coro_trace_reason_strs[] = {
+	[CORO_TRACE_YIELD] = "yield",
+	[CORO_TRACE_WAIT] = "wait",
+	[CORO_TRACE_FINISH] = "finish",
+	[CORO_TRACE_RUN] = "run",
+};
+
+int
+coro_trace_start(struct coro_trace *t, size_t capacity, uint64_t now)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size *= 2;
+	if (t->slices == NULL || size != t->mask + 1) {
+		struct coro_trace_slice *slices =
+			calloc(size, sizeof(slices[0]));
+		if (slices == NULL)
+			return -1;
+		free(t->slices);
+		t->slices = slices;
+		t->mask = size - 1;
+	} else {
+		for (size_t i = 0; i < size; ++i)
+			atomic_store(&t->slices[i].seq, 0);
+	}
+	atomic_store(&t->head, 0);
+	t->start = now;
+	return 0;
+}
+
+void
+coro_trace_destroy(struct coro_trace *t)
+{
+	free(t->slices);
+	coro_trace_create(t);
+}
+
+void
+coro_trace_write(struct coro_trace *t, uint64_t id, const char *name,
+		 pid_t tid, uint64_t start, uint64_t end, uint64_t next_id,
+		 enum coro_trace_reason reason)
+{
+	uint64_t pos = atomic_fetch_add_explicit(&t->head, 1,
+						 memory_order_relaxed);
+	struct coro_trace_slice *s = &t->slices[pos & t->mask];
+	atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+	/* The reader must not see the new data with the old seq. */
+	atomic_thread_fence(memory_order_release);
+	s->start = start;
+	s->end = end;
+	s->id = id;
+	s->next_id = next_id;
+	s->tid = tid;
+	s->reason = reason;
+	strncpy(s->name, name, CORO_TRACE_NAME_MAX - 1);
+	s->name[CORO_TRACE_NAME_MAX - 1] = 0;
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+}
+
+/** Print a JSON string, the names are given by the users. */
+static void
+coro_trace_print_str(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str != 0; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+int
+coro_trace_dump(struct coro_trace *t, FILE *out, double ns_per_tick)
+{
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	uint64_t head = atomic_load(&t->head);
+	uint64_t size = t->slices == NULL ? 0 : t->mask + 1;
+	uint64_t pos = head > size ? head - size : 0;
+	bool is_first = true;
+	for (; pos < head; ++pos) {
+		struct coro_trace_slice *s = &t->slices[pos & t->mask];
+		if (atomic_load_explicit(&s->seq,
+					 memory_order_acquire) != pos + 1)
+			continue;
+		struct coro_trace_slice copy;
+		memcpy(&copy, s, sizeof(copy));
+		atomic_thread_fence(memory_order_acquire);
+		/* Is being overwritten. */
+		if (atomic_load_explicit(&s->seq,
+					 memory_order_relaxed) != pos + 1)
+			continue;
+		/* A slice could start before the trace. */
+		uint64_t start = copy.start > t->start ? copy.start : t->start;
+		uint64_t end = copy.end > start ? copy.end : start;
+		fprintf(out, "%s\n{\"ph\":\"X\",\"cat\":\"coro\",\"name\":",
+			is_first ? "" : ",");
+		is_first = false;
+		if (copy.name[0] != 0) {
+			coro_trace_print_str(out, copy.name);
+		} else if (copy.id == 0) {
+			fprintf(out, "\"scheduler\"");
+		} else {
+			fprintf(out, "\"coro %llu\"",
+				(unsigned long long)copy.id);
+		}
+		fprintf(out, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+			"\"args\":{\"id\":%llu,\"end\":\"%s\",\"next\":%llu}}",
+			(int)getpid(), (int)copy.tid,
+			(start - t->start) * ns_per_tick / 1000,
+			(end - start) * ns_per_tick / 1000,
+			(unsigned long long)copy.id,
+			coro_trace_reason_strs[copy.reason],
+			(unsigned long long)copy.next_id);
+	}
+	fprintf(out, "\n]}\n");
+	return ferror(out) ? -1 : 0;
+}
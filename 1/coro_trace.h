@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * Ring buffer of the run slices of coroutines. A slice is written
+ * on each switch: who ran, in which thread, since when and till
+ * when, why it stopped, and who got the CPU then. The writers of
+ * many threads take the positions with an atomic increment, and
+ * the oldest slices are overwritten. Each slot has a sequence
+ * number, changed around the writing, so the reader skips the
+ * slots, which are being written, like a seqlock.
+ */
+
+enum coro_trace_reason {
+	/** Yielded and stays ready. */
+	CORO_TRACE_YIELD,
+	/** Blocked in a wait queue. */
+	CORO_TRACE_WAIT,
+	/** Has finished. */
+	CORO_TRACE_FINISH,
+	/** A worker loop has given the CPU to a coroutine. */
+	CORO_TRACE_RUN,
+	/** The slice is recorded already, nothing to do. */
+	CORO_TRACE_NONE,
+};
+
+enum {
+	/** Longer names are truncated in the trace. */
+	CORO_TRACE_NAME_MAX = 24,
+};
+
+struct coro_trace_slice {
+	/** Position + 1, when written. 0 while being written. */
+	_Atomic uint64_t seq;
+	/** Run time in coro_arch_ticks(). */
+	uint64_t start;
+	uint64_t end;
+	/** Coroutine ID, 0 for a thread itself. */
+	uint64_t id;
+	/** Who ran next. 0 - a thread, or its scheduler. */
+	uint64_t next_id;
+	pid_t tid;
+	uint8_t reason;
+	char name[CORO_TRACE_NAME_MAX];
+};
+
+struct coro_trace {
+	/** NULL, until enabled for the first time. */
+	struct coro_trace_slice *slices;
+	/** Capacity - 1, the capacity is a power of 2. */
+	uint64_t mask;
+	/** Total number of the slices ever written. */
+	_Atomic uint64_t head;
+	/** Zero time of the trace, in ticks. */
+	uint64_t start;
+	/** Checked on each switch. */
+	atomic_bool is_enabled;
+};
+
+/** Empty disabled trace. */
+static inline void
+coro_trace_create(struct coro_trace *t)
+{
+	t->slices = NULL;
+	t->mask = 0;
+	atomic_init(&t->head, 0);
+	t->start = 0;
+	atomic_init(&t->is_enabled, false);
+}
+
+/**
+ * Start recording into a buffer of @a capacity slices, rounded up
+ * to a power of 2. The old slices are forgotten. The buffer is
+ * reallocated, if the capacity is different.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+int
+coro_trace_start(struct coro_trace *t, size_t capacity, uint64_t now);
+
+/** Free the buffer. Nobody should be writing into it. */
+void
+coro_trace_destroy(struct coro_trace *t);
+
+/** Write a slice of the coroutine @a id, named @a name. */
+void
+coro_trace_write(struct coro_trace *t, uint64_t id, const char *name,
+		 pid_t tid, uint64_t start, uint64_t end, uint64_t next_id,
+		 enum coro_trace_reason reason);
+
+/**
+ * Write the slices as Chrome trace event JSON, which chrome://tracing
+ * and Perfetto open.
+ * @retval 0 Success.
+ * @retval -1 Write error.
+ */
+int
+coro_trace_dump(struct coro_trace *t, FILE *out, double ns_per_tick);
@@ -4,6 +4,8 @@
 #define _POSIX_C_SOURCE 200809
 #include "coro_util.h"
 #include "libcoro.h"
+#include <string.h>
+#include "sort_kernel.h"
 #define min(x, y) (x < y ? x : y)
 
 uint64_t coro_gettime() {
@@ -12,98 +14,371 @@ uint64_t coro_gettime() {
     return (uint64_t)(time.tv_sec * 1e6) + (uint64_t)(time.tv_nsec / 1000);
 }
 
-void merge(long arr[], int l, int m, int r) {
-    int size_l = m - l + 1,
-            size_r = r - m;
+// Elements sorted by the networks between the yield checks
+#define SORT_CHUNK (64 * SORT_BLOCK)
 
-    // Allocating memory dynamically because stack size is too small
-    long *arr_l = (long *)malloc(sizeof(long) * size_l),
-            *arr_r = (long *)malloc(sizeof(long) * size_r);
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
 
-    for(int i = 0; i < size_l; ++i)
-        arr_l[i] = arr[l + i];
-    for(int j = 0; j < size_r; ++j)
-        arr_r[j] = arr[m + j + 1];
+void iter_merge_sort(long arr[], long size) {
+    if(size < 2)
+        return;
+    // One scratch buffer, the runs go back and forth between it and arr
+    long *scratch = (long *)malloc(sizeof(long) * size);
+    if(scratch == NULL) {
+        qsort(arr, size, sizeof(long), compare_long);
+        return;
+    }
+    iter_merge_sort_scratch(arr, size, scratch);
+    free(scratch);
+}
 
-    int i = 0, j = 0, k = l;
-    while(i < size_l && j < size_r) {
-        if(arr_l[i] <= arr_r[j]) {
-            arr[k] = arr_l[i];
-            ++i;
+void iter_merge_sort_scratch(long arr[], long size, long scratch[]) {
+    if(size < 2)
+        return;
+    // The first passes are replaced with a sorting network, if the CPU
+    // has the vectors for it
+    long c_size = 1;
+    for(long l = 0; l < size; l += SORT_CHUNK) {
+        CORO_SAFE_POINT();
+        c_size = sort_blocks(arr + l, min(SORT_CHUNK, size - l));
+    }
+    long *src = arr, *dst = scratch;
+    for(; c_size < size; c_size *= 2) {
+        for(long l = 0; l < size; l += 2 * c_size) {
+            CORO_SAFE_POINT();
+            long m = min(l + c_size, size),
+                r = min(l + 2 * c_size, size);
+            // An unpaired last run is moved as it is
+            merge_runs(src + l, m - l, src + m, r - m, dst + l);
         }
-        else {
-            arr[k] = arr_r[j];
-            ++j;
+        long *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if(src != arr)
+        memcpy(arr, src, sizeof(long) * size);
+}
+
+// Digit of the radix sort, its histogram fits into L1
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (32 / RADIX_BITS)
+// Elements between the yield checks inside a pass
+#define RADIX_BLOCK 16384
+
+// The sign bit is flipped, so the negative numbers go first
+static inline uint32_t radix_key(long value) {
+    return (uint32_t)value ^ 0x80000000u;
+}
+
+void radix_sort(long arr[], long size) {
+    if(size < 2)
+        return;
+    long *scratch = (long *)malloc(sizeof(long) * size);
+    if(scratch == NULL) {
+        qsort(arr, size, sizeof(long), compare_long);
+        return;
+    }
+    radix_sort_scratch(arr, size, scratch);
+    free(scratch);
+}
+
+void radix_sort_scratch(long arr[], long size, long scratch[]) {
+    if(size < 2)
+        return;
+    // The histograms of all the digits are counted in one pass
+    long counts[RADIX_PASSES][RADIX_SIZE] = {{0}};
+    bool is_int = true;
+    for(long b = 0; b < size; b += RADIX_BLOCK) {
+        CORO_SAFE_POINT();
+        long e = min(b + RADIX_BLOCK, size);
+        for(long i = b; i < e; ++i) {
+            uint32_t key = radix_key(arr[i]);
+            is_int &= arr[i] == (int)arr[i];
+            for(int d = 0; d < RADIX_PASSES; ++d)
+                ++counts[d][(key >> (d * RADIX_BITS)) & (RADIX_SIZE - 1)];
         }
-        ++k;
     }
-    while(i < size_l) {
-        arr[k] = arr_l[i];
-        ++i, ++k;
+    if(!is_int) {
+        iter_merge_sort_scratch(arr, size, scratch);
+        return;
     }
+    long *src = arr, *dst = scratch;
+    for(int d = 0; d < RADIX_PASSES; ++d) {
+        int shift = d * RADIX_BITS;
+        // All have the same digit, the order stays
+        if(counts[d][(radix_key(src[0]) >> shift) & (RADIX_SIZE - 1)] == size)
+            continue;
+        long offsets[RADIX_SIZE], sum = 0;
+        for(int v = 0; v < RADIX_SIZE; ++v) {
+            offsets[v] = sum;
+            sum += counts[d][v];
+        }
+        for(long b = 0; b < size; b += RADIX_BLOCK) {
+            CORO_SAFE_POINT();
+            long e = min(b + RADIX_BLOCK, size);
+            for(long i = b; i < e; ++i)
+                dst[offsets[(radix_key(src[i]) >> shift) & (RADIX_SIZE - 1)]++] = src[i];
+        }
+        long *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if(src != arr)
+        memcpy(arr, src, sizeof(long) * size);
+}
 
-    while(j < size_r) {
-        arr[k] = arr_r[j];
-        ++j, ++k;
+// Runs, which are shorter, are extended with the insertion sort
+#define TIM_MIN_MERGE 64
+// Wins in a row of one run, after which the merge gallops
+#define TIM_MIN_GALLOP 7
+// Enough for 2^64 elements, the run lengths on the stack grow faster
+// than Fibonacci numbers
+#define TIM_MAX_RUNS 85
+
+typedef struct {
+    long *arr;
+    long base[TIM_MAX_RUNS];
+    long len[TIM_MAX_RUNS];
+    int count;
+    long min_gallop;
+    // For the left run of a merge, allocated on the first one, unless
+    // the caller gave it
+    long *tmp;
+    long tmp_size;
+} tim_state;
+
+// Minimal run length: 32..64, so the number of runs is a power of 2,
+// or just below it
+static long tim_min_run(long size) {
+    long r = 0;
+    while(size >= TIM_MIN_MERGE) {
+        r |= size & 1;
+        size >>= 1;
     }
-    free(arr_l);
-    free(arr_r);
+    return size + r;
 }
 
-void iter_merge_sort(coro_ctx *ctx, long arr[], long size) {
-    // ctx->start_time = coro_gettime();
-    for(int c_size = 1; c_size < size; c_size *= 2) {
-        for(int l = 0; l < size - 1; l += 2 * c_size) {
-            if(coro_gettime() - ctx->start_time > ctx->timeout) {
-                ctx->total_time += coro_gettime() - ctx->start_time;
-                ++ctx->s_cnt;
-                coro_yield();
-                ctx->start_time = coro_gettime();
-            }
-            int m = min(l + c_size - 1, size - 1),
-                r = min(l + 2 * c_size - 1, size - 1);
-            int size_l = m - l + 1,
-            size_r = r - m;
-
-            // Allocating memory dynamically because stack size is too small
-            long *arr_l = (long *)malloc(sizeof(long) * size_l),
-                    *arr_r = (long *)malloc(sizeof(long) * size_r);
-
-            for(int i = 0; i < size_l; ++i)
-                arr_l[i] = arr[l + i];
-            for(int j = 0; j < size_r; ++j)
-                arr_r[j] = arr[m + j + 1];
-
-            int i = 0, j = 0, k = l;
-            while(i < size_l && j < size_r) {
-                if(arr_l[i] <= arr_r[j]) {
-                    arr[k] = arr_l[i];
-                    ++i;
-                }
-                else {
-                    arr[k] = arr_r[j];
-                    ++j;
-                }
-                ++k;
-            }
-            while(i < size_l) {
-                arr[k] = arr_l[i];
-                ++i, ++k;
-            }
+// Length of the run from arr, a descending one is reversed. It must be
+// strictly descending, the equal elements would lose their order.
+static long tim_count_run(long *arr, long size) {
+    if(size < 2)
+        return size;
+    long n = 2;
+    if(arr[1] < arr[0]) {
+        while(n < size && arr[n] < arr[n - 1])
+            ++n;
+        for(long i = 0, j = n - 1; i < j; ++i, --j) {
+            long tmp = arr[i];
+            arr[i] = arr[j];
+            arr[j] = tmp;
+        }
+    } else {
+        while(n < size && arr[n] >= arr[n - 1])
+            ++n;
+    }
+    return n;
+}
+
+// Sorts arr, the first sorted elements of which are sorted already.
+// The place of each next one is found with a binary search.
+static void binary_insertion_sort(long *arr, long size, long sorted) {
+    for(long i = sorted; i < size; ++i) {
+        long v = arr[i], lo = 0, hi = i;
+        // After the equal ones
+        while(lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            if(v < arr[mid])
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        memmove(arr + lo + 1, arr + lo, sizeof(long) * (i - lo));
+        arr[lo] = v;
+    }
+}
+
+// Number of the first elements of arr, which go before value: the ones
+// less or equal to it, if is_right, or only the less ones. They are
+// found with the steps 1, 3, 7, ... from the start, then with a binary
+// search in the last step.
+static long gallop(const long *arr, long size, long value, bool is_right) {
+#define BEFORE(x) (is_right ? (x) <= value : (x) < value)
+    if(size == 0 || !BEFORE(arr[0]))
+        return 0;
+    long lo = 0, hi = 1;
+    while(hi < size && BEFORE(arr[hi])) {
+        lo = hi;
+        hi = 2 * hi + 1;
+    }
+    hi = min(hi, size);
+    // arr[lo] goes before, arr[hi] doesn't, or is the end
+    ++lo;
+    while(lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if(BEFORE(arr[mid]))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+#undef BEFORE
+}
 
-            while(j < size_r) {
-                arr[k] = arr_r[j];
-                ++j, ++k;
+// Merges the runs i and i + 1, the left one is moved into the buffer.
+// Returns -1, if there is no memory for it.
+static int tim_merge_at(tim_state *st, int i) {
+    long *a = st->arr + st->base[i], na = st->len[i];
+    long *b = st->arr + st->base[i + 1], nb = st->len[i + 1];
+    st->len[i] += nb;
+    for(int j = i + 1; j < st->count - 1; ++j) {
+        st->base[j] = st->base[j + 1];
+        st->len[j] = st->len[j + 1];
+    }
+    --st->count;
+    // The ones of a, before b[0], and the ones of b, after the last one
+    // of a, are in place already
+    long k = gallop(a, na, b[0], true);
+    a += k;
+    na -= k;
+    if(na == 0)
+        return 0;
+    nb = gallop(b, nb, a[na - 1], false);
+    if(nb == 0)
+        return 0;
+    if(st->tmp_size < na) {
+        long *tmp = (long *)realloc(st->tmp, sizeof(long) * na);
+        if(tmp == NULL)
+            return -1;
+        st->tmp = tmp;
+        st->tmp_size = na;
+    }
+    memcpy(st->tmp, a, sizeof(long) * na);
+    const long *pa = st->tmp, *pa_end = st->tmp + na;
+    long *pb = b, *pb_end = b + nb, *out = a;
+    // The output never overtakes pb, the rest of b is in place, when a
+    // ends
+    while(true) {
+        long wins_a = 0, wins_b = 0;
+        while(wins_a < st->min_gallop && wins_b < st->min_gallop) {
+            if(*pb < *pa) {
+                *out++ = *pb++;
+                ++wins_b;
+                wins_a = 0;
+                if(pb == pb_end)
+                    goto done;
+            } else {
+                *out++ = *pa++;
+                ++wins_a;
+                wins_b = 0;
+                if(pa == pa_end)
+                    goto done;
             }
-            free(arr_l);
-            free(arr_r);
         }
+        // One run wins too often, the chunks of each are found by galloping
+        // and moved at once, while they are long
+        do {
+            wins_a = gallop(pa, pa_end - pa, *pb, true);
+            memcpy(out, pa, sizeof(long) * wins_a);
+            out += wins_a;
+            pa += wins_a;
+            if(pa == pa_end)
+                goto done;
+            *out++ = *pb++;
+            if(pb == pb_end)
+                goto done;
+            wins_b = gallop(pb, pb_end - pb, *pa, false);
+            memmove(out, pb, sizeof(long) * wins_b);
+            out += wins_b;
+            pb += wins_b;
+            if(pb == pb_end)
+                goto done;
+            *out++ = *pa++;
+            if(pa == pa_end)
+                goto done;
+            if(st->min_gallop > 1)
+                --st->min_gallop;
+        } while(wins_a >= TIM_MIN_GALLOP || wins_b >= TIM_MIN_GALLOP);
+        ++st->min_gallop;
+    }
+done:
+    memcpy(out, pa, sizeof(long) * (pa_end - pa));
+    return 0;
+}
+
+// Merges the runs on the top of the stack, until their lengths decrease
+// faster than Fibonacci numbers, so the merges stay balanced
+static int tim_merge_collapse(tim_state *st) {
+    while(st->count > 1) {
+        int i = st->count - 2;
+        long *len = st->len;
+        if((i > 0 && len[i - 1] <= len[i] + len[i + 1]) ||
+           (i > 1 && len[i - 2] <= len[i - 1] + len[i])) {
+            if(len[i - 1] < len[i + 1])
+                --i;
+        } else if(len[i] > len[i + 1]) {
+            break;
+        }
+        CORO_SAFE_POINT();
+        if(tim_merge_at(st, i) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Finds the runs and merges them. Returns -1, if there is no memory for
+// a merge, the runs are sorted then, but not all merged.
+static int tim_sort_runs(tim_state *st, long size) {
+    long *arr = st->arr;
+    long min_run = tim_min_run(size);
+    int rc = 0;
+    for(long pos = 0; pos < size && rc == 0;) {
+        CORO_SAFE_POINT();
+        long n = tim_count_run(arr + pos, size - pos);
+        if(n < min_run) {
+            long forced = min(min_run, size - pos);
+            binary_insertion_sort(arr + pos, forced, n);
+            n = forced;
+        }
+        st->base[st->count] = pos;
+        st->len[st->count] = n;
+        ++st->count;
+        pos += n;
+        rc = tim_merge_collapse(st);
     }
-    // ctx->total_time += coro_gettime() - ctx->start_time;
-    // ++ctx->s_cnt;
+    while(st->count > 1 && rc == 0) {
+        int i = st->count - 2;
+        if(i > 0 && st->len[i - 1] < st->len[i + 1])
+            --i;
+        CORO_SAFE_POINT();
+        rc = tim_merge_at(st, i);
+    }
+    return rc;
+}
+
+void tim_sort(long arr[], long size) {
+    if(size < 2)
+        return;
+    tim_state st = {.arr = arr, .min_gallop = TIM_MIN_GALLOP};
+    int rc = tim_sort_runs(&st, size);
+    free(st.tmp);
+    if(rc != 0)
+        qsort(arr, size, sizeof(long), compare_long);
+}
+
+void tim_sort_scratch(long arr[], long size, long scratch[]) {
+    if(size < 2)
+        return;
+    // The left run of a merge is never longer than the array
+    tim_state st = {.arr = arr, .min_gallop = TIM_MIN_GALLOP,
+                    .tmp = scratch, .tmp_size = size};
+    tim_sort_runs(&st, size);
 }
 
-void quick_sort(coro_ctx *ctx, long arr[], int l, int r) {
+void quick_sort(long arr[], int l, int r) {
     if(l < r) {
         long pivot = arr[r];
         int i = l - 1;
@@ -117,12 +392,80 @@ void quick_sort(coro_ctx *ctx, long arr[], int l, int r) {
         long tmp = arr[i + 1];
         arr[i + 1] = arr[r];
         arr[r] = tmp;
-        ctx->start_time = coro_gettime();
-        quick_sort(ctx, arr, l, i);
-        ctx->start_time = coro_gettime();
-        quick_sort(ctx, arr, i + 2, r);
-    }
-    ctx->total_time += coro_gettime() - ctx->start_time;
-    ++ctx->s_cnt;
-    coro_yield();
-}
\ No newline at end of file
+        quick_sort(arr, l, i);
+        quick_sort(arr, i + 2, r);
+    }
+    CORO_SAFE_POINT();
+}
+// Whether the head of run a goes before the head of run b. An empty
+// run goes after all.
+static inline bool loser_tree_less(const loser_tree *t, int a, int b) {
+    const loser_run *ra = &t->runs[a], *rb = &t->runs[b];
+    return ra->pos != ra->end && (rb->pos == rb->end || *ra->pos < *rb->pos);
+}
+
+// Plays the matches of the subtree, returns its winner
+static int loser_tree_build(loser_tree *t, int node) {
+    if(node >= t->k)
+        return node - t->k;
+    int l = loser_tree_build(t, 2 * node),
+        r = loser_tree_build(t, 2 * node + 1);
+    if(loser_tree_less(t, r, l)) {
+        t->nodes[node] = l;
+        return r;
+    }
+    t->nodes[node] = r;
+    return l;
+}
+
+int loser_tree_create(loser_tree *t, long **arrays, const long *sizes, int k) {
+    t->k = k;
+    t->refill = NULL;
+    t->refill_ctx = NULL;
+    // No runs, nothing to pop, and nothing to allocate
+    if(k == 0) {
+        t->runs = NULL;
+        t->nodes = NULL;
+        return 0;
+    }
+    t->runs = malloc(sizeof(loser_run) * k);
+    t->nodes = malloc(sizeof(int) * k);
+    if(t->runs == NULL || t->nodes == NULL) {
+        free(t->runs);
+        free(t->nodes);
+        return -1;
+    }
+    for(int i = 0; i < k; ++i) {
+        t->runs[i].pos = arrays[i];
+        t->runs[i].end = arrays[i] + sizes[i];
+    }
+    t->nodes[0] = loser_tree_build(t, 1);
+    return 0;
+}
+
+bool loser_tree_pop(loser_tree *t, long *value) {
+    if(t->k == 0)
+        return false;
+    int winner = t->nodes[0];
+    loser_run *run = &t->runs[winner];
+    if(run->pos == run->end)
+        return false;
+    *value = *run->pos++;
+    if(run->pos == run->end && t->refill != NULL)
+        t->refill(t->refill_ctx, winner, run);
+    // Only the matches on the path of the winner's leaf change
+    for(int node = (winner + t->k) / 2; node > 0; node /= 2) {
+        if(loser_tree_less(t, t->nodes[node], winner)) {
+            int loser = winner;
+            winner = t->nodes[node];
+            t->nodes[node] = loser;
+        }
+    }
+    t->nodes[0] = winner;
+    return true;
+}
+
+void loser_tree_destroy(loser_tree *t) {
+    free(t->runs);
+    free(t->nodes);
+}
@@ -5,33 +5,89 @@
 #ifndef SYSPROG_CORO_UTIL_H
 #define SYSPROG_CORO_UTIL_H
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 #include <stdlib.h>
 
-typedef struct {
-    uint64_t id;
-    uint64_t start_time;
-    uint64_t total_time;
-    uint64_t timeout;
-    int s_cnt;
-} coro_ctx;
-
 uint64_t coro_gettime();
 
+struct coro_channel;
+struct ext_spill;
+struct ext_run;
+
+// Time and switches are accounted by libcoro, see coro_stats()
 typedef struct {
-    coro_ctx *ctx;
-    char **queue;
-    int *q_size;
+    int id;
+    // Indexes of not sorted files
+    struct coro_channel *queue;
+    char **filenames;
     long **arrays;
     long *arr_sizes;
+    // iter_merge_sort(), tim_sort() or radix_sort()
+    void (*sort)(long arr[], long size);
+    // The same one, which takes the scratch, for the chunks
+    void (*sort_scratch)(long arr[], long size, long scratch[]);
+    // External sort, if not 0: the files are sorted by chunks of so many
+    // numbers, which are spilled as runs into the own file of the coroutine
+    long chunk;
+    size_t read_buf;
+    struct ext_spill *spill;
+    // Runs of each file
+    struct ext_run **runs;
+    int *run_counts;
 } coro_arg;
 
-void merge(long arr[], int l, int m, int r);
+typedef struct {
+    const long *pos;
+    const long *end;
+} loser_run;
+
+// Tournament tree over k sorted runs. A node keeps the loser of the
+// match of its subtrees, node 0 - the overall winner, the smallest head,
+// so a pop replays only the log(k) matches on one path.
+typedef struct {
+    int k;
+    loser_run *runs;
+    int *nodes;
+    // If set, is called for a run, which is empty, to give it the next
+    // part. The run stays empty, when it returns false.
+    bool (*refill)(void *ctx, int run, loser_run *r);
+    void *refill_ctx;
+} loser_tree;
+
+// Arrays can be NULL, when their sizes are 0. Returns 0 on success, -1
+// if there is no memory.
+int loser_tree_create(loser_tree *t, long **arrays, const long *sizes, int k);
+
+// Takes the smallest of all the heads, returns false when all the runs
+// are empty
+bool loser_tree_pop(loser_tree *t, long *value);
+
+void loser_tree_destroy(loser_tree *t);
+
+// Both sorts yield at CORO_SAFE_POINT() when the preemption timer expires
+void iter_merge_sort(long arr[], long size);
+
+void quick_sort(long arr[], int l, int r);
+
+// Merge sort of the natural runs, like Timsort. The ascending and the
+// strictly descending runs are found, the short ones are extended with
+// the binary insertion sort, and the merges gallop through the long
+// chunks of one run. A sorted array takes one pass. It yields at
+// CORO_SAFE_POINT() between the runs and the merges.
+void tim_sort(long arr[], long size);
 
-void iter_merge_sort(coro_ctx *ctx, long arr[], long size);
+// LSD radix sort, 8 bits a pass, with the passes skipped where all the
+// digits are the same. It yields at CORO_SAFE_POINT() between the blocks
+// of each pass. The numbers must fit in int, otherwise iter_merge_sort()
+// is used.
+void radix_sort(long arr[], long size);
 
-// Merge sort is a pain to use with latencies
-void quick_sort(coro_ctx *ctx, long arr[], int l, int r);
+// The same sorts with the scratch of @a size numbers from the caller.
+// They allocate nothing, so the memory of a sort is known beforehand.
+void iter_merge_sort_scratch(long arr[], long size, long scratch[]);
+void tim_sort_scratch(long arr[], long size, long scratch[]);
+void radix_sort_scratch(long arr[], long size, long scratch[]);
 
 #endif //SYSPROG_CORO_UTIL_H
@@ -0,0 +1,136 @@
+#include <assert.h>
+#include <string.h>
+#include "coro_wheel.h"
+
+static inline uint64_t
+coro_wheel_rotl(uint64_t v, int n)
+{
+	n &= CORO_WHEEL_SIZE - 1;
+	return n == 0 ? v : (v << n) | (v >> (64 - n));
+}
+
+void
+coro_wheel_create(struct coro_wheel *w, uint64_t now)
+{
+	memset(w, 0, sizeof(*w));
+	w->now = now;
+}
+
+void
+coro_wheel_add(struct coro_wheel *w, struct coro_timer *t,
+	       uint64_t deadline)
+{
+	assert(! t->is_armed);
+	t->deadline = deadline;
+	uint64_t at = deadline > w->now ? deadline : w->now + 1;
+	/*
+	 * The highest differing digit. The slot is after the current
+	 * one on that level, and all the upper digits are the same, so
+	 * the timer is reached before the level wraps around.
+	 */
+	int level = (63 - __builtin_clzll(at ^ w->now)) / CORO_WHEEL_BITS;
+	int slot = (at >> (level * CORO_WHEEL_BITS)) & (CORO_WHEEL_SIZE - 1);
+	t->level = level;
+	t->slot = slot;
+	struct coro_timer **head = &w->slots[level][slot];
+	t->prev = NULL;
+	t->next = *head;
+	if (*head != NULL)
+		(*head)->prev = t;
+	*head = t;
+	w->occupied[level] |= (uint64_t)1 << slot;
+	t->is_armed = true;
+	++w->count;
+}
+
+void
+coro_wheel_remove(struct coro_wheel *w, struct coro_timer *t)
+{
+	assert(t->is_armed);
+	struct coro_timer **head = &w->slots[t->level][t->slot];
+	if (t->prev != NULL)
+		t->prev->next = t->next;
+	else
+		*head = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	if (*head == NULL)
+		w->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+	t->next = t->prev = NULL;
+	t->is_armed = false;
+	--w->count;
+}
+
+struct coro_timer *
+coro_wheel_advance(struct coro_wheel *w, uint64_t now)
+{
+	if (now <= w->now)
+		return NULL;
+	/* Take all the slots, which the time has passed or entered. */
+	struct coro_timer *todo = NULL;
+	for (int level = 0; level < CORO_WHEEL_LEVELS; ++level) {
+		int shift = level * CORO_WHEEL_BITS;
+		uint64_t from = w->now >> shift;
+		uint64_t to = now >> shift;
+		/* The upper levels have not changed either. */
+		if (from == to)
+			break;
+		uint64_t passed;
+		if (to - from >= CORO_WHEEL_SIZE) {
+			passed = UINT64_MAX;
+		} else {
+			passed = coro_wheel_rotl(((uint64_t)1 << (to - from)) - 1,
+						 from + 1);
+		}
+		uint64_t pending = w->occupied[level] & passed;
+		w->occupied[level] &= ~passed;
+		while (pending != 0) {
+			int slot = __builtin_ctzll(pending);
+			pending &= pending - 1;
+			struct coro_timer *t = w->slots[level][slot];
+			w->slots[level][slot] = NULL;
+			while (t != NULL) {
+				struct coro_timer *next = t->next;
+				t->next = todo;
+				todo = t;
+				t = next;
+			}
+		}
+	}
+	w->now = now;
+	/* Expire the due ones, move the rest to the lower levels. */
+	struct coro_timer *expired = NULL;
+	while (todo != NULL) {
+		struct coro_timer *t = todo;
+		todo = t->next;
+		t->is_armed = false;
+		--w->count;
+		if (t->deadline <= now) {
+			t->prev = NULL;
+			t->next = expired;
+			expired = t;
+		} else {
+			coro_wheel_add(w, t, t->deadline);
+		}
+	}
+	return expired;
+}
+
+uint64_t
+coro_wheel_next(const struct coro_wheel *w)
+{
+	/* The timers of a lower level are always earlier. */
+	for (int level = 0; level < CORO_WHEEL_LEVELS; ++level) {
+		if (w->occupied[level] == 0)
+			continue;
+		int shift = level * CORO_WHEEL_BITS;
+		uint64_t cur = w->now >> shift;
+		int cur_slot = cur & (CORO_WHEEL_SIZE - 1);
+		uint64_t after = w->occupied[level] & (UINT64_MAX << cur_slot << 1);
+		assert(after != 0);
+		int slot = __builtin_ctzll(after);
+		return (((cur >> CORO_WHEEL_BITS) << CORO_WHEEL_BITS) | slot) <<
+		       shift;
+	}
+	return UINT64_MAX;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Hierarchical timer wheel. Each level has 64 slots, and a slot of
+ * level L covers 64^L time units. A timer goes to the level of the
+ * highest 6-bit digit, where its deadline differs from the current
+ * time, so adding and removing a timer are O(1). When the time
+ * passes a slot of an upper level, its timers are moved down, and
+ * only those of level 0 expire. Bitmaps of not empty slots let the
+ * time jump over any gap without visiting the empty slots.
+ *
+ * The time units are up to the user, the wheel only needs them to
+ * grow monotonically.
+ */
+
+enum {
+	CORO_WHEEL_BITS = 6,
+	CORO_WHEEL_SIZE = 1 << CORO_WHEEL_BITS,
+	/** Enough to cover any 64-bit deadline, nothing overflows. */
+	CORO_WHEEL_LEVELS = (64 + CORO_WHEEL_BITS - 1) / CORO_WHEEL_BITS,
+};
+
+struct coro_timer {
+	/** When the timer expires. */
+	uint64_t deadline;
+	/** Links in the slot, or in the list of expired timers. */
+	struct coro_timer *next, *prev;
+	/** Where the timer is, to remove it. */
+	uint8_t level;
+	uint8_t slot;
+	/** True, while the timer is in the wheel. */
+	bool is_armed;
+};
+
+struct coro_wheel {
+	/** Current time. The timers up to it have expired. */
+	uint64_t now;
+	/** Number of armed timers. */
+	long long count;
+	/** Bit i of level L is set, if slots[L][i] is not empty. */
+	uint64_t occupied[CORO_WHEEL_LEVELS];
+	struct coro_timer *slots[CORO_WHEEL_LEVELS][CORO_WHEEL_SIZE];
+};
+
+static inline void
+coro_timer_create(struct coro_timer *t)
+{
+	t->next = t->prev = NULL;
+	t->is_armed = false;
+}
+
+/** Create an empty wheel with the current time @a now. */
+void
+coro_wheel_create(struct coro_wheel *w, uint64_t now);
+
+/**
+ * Arm the timer. A deadline, which has passed already, expires on
+ * the next advance of the time.
+ */
+void
+coro_wheel_add(struct coro_wheel *w, struct coro_timer *t,
+	       uint64_t deadline);
+
+/** Disarm the timer. */
+void
+coro_wheel_remove(struct coro_wheel *w, struct coro_timer *t);
+
+/**
+ * Move the time forward to @a now.
+ * @return The expired timers, linked by next. They are disarmed.
+ */
+struct coro_timer *
+coro_wheel_advance(struct coro_wheel *w, uint64_t now);
+
+/**
+ * The earliest time, when some timer can expire. Can be earlier
+ * than the real deadline, then nothing expires at that time, and
+ * it should be asked again. UINT64_MAX, if there are no timers.
+ */
+uint64_t
+coro_wheel_next(const struct coro_wheel *w);
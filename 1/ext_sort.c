@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809
+#include "ext_sort.h"
+#include "coro_util.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Buffer of a run, which is being merged, and the rest of it in the file
+typedef struct {
+    ext_run rest;
+    long *buf;
+    long size;
+} ext_reader;
+
+typedef struct {
+    ext_reader *readers;
+    int count;
+    // The first read error
+    int err;
+} ext_merge_state;
+
+int ext_spill_open(ext_spill *s) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    const char *dir = getenv("TMPDIR");
+    if(dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    char path[PATH_MAX];
+    if(snprintf(path, sizeof(path), "%s/sort-XXXXXX", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    s->fd = mkstemp(path);
+    if(s->fd < 0)
+        return -1;
+    unlink(path);
+    return 0;
+}
+
+int ext_spill_append(ext_spill *s, const long *values, long count) {
+    const char *p = (const char *)values;
+    size_t left = sizeof(long) * count;
+    while(left > 0) {
+        ssize_t rc = write(s->fd, p, left);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += rc;
+        left -= rc;
+        s->size += rc;
+    }
+    return 0;
+}
+
+void ext_spill_close(ext_spill *s) {
+    close(s->fd);
+    s->fd = -1;
+}
+
+// Reads the next part of the run into its buffer
+static bool ext_refill(void *ctx, int run, loser_run *r) {
+    ext_merge_state *st = (ext_merge_state *)ctx;
+    ext_reader *rd = &st->readers[run];
+    long n = rd->size < rd->rest.count ? rd->size : rd->rest.count;
+    char *p = (char *)rd->buf;
+    size_t left = sizeof(long) * n;
+    while(left > 0) {
+        ssize_t rc = pread(rd->rest.fd, p, left, rd->rest.offset);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc <= 0) {
+            // The run is cut, the merge reports it in the end
+            if(st->err == 0)
+                st->err = rc == 0 ? EIO : errno;
+            rd->rest.count = 0;
+            r->pos = r->end = rd->buf;
+            return false;
+        }
+        p += rc;
+        left -= rc;
+        rd->rest.offset += rc;
+    }
+    rd->rest.count -= n;
+    r->pos = rd->buf;
+    r->end = rd->buf + n;
+    return n > 0;
+}
+
+static void ext_merge_close(ext_merge_state *st, loser_tree *t) {
+    loser_tree_destroy(t);
+    for(int i = 0; i < st->count; ++i)
+        free(st->readers[i].buf);
+    free(st->readers);
+}
+
+// Gives each run a buffer of up to @a buf_size numbers, fills them, and
+// builds the tree, which refills them, as they empty
+static int ext_merge_open(ext_merge_state *st, loser_tree *t, const ext_run *runs,
+                          int count, long buf_size) {
+    st->err = 0;
+    st->count = count;
+    st->readers = calloc(count, sizeof(ext_reader));
+    long **arrays = calloc(count, sizeof(long *));
+    long *sizes = calloc(count, sizeof(long));
+    int rc = st->readers != NULL && arrays != NULL && sizes != NULL ? 0 : -1;
+    for(int i = 0; i < count && rc == 0; ++i) {
+        ext_reader *rd = &st->readers[i];
+        rd->rest = runs[i];
+        rd->size = buf_size < runs[i].count ? buf_size : runs[i].count;
+        rd->buf = malloc(sizeof(long) * (rd->size > 0 ? rd->size : 1));
+        if(rd->buf == NULL) {
+            rc = -1;
+            break;
+        }
+        loser_run r;
+        ext_refill(st, i, &r);
+        arrays[i] = rd->buf;
+        sizes[i] = r.end - r.pos;
+    }
+    if(rc == 0 && st->err == 0)
+        rc = loser_tree_create(t, arrays, sizes, count);
+    free(arrays);
+    free(sizes);
+    if(rc != 0 || st->err != 0) {
+        int err = rc != 0 ? ENOMEM : st->err;
+        if(st->readers != NULL) {
+            for(int i = 0; i < count; ++i)
+                free(st->readers[i].buf);
+        }
+        free(st->readers);
+        errno = err;
+        return -1;
+    }
+    t->refill = ext_refill;
+    t->refill_ctx = st;
+    return 0;
+}
+
+// Merges the groups of up to @a fan_in runs into the runs of a new spill
+// file. The merged runs replace the old ones in *runs.
+static int ext_merge_pass(ext_run **runs, int *count, int fan_in, size_t budget,
+                          ext_spill *spill) {
+    int groups = (*count + fan_in - 1) / fan_in;
+    // One more buffer for the output
+    long buf_size = budget / sizeof(long) / (fan_in + 1);
+    ext_run *merged = malloc(sizeof(ext_run) * groups);
+    long *out = malloc(sizeof(long) * buf_size);
+    spill->fd = -1;
+    int rc = merged != NULL && out != NULL ? ext_spill_open(spill) : -1;
+    if(merged == NULL || out == NULL)
+        errno = ENOMEM;
+    for(int g = 0; g < groups && rc == 0; ++g) {
+        // The groups are even, none is much shorter
+        int first = (long)g * *count / groups,
+            last = (long)(g + 1) * *count / groups;
+        merged[g] = (ext_run) {.fd = spill->fd, .offset = spill->size};
+        ext_merge_state st;
+        loser_tree tree;
+        rc = ext_merge_open(&st, &tree, *runs + first, last - first, buf_size);
+        if(rc != 0)
+            break;
+        long used = 0, value;
+        while(loser_tree_pop(&tree, &value) && rc == 0) {
+            out[used++] = value;
+            if(used == buf_size) {
+                rc = ext_spill_append(spill, out, used);
+                merged[g].count += used;
+                used = 0;
+            }
+        }
+        if(rc == 0) {
+            rc = ext_spill_append(spill, out, used);
+            merged[g].count += used;
+        }
+        ext_merge_close(&st, &tree);
+        if(rc == 0 && st.err != 0) {
+            errno = st.err;
+            rc = -1;
+        }
+    }
+    free(out);
+    if(rc != 0) {
+        if(spill->fd >= 0)
+            ext_spill_close(spill);
+        free(merged);
+        return -1;
+    }
+    free(*runs);
+    *runs = merged;
+    *count = groups;
+    return 0;
+}
+
+int ext_merge(const ext_run *runs, int count, size_t budget, int_writer *out) {
+    long max_fan_in = budget / EXT_MIN_BUF;
+    // A pass needs two runs and its output
+    if(max_fan_in < 3) {
+        errno = EINVAL;
+        return -1;
+    }
+    ext_run *cur = malloc(sizeof(ext_run) * (count > 0 ? count : 1));
+    if(cur == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(cur, runs, sizeof(ext_run) * count);
+    // Output of the last pass, the one before it is closed, when merged
+    ext_spill spill = {.fd = -1};
+    int rc = 0;
+    while(count > max_fan_in && rc == 0) {
+        ext_spill next;
+        rc = ext_merge_pass(&cur, &count, max_fan_in - 1, budget, &next);
+        if(spill.fd >= 0)
+            ext_spill_close(&spill);
+        if(rc == 0)
+            spill = next;
+    }
+    if(rc == 0) {
+        long buf_size = budget / sizeof(long) / (count > 0 ? count : 1);
+        ext_merge_state st;
+        loser_tree tree;
+        rc = ext_merge_open(&st, &tree, cur, count, buf_size);
+        if(rc == 0) {
+            long value;
+            while(loser_tree_pop(&tree, &value))
+                int_writer_put(out, value);
+            ext_merge_close(&st, &tree);
+            if(st.err != 0) {
+                errno = st.err;
+                rc = -1;
+            }
+        }
+    }
+    if(spill.fd >= 0)
+        ext_spill_close(&spill);
+    free(cur);
+    return rc;
+}
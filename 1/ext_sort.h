@@ -0,0 +1,47 @@
+#ifndef SYSPROG_EXT_SORT_H
+#define SYSPROG_EXT_SORT_H
+#include <stddef.h>
+#include <sys/types.h>
+#include "int_io.h"
+
+// External sort, for the numbers, which don't fit in memory. They are
+// sorted in chunks, which are spilled to temporary files as binary runs,
+// then the runs are merged through the buffers of a fixed size.
+
+// The smallest read buffer of a run in a merge. With less memory per
+// run the runs are merged in several passes.
+#define EXT_MIN_BUF (64 * 1024)
+
+// Temporary file, which the runs are appended to. It is unlinked right
+// after the creation, so it is gone, when closed or the process dies.
+typedef struct ext_spill {
+    int fd;
+    off_t size;
+} ext_spill;
+
+// Sorted numbers in a spill file
+typedef struct ext_run {
+    int fd;
+    off_t offset;
+    long count;
+} ext_run;
+
+// Creates the file in $TMPDIR, or /tmp. Returns 0 on success, -1 with
+// errno set on error.
+int ext_spill_open(ext_spill *s);
+
+// Appends the numbers to the file, a run can be written in several
+// appends. The writes are plain write(), so it works the same in the
+// coroutines, which spill the runs, and in the merge passes out of them.
+// Returns 0 on success, -1 with errno set on error.
+int ext_spill_append(ext_spill *s, const long *values, long count);
+
+void ext_spill_close(ext_spill *s);
+
+// Merges the runs into out, with not more than @a budget bytes of the
+// buffers. If it is not enough for EXT_MIN_BUF per run, the groups of
+// runs are merged into longer ones first, in new spill files. Returns 0
+// on success, -1 with errno set on error.
+int ext_merge(const ext_run *runs, int count, size_t budget, int_writer *out);
+
+#endif //SYSPROG_EXT_SORT_H
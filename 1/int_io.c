@@ -0,0 +1,490 @@
+#define _POSIX_C_SOURCE 200809
+#include "int_io.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Longer digit runs can overflow a long
+#define INT_PARSE_SAFE_DIGITS 18
+// Sign, 19 digits, a space, and 7 bytes after them, which put_long()
+// can store to
+#define INT_WRITE_MAX 28
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+#endif
+
+static const uint64_t pow10_table[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static inline bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool is_digit(char c) {
+    return (unsigned char)(c - '0') < 10;
+}
+
+#ifdef __SSE2__
+// Bit i is set, when p[i] is a space
+static inline unsigned space_mask(const char *p) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    __m128i sp = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+    __m128i ge = _mm_cmpgt_epi8(c, _mm_set1_epi8('\t' - 1));
+    __m128i le = _mm_cmplt_epi8(c, _mm_set1_epi8('\r' + 1));
+    return _mm_movemask_epi8(_mm_or_si128(sp, _mm_and_si128(ge, le)));
+}
+
+// Bit i is set, when p[i] is a digit
+static inline unsigned digit_mask(const char *p) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    __m128i ge = _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1));
+    __m128i le = _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1));
+    return _mm_movemask_epi8(_mm_and_si128(ge, le));
+}
+#endif
+
+// Number of the spaces from p, 16 bytes at a time while they are there
+static size_t space_run(const char *p, const char *end) {
+    const char *start = p;
+#ifdef __SSE2__
+    for(; end - p >= 16; p += 16) {
+        unsigned other = ~space_mask(p) & 0xffff;
+        if(other != 0)
+            return p - start + __builtin_ctz(other);
+    }
+#endif
+    while(p < end && is_space(*p))
+        ++p;
+    return p - start;
+}
+
+// Number of the digits from p, 16 bytes at a time while they are there
+static size_t digit_run(const char *p, const char *end) {
+    const char *start = p;
+#ifdef __SSE2__
+    for(; end - p >= 16; p += 16) {
+        unsigned other = ~digit_mask(p) & 0xffff;
+        if(other != 0)
+            return p - start + __builtin_ctz(other);
+    }
+#endif
+    while(p < end && is_digit(*p))
+        ++p;
+    return p - start;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Value of 8 digits in one register, the pairs, the quads, then all 8
+// are combined with multiplications
+static inline uint64_t parse8(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    v -= 0x3030303030303030ULL;
+    v = v * 10 + (v >> 8);
+    const uint64_t mask = 0x000000ff000000ffULL,
+        mul1 = 100 + (1000000ULL << 32),
+        mul2 = 1 + (10000ULL << 32);
+    return ((v & mask) * mul1 + ((v >> 16) & mask) * mul2) >> 32;
+}
+#else
+static inline uint64_t parse8(const char *p) {
+    uint64_t v = 0;
+    for(int i = 0; i < 8; ++i)
+        v = v * 10 + (p[i] - '0');
+    return v;
+}
+#endif
+
+// Value of the digits, saturated like strtol() does
+static long digits_value(const char *p, size_t len, bool is_neg) {
+    if(len > INT_PARSE_SAFE_DIGITS) {
+        unsigned long limit = is_neg ? -(unsigned long)LONG_MIN : LONG_MAX,
+            v = 0;
+        for(size_t i = 0; i < len; ++i) {
+            unsigned long d = p[i] - '0';
+            if(v > (limit - d) / 10)
+                return is_neg ? LONG_MIN : LONG_MAX;
+            v = v * 10 + d;
+        }
+        return is_neg ? (long)-v : (long)v;
+    }
+    uint64_t v = 0;
+    for(; len >= 8; p += 8, len -= 8)
+        v = v * 100000000 + parse8(p);
+    for(; len > 0; ++p, --len)
+        v = v * 10 + (*p - '0');
+    return is_neg ? -(long)v : (long)v;
+}
+
+int int_parser_open(int_parser *p, const char *filename) {
+    memset(p, 0, sizeof(*p));
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    p->size = st.st_size;
+    if(p->size > 0) {
+        void *data = mmap(NULL, p->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        // The pages are read ahead, while the first chunks are parsed
+        posix_madvise(data, p->size, POSIX_MADV_SEQUENTIAL);
+        posix_madvise(data, p->size, POSIX_MADV_WILLNEED);
+        p->data = data;
+    }
+    close(fd);
+    // A number takes a digit, and a separator unless it is the last one
+    p->values = malloc(sizeof(long) * ((p->size + 1) / 2 + 1));
+    if(p->values == NULL) {
+        if(p->data != NULL)
+            munmap((void *)p->data, p->size);
+        errno = ENOMEM;
+        return -1;
+    }
+    p->is_done = p->size == 0;
+    return 0;
+}
+
+// Parses the numbers from pos, until the one after stop, or max of them.
+// Unless is_end, the input can go on after end, and a number touching it
+// is left for the next call. Returns the position after the last parsed
+// one.
+static const char *parse_numbers(const char *pos, const char *end, const char *stop,
+                                 bool is_end, long *values, long *count, long max,
+                                 bool *is_done) {
+    long n = *count;
+    while(pos < stop && n < max) {
+        const char *num = pos + space_run(pos, end);
+        const char *digits = num;
+        bool is_neg = false;
+        if(digits < end && (*digits == '-' || *digits == '+'))
+            is_neg = *digits++ == '-';
+        size_t len = digit_run(digits, end);
+        if(!is_end && digits + len == end) {
+            // Only the spaces are taken, the rest can be a part of a number
+            pos = num;
+            break;
+        }
+        if(len == 0) {
+            // Like strtol(), stop at what is not a number
+            *is_done = true;
+            break;
+        }
+        values[n++] = digits_value(digits, len, is_neg);
+        pos = digits + len;
+    }
+    *count = n;
+    return pos;
+}
+
+bool int_parser_step(int_parser *p, size_t chunk) {
+    const char *pos = p->data + p->pos, *end = p->data + p->size;
+    const char *stop = chunk < (size_t)(end - pos) ? pos + chunk : end;
+    if(!p->is_done)
+        pos = parse_numbers(pos, end, stop, true, p->values, &p->count, LONG_MAX,
+                            &p->is_done);
+    if(pos == end)
+        p->is_done = true;
+    p->pos = pos - p->data;
+    return p->is_done;
+}
+
+long *int_parser_finish(int_parser *p, long *count) {
+    if(p->data != NULL)
+        munmap((void *)p->data, p->size);
+    // The estimate is for the shortest numbers, give the rest back
+    long *values = realloc(p->values, sizeof(long) * (p->count > 0 ? p->count : 1));
+    if(values == NULL)
+        values = p->values;
+    *count = p->count;
+    p->data = NULL;
+    p->values = NULL;
+    return values;
+}
+
+int int_reader_open(int_reader *r, const char *filename, size_t buf_size) {
+    char *buf = malloc(buf_size);
+    if(buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(int_reader_open_buf(r, filename, buf, buf_size) != 0) {
+        free(buf);
+        return -1;
+    }
+    r->is_own_buf = true;
+    return 0;
+}
+
+int int_reader_open_buf(int_reader *r, const char *filename, char *buf, size_t buf_size) {
+    memset(r, 0, sizeof(*r));
+    r->read = read;
+    r->buf = buf;
+    r->size = buf_size;
+    r->fd = open(filename, O_RDONLY);
+    if(r->fd < 0)
+        return -1;
+    posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+long int_reader_read(int_reader *r, long *values, long max) {
+    long count = 0;
+    while(count < max && !r->is_done) {
+        const char *pos = r->buf + r->pos, *end = r->buf + r->used;
+        pos = parse_numbers(pos, end, end, r->is_eof, values, &count, max, &r->is_done);
+        r->pos = pos - r->buf;
+        if(count == max || r->is_done)
+            break;
+        if(r->is_eof) {
+            r->is_done = true;
+            break;
+        }
+        // The rest is a part of a number, it is moved to the start and
+        // continued with the next read
+        r->used -= r->pos;
+        memmove(r->buf, r->buf + r->pos, r->used);
+        r->pos = 0;
+        if(r->used == r->size) {
+            // A number is longer than the buffer
+            errno = ERANGE;
+            return -1;
+        }
+        ssize_t rc = r->read(r->fd, r->buf + r->used, r->size - r->used);
+        if(rc < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(rc == 0)
+            r->is_eof = true;
+        r->used += rc;
+    }
+    return count;
+}
+
+void int_reader_close(int_reader *r) {
+    close(r->fd);
+    if(r->is_own_buf)
+        free(r->buf);
+    r->buf = NULL;
+}
+
+// Number of the decimal digits, from the bit length without a loop
+static inline int digit_count(uint64_t v) {
+    // 0 has a digit too, and | 1 doesn't change the others' count
+    v |= 1;
+    int approx = ((64 - __builtin_clzll(v)) * 1233) >> 12;
+    return approx + (v >= pow10_table[approx]);
+}
+
+// Length of the number with its sign and the space
+static inline size_t long_len(long value) {
+    uint64_t v = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    return (value < 0) + digit_count(v) + 1;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// 8 digits of x < 10^8 in one register, the first one in the lowest
+// byte, not yet ASCII. The halves, the pairs, then the digits are split
+// in all the lanes at once, dividing with multiplications.
+static inline uint64_t split8(uint32_t x) {
+    uint64_t merged = x / 10000 | (uint64_t)(x % 10000) << 32;
+    uint64_t top = ((merged * 10486) >> 20) & 0x0000007f0000007fULL;
+    uint64_t bottom = merged - 100 * top;
+    uint64_t hundreds = (bottom << 16) + top;
+    uint64_t tens = ((hundreds * 103) >> 10) & 0x000f000f000f000fULL;
+    return tens + ((hundreds - 10 * tens) << 8);
+}
+
+// Prints the leading digits of x < 10^8, without the zeros. All 8
+// bytes are stored, the ones after the digits are overwritten later.
+static inline char *put_head(char *p, uint32_t x) {
+    uint64_t digits = split8(x);
+    // The leading zeros are the lowest zero bytes
+    int zeros = digits != 0 ? __builtin_ctzll(digits) / 8 : 7;
+    digits = (digits + 0x3030303030303030ULL) >> (8 * zeros);
+    memcpy(p, &digits, sizeof(digits));
+    return p + 8 - zeros;
+}
+
+static inline char *put_8(char *p, uint32_t x) {
+    uint64_t digits = split8(x) + 0x3030303030303030ULL;
+    memcpy(p, &digits, sizeof(digits));
+    return p + 8;
+}
+
+// Prints the number and a space at p, returns the end. Up to
+// INT_WRITE_MAX bytes can be changed.
+static inline char *put_long(char *p, long value) {
+    uint64_t v = (uint64_t)value;
+    if(value < 0) {
+        *p++ = '-';
+        v = -v;
+    }
+    if(v < 100000000) {
+        p = put_head(p, v);
+    } else if(v < 10000000000000000ULL) {
+        p = put_head(p, v / 100000000);
+        p = put_8(p, v % 100000000);
+    } else {
+        uint64_t low = v % 10000000000000000ULL;
+        p = put_head(p, v / 10000000000000000ULL);
+        p = put_8(p, low / 100000000);
+        p = put_8(p, low % 100000000);
+    }
+    *p = ' ';
+    return p + 1;
+}
+#else
+// Prints the number and a space at p, returns the end. The digits go
+// from the last one, two at a time.
+static inline char *put_long(char *p, long value) {
+    uint64_t v = (uint64_t)value;
+    if(value < 0) {
+        *p++ = '-';
+        v = -v;
+    }
+    char *end = p + digit_count(v), *pos = end;
+    while(v >= 100) {
+        pos -= 2;
+        memcpy(pos, digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if(v >= 10) {
+        pos -= 2;
+        memcpy(pos, digit_pairs + v * 2, 2);
+    } else {
+        *--pos = '0' + v;
+    }
+    *end = ' ';
+    return end + 1;
+}
+#endif
+
+static void int_writer_flush(int_writer *w) {
+    size_t done = 0;
+    while(done < w->used && w->err == 0) {
+        ssize_t rc = write(w->fd, w->buf + done, w->used - done);
+        if(rc >= 0)
+            done += rc;
+        else if(errno != EINTR)
+            w->err = errno;
+    }
+    w->used = 0;
+}
+
+int int_writer_open(int_writer *w, const char *filename) {
+    memset(w, 0, sizeof(*w));
+    w->size = INT_WRITER_BUF_SIZE;
+    w->buf = malloc(w->size);
+    if(w->buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(w->fd < 0) {
+        free(w->buf);
+        return -1;
+    }
+    return 0;
+}
+
+int int_writer_open_mmap(int_writer *w, const char *filename, size_t size) {
+    memset(w, 0, sizeof(*w));
+    w->is_mapped = true;
+    w->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(w->fd < 0)
+        return -1;
+    if(size == 0)
+        return 0;
+    char *map = MAP_FAILED;
+    if(ftruncate(w->fd, size) == 0)
+        map = mmap(NULL, size, PROT_WRITE, MAP_SHARED, w->fd, 0);
+    if(map == MAP_FAILED) {
+        int err = errno;
+        close(w->fd);
+        errno = err;
+        return -1;
+    }
+    w->buf = map;
+    w->size = size;
+    return 0;
+}
+
+size_t int_text_size(const long *values, long count) {
+    size_t size = 0;
+    for(long i = 0; i < count; ++i)
+        size += long_len(values[i]);
+    return size;
+}
+
+void int_writer_put(int_writer *w, long value) {
+    if(w->size - w->used >= INT_WRITE_MAX) {
+        w->used = put_long(w->buf + w->used, value) - w->buf;
+        return;
+    }
+    if(!w->is_mapped) {
+        int_writer_flush(w);
+        w->used = put_long(w->buf, value) - w->buf;
+        return;
+    }
+    // The last ones are printed aside, not to store past the mapping
+    char tmp[INT_WRITE_MAX];
+    size_t len = put_long(tmp, value) - tmp;
+    if(len > w->size - w->used) {
+        w->err = ENOSPC;
+        return;
+    }
+    memcpy(w->buf + w->used, tmp, len);
+    w->used += len;
+}
+
+int int_writer_close(int_writer *w) {
+    if(w->is_mapped) {
+        if(w->buf != NULL)
+            munmap(w->buf, w->size);
+    } else {
+        int_writer_flush(w);
+        free(w->buf);
+    }
+    if(close(w->fd) != 0 && w->err == 0)
+        w->err = errno;
+    w->buf = NULL;
+    if(w->err != 0) {
+        errno = w->err;
+        return -1;
+    }
+    return 0;
+}
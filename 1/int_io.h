@@ -0,0 +1,98 @@
+#ifndef SYSPROG_INT_IO_H
+#define SYSPROG_INT_IO_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Parser of the whitespace separated numbers of a file. The file is
+// mapped, and the numbers are written straight into an array, sized by
+// the file size, so it is never grown or copied. The parsing goes in
+// chunks, the caller can yield between them.
+typedef struct {
+    const char *data;
+    size_t size;
+    // Offset of the next number
+    size_t pos;
+    long *values;
+    long count;
+    // Reached the end, or something which is not a number
+    bool is_done;
+} int_parser;
+
+// Returns 0 on success, -1 with errno set on error
+int int_parser_open(int_parser *p, const char *filename);
+
+// Parses at least @a chunk bytes, unless the file ends. Returns true,
+// when all the numbers are parsed.
+bool int_parser_step(int_parser *p, size_t chunk);
+
+// Unmaps the file and returns the numbers, which the caller frees
+long *int_parser_finish(int_parser *p, long *count);
+
+// Same numbers, but read with read() into a buffer of a fixed size, so
+// the memory doesn't depend on the file size. The numbers are taken by
+// as many, as the caller has room for.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t size;
+    // Offset of the next number, and the end of the read bytes
+    size_t pos;
+    size_t used;
+    bool is_eof;
+    // Reached the end, or something which is not a number
+    bool is_done;
+    // read() by default, can be replaced with coro_read()
+    ssize_t (*read)(int fd, void *buf, size_t size);
+    // The buffer was allocated by int_reader_open()
+    bool is_own_buf;
+} int_reader;
+
+// Returns 0 on success, -1 with errno set on error
+int int_reader_open(int_reader *r, const char *filename, size_t buf_size);
+
+// Same, with the buffer of the caller, which is not freed on close
+int int_reader_open_buf(int_reader *r, const char *filename, char *buf, size_t buf_size);
+
+// Parses up to @a max numbers into values. Returns their count, 0 when
+// the file is over, -1 with errno set on error. A number longer than the
+// buffer is an error too.
+long int_reader_read(int_reader *r, long *values, long max);
+
+void int_reader_close(int_reader *r);
+
+// Buffer of int_writer_open()
+#define INT_WRITER_BUF_SIZE (1 << 20)
+
+// Writer of numbers, each one followed by a space, as fprintf("%ld ")
+// would print them. They are formatted into a buffer, flushed with
+// write(), or straight into a mapping of the file, sized beforehand.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t used;
+    // Capacity of the buffer, or the size of the mapped file
+    size_t size;
+    bool is_mapped;
+    // The first error, it is returned on close
+    int err;
+} int_writer;
+
+// Creates or truncates the file. Returns 0 on success, -1 with errno set
+// on error.
+int int_writer_open(int_writer *w, const char *filename);
+
+// Same, but the file is mapped and takes exactly @a size bytes, the sum
+// of int_text_size() of all the numbers to write
+int int_writer_open_mmap(int_writer *w, const char *filename, size_t size);
+
+// Length of the numbers, as int_writer prints them
+size_t int_text_size(const long *values, long count);
+
+void int_writer_put(int_writer *w, long value);
+
+// Flushes and closes the file. Returns 0 on success, -1 with errno set,
+// if any write has failed.
+int int_writer_close(int_writer *w);
+
+#endif //SYSPROG_INT_IO_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -5,7 +6,22 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "libcoro.h"
+#include "coro_arch.h"
+#include "coro_stack.h"
+#include "coro_runq.h"
+#include "coro_wheel.h"
+#include "coro_trace.h"
+#ifdef CORO_BACKEND_SIGNAL
+#include <ucontext.h>
+#endif
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
@@ -13,143 +29,1846 @@
 struct coro {
 	/** A value, returned by func. */
 	int ret;
+	/** Unique ID for the traces, 0 for the threads. */
+	uint64_t id;
+	/** Scheduler the coroutine belongs to. */
+	struct coro_sched *sched;
 	/** Stack, used by the coroutine. */
-	void *stack;
+	struct coro_stack stack;
+	/** False, if the stack was provided by the user. */
+	bool is_stack_owned;
+	/** True, if the stack is painted for high-water tracking. */
+	bool is_stack_painted;
+	/** Stack high-water mark, calculated on finish. */
+	size_t stack_high_water;
+	/** Name for diagnostics. */
+	char name[CORO_NAME_MAX];
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+	/** Function of a stackless coroutine, NULL for the others. */
+	coro_step_f step;
+	/** Where the stackless one continues, see CORO_BEGIN(). */
+	int step_point;
 	/** Last remembered coroutine context. */
+#ifdef CORO_SWITCH_ASM
+	struct coro_arch_ctx ctx;
+#else
 	sigjmp_buf ctx;
+#endif
+	/**
+	 * True, if the context is valid. Otherwise the coroutine
+	 * is started from scratch on the first switch to it.
+	 */
+	bool is_started;
 	/** True, if the coroutine has finished. */
 	bool is_finished;
+	/**
+	 * True, if somebody joined the coroutine. Then it is not
+	 * returned by coro_sched_wait().
+	 */
+	bool is_joined;
+	/**
+	 * True for the own context of a thread. With worker threads
+	 * nobody switches to it, and it sleeps on a condition
+	 * variable instead.
+	 */
+	bool is_thread;
+	/** Timeout of coro_wait_deadline(). */
+	struct coro_timer timer;
+	/** True, if the last wait has ended by the timeout. */
+	bool is_timed_out;
+	/** Coroutines waiting for this one to finish. */
+	struct coro_queue waiters;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
+	/** Time spent running, in coro_arch_ticks(). */
+	uint64_t run_ticks;
+	/** Priority for CORO_POLICY_PRIORITY. */
+	int priority;
+	/** Target latency in ticks for CORO_POLICY_EDF. */
+	uint64_t latency_ticks;
+	/** Deadline in ticks. Is updated when becoming ready. */
+	uint64_t deadline;
+	/** True, if the deadline was set explicitly and is fixed. */
+	bool is_deadline_fixed;
+	/** True, if the coroutine is in a ready or run queue. */
+	bool is_ready;
+	/** Position in the EDF heap, while ready. */
+	int heap_pos;
+	/** Order of becoming ready, breaks ties of deadlines. */
+	uint64_t ready_seq;
+	/** Queue the coroutine is linked into, if any. */
+	struct coro_queue *queue;
+	/** Links in the queue. */
 	struct coro *next, *prev;
 };
 
+/** What a worker loop does after a coroutine switched to it. */
+enum coro_worker_after {
+	CORO_AFTER_NOTHING,
+	/** The coroutine has yielded, make it ready. */
+	CORO_AFTER_READY,
+	/**
+	 * The coroutine is blocked or finished under the scheduler
+	 * lock. It is released only now, when the context is saved
+	 * and nobody runs on the stack.
+	 */
+	CORO_AFTER_UNLOCK,
+};
+
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * Scheduler of one thread. Without worker threads there is only
+ * the one of the thread, which waits for the coroutines, and they
+ * switch directly between each other. Each worker thread has its
+ * own and runs a loop, which takes the coroutines from its run
+ * queue or steals them from the others. There a coroutine switches
+ * back to the loop, not to another coroutine: it can't put itself
+ * into a run queue before its context is saved, or another worker
+ * could resume it too early.
  */
-static struct coro coro_sched;
+struct coro_worker {
+	/** Scheduler the worker belongs to. */
+	struct coro_sched *sched;
+	/** Context of the thread itself: the waiter or the loop. */
+	struct coro ctx;
+	/** Which coroutine works at this moment. */
+	struct coro *this;
+	/** When the current coroutine got the CPU, in ticks. */
+	uint64_t switch_ticks;
+	/** When the quantum of the current coroutine is over. */
+	uint64_t slice_end;
+	/** Ready coroutines for CORO_POLICY_RR, in the order of running. */
+	struct coro_queue ready;
+	/** Ready coroutines for CORO_POLICY_PRIORITY, a FIFO per priority. */
+	struct coro_queue ready_prio[CORO_PRIORITY_MAX + 1];
+	/** Bit i is set, if ready_prio[i] is not empty. */
+	uint64_t ready_prio_mask;
+	/** Ready coroutines for CORO_POLICY_EDF, min-heap by deadline. */
+	struct coro **ready_heap;
+	int ready_heap_size;
+	int ready_heap_capacity;
+	/** Counter of becoming ready, to order equal deadlines. */
+	uint64_t ready_seq;
+	/** Number of ready coroutines, whatever the policy is. */
+	long long ready_count;
+	/** Thread ID, the preemption signal is sent to. */
+	pid_t tid;
+	/** True, if the preemption timer is armed. */
+	bool is_preemptive;
+	/** The preemption timer, if armed. */
+	timer_t preempt_timer;
+	/** Run queue of a worker thread. */
+	struct coro_runq runq;
+	/** Action for the loop after a coroutine switched to it. */
+	enum coro_worker_after after;
+	/** State of a random generator to choose steal victims. */
+	unsigned seed;
+	pthread_t thread;
+};
+_Static_assert(CORO_PRIORITY_MAX < 64, "priority mask is too small");
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * A group of coroutines with its own queues, settings, and
+ * threads. The groups don't share anything but the stack pool.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+struct coro_sched {
+	/** Scheduler of the thread, which waits for the coroutines. */
+	struct coro_worker main;
+	/** Worker threads. When none, the waiting thread runs all. */
+	struct coro_worker *workers;
+	int worker_count;
+	/**
+	 * Protects everything shared by the worker threads except
+	 * for the run queues: the wait queues, the finished
+	 * coroutines, the counters. Not used without workers.
+	 */
+	pthread_mutex_t lock;
+	/** Threads blocked in coro_wait() sleep on it, with lock. */
+	pthread_cond_t thread_cond;
+	/** Protects inject and sleeping of the idle workers. */
+	pthread_mutex_t park_lock;
+	pthread_cond_t park_cond;
+	/**
+	 * Ready coroutines from the threads without a run queue, or
+	 * not fitting into one.
+	 */
+	struct coro_queue inject;
+	/** Size of inject, to check it without the lock. */
+	atomic_int inject_count;
+	/** Number of workers sleeping for lack of work. */
+	atomic_int idle_count;
+	/** True, while the new workers wait for each other. */
+	bool is_starting;
+	/** True, if the workers should exit. */
+	bool is_stopping;
+	/** Current scheduling policy. */
+	enum coro_policy policy;
+	/** Threads and coroutines waiting in coro_sched_wait(). */
+	struct coro_queue waiters;
+	/** Finished coroutines, not returned by coro_sched_wait() yet. */
+	struct coro_queue finished;
+	/** Number of not finished coroutines. */
+	long long count;
+	/** How long a coroutine can run before it should yield. */
+	uint64_t quantum_ticks;
+	/** Quantum in microseconds, as it was set. */
+	uint64_t quantum_usec;
+	/** True, if the preemption is enabled. */
+	bool is_preemptive;
+	/**
+	 * True, if the quantum is shorter than the timers can take,
+	 * then the safe points check the ticks instead.
+	 */
+	bool is_preempt_ticks;
+	/** Source of events for the blocked coroutines, if any. */
+	struct coro_poller *poller;
+	/** Timeouts of the blocked coroutines, in coro_time(). */
+	struct coro_wheel wheel;
+	/**
+	 * When the wheel should be advanced, in coro_time() and in
+	 * ticks, to check it on each switch cheaply. Is read by the
+	 * workers without the lock.
+	 */
+	_Atomic uint64_t timer_next;
+	_Atomic uint64_t timer_next_ticks;
+	/** Run slices of the coroutines, when tracing is enabled. */
+	struct coro_trace trace;
+};
+
+/** Scheduler of coro_sched_init(), used by default. */
+static struct coro_sched coro_sched_default;
+/** Scheduler of the current thread. */
+static __thread struct coro_worker *coro_worker_ptr = NULL;
+/** The last given coroutine ID. */
+static _Atomic uint64_t coro_id_last = 0;
+
+__thread volatile sig_atomic_t coro_preempt_pending = 0;
+#ifdef CORO_BACKEND_SIGNAL
 /**
  * Buffer, used by the coroutine constructor to escape from the
  * signal handler back into the constructor to rollback
  * sigaltstack etc.
  */
 static sigjmp_buf start_point;
+/** The coroutine being prepared by the signal handler. */
+static struct coro *volatile start_coro;
+/** The signal handler is process-wide, one constructor at once. */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * Scheduler of the current thread. Not inlined on purpose: after
+ * a switch a coroutine can continue in another thread, and the
+ * compiler must not reuse the thread pointer read before it.
+ */
+static __attribute__((noinline)) struct coro_worker *
+coro_worker(void)
+{
+	return coro_worker_ptr;
+}
+
+/**
+ * Scheduler of the current coroutine or thread. The default one
+ * for the threads, which have not entered any.
+ */
+static inline struct coro_sched *
+coro_sched_current(void)
+{
+	struct coro_worker *w = coro_worker();
+	return w != NULL ? w->sched : &coro_sched_default;
+}
+
+/** Append a coroutine to the end of the queue. */
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->queue = q;
+	c->next = NULL;
+	c->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+}
+
+/** Remove a coroutine from the queue it is in. */
+static inline void
+coro_queue_remove(struct coro *c)
+{
+	struct coro_queue *q = c->queue;
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		q->first = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		q->last = c->prev;
+	c->queue = NULL;
+	c->next = c->prev = NULL;
+}
+
+/** Take the first coroutine from the queue. NULL, if empty. */
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c != NULL)
+		coro_queue_remove(c);
+	return c;
+}
+
+/** Add @a ticks to @a now. Saturates at infinity - UINT64_MAX. */
+static inline uint64_t
+coro_ticks_after(uint64_t now, uint64_t ticks)
+{
+	return now > UINT64_MAX - ticks ? UINT64_MAX : now + ticks;
+}
+
+/** Convert microseconds into ticks. UINT64_MAX stays infinite. */
+static uint64_t
+coro_usec_to_ticks(uint64_t usec)
+{
+	if (usec == UINT64_MAX)
+		return UINT64_MAX;
+	double ticks = usec * 1000.0 / coro_arch_ns_per_tick();
+	return ticks >= (double)UINT64_MAX ? UINT64_MAX : (uint64_t)ticks;
+}
+
+/** True, if @a a should run before @a b under CORO_POLICY_EDF. */
+static inline bool
+coro_heap_less(const struct coro *a, const struct coro *b)
+{
+	if (a->deadline != b->deadline)
+		return a->deadline < b->deadline;
+	return a->ready_seq < b->ready_seq;
+}
+
+static inline void
+coro_heap_set(struct coro_worker *w, int pos, struct coro *c)
+{
+	w->ready_heap[pos] = c;
+	c->heap_pos = pos;
+}
+
+static void
+coro_heap_sift_up(struct coro_worker *w, int pos)
+{
+	struct coro *c = w->ready_heap[pos];
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (! coro_heap_less(c, w->ready_heap[parent]))
+			break;
+		coro_heap_set(w, pos, w->ready_heap[parent]);
+		pos = parent;
+	}
+	coro_heap_set(w, pos, c);
+}
+
+static void
+coro_heap_sift_down(struct coro_worker *w, int pos)
+{
+	struct coro *c = w->ready_heap[pos];
+	while (true) {
+		int child = 2 * pos + 1;
+		if (child >= w->ready_heap_size)
+			break;
+		if (child + 1 < w->ready_heap_size &&
+		    coro_heap_less(w->ready_heap[child + 1],
+				   w->ready_heap[child]))
+			++child;
+		if (! coro_heap_less(w->ready_heap[child], c))
+			break;
+		coro_heap_set(w, pos, w->ready_heap[child]);
+		pos = child;
+	}
+	coro_heap_set(w, pos, c);
+}
+
+/**
+ * Make sure the EDF heap fits @a count coroutines. The heap is
+ * grown in advance, so making a coroutine ready never fails.
+ */
+static int
+coro_heap_reserve(struct coro_worker *w, long long count)
+{
+	if (count <= w->ready_heap_capacity)
+		return 0;
+	long long capacity = w->ready_heap_capacity * 2;
+	if (capacity < 16)
+		capacity = 16;
+	if (capacity < count)
+		capacity = count;
+	if (capacity > INT_MAX) {
+		errno = ENOMEM;
+		return -1;
+	}
+	struct coro **heap = (struct coro **)
+		realloc(w->ready_heap, capacity * sizeof(*heap));
+	if (heap == NULL)
+		return -1;
+	w->ready_heap = heap;
+	w->ready_heap_capacity = capacity;
+	return 0;
+}
+
+static void
+coro_heap_free(struct coro_worker *w)
+{
+	free(w->ready_heap);
+	w->ready_heap = NULL;
+	w->ready_heap_capacity = 0;
+}
+
+/** Put a coroutine into the ready queue of the current policy. */
+static void
+coro_ready_push(struct coro_worker *w, struct coro *c)
+{
+	assert(! c->is_ready);
+	c->is_ready = true;
+	++w->ready_count;
+	switch (w->sched->policy) {
+	case CORO_POLICY_RR:
+		coro_queue_push(&w->ready, c);
+		break;
+	case CORO_POLICY_PRIORITY:
+		coro_queue_push(&w->ready_prio[c->priority], c);
+		w->ready_prio_mask |= (uint64_t)1 << c->priority;
+		break;
+	case CORO_POLICY_EDF:
+		if (! c->is_deadline_fixed) {
+			c->deadline = coro_ticks_after(coro_arch_ticks(),
+						       c->latency_ticks);
+		}
+		c->ready_seq = w->ready_seq++;
+		assert(w->ready_heap_size < w->ready_heap_capacity);
+		coro_heap_set(w, w->ready_heap_size++, c);
+		coro_heap_sift_up(w, c->heap_pos);
+		break;
+	}
+}
+
+/** Remove a coroutine from the ready queue. */
+static void
+coro_ready_remove(struct coro_worker *w, struct coro *c)
+{
+	assert(c->is_ready);
+	c->is_ready = false;
+	--w->ready_count;
+	switch (w->sched->policy) {
+	case CORO_POLICY_RR:
+		coro_queue_remove(c);
+		break;
+	case CORO_POLICY_PRIORITY:
+		coro_queue_remove(c);
+		if (coro_queue_is_empty(&w->ready_prio[c->priority]))
+			w->ready_prio_mask &= ~((uint64_t)1 << c->priority);
+		break;
+	case CORO_POLICY_EDF: {
+		struct coro *last = w->ready_heap[--w->ready_heap_size];
+		if (last != c) {
+			coro_heap_set(w, c->heap_pos, last);
+			coro_heap_sift_up(w, last->heap_pos);
+			coro_heap_sift_down(w, last->heap_pos);
+		}
+		break;
+	}
+	}
+}
+
+/** The ready coroutine to run next. NULL, if none. */
+static inline struct coro *
+coro_ready_first(struct coro_worker *w)
+{
+	switch (w->sched->policy) {
+	case CORO_POLICY_RR:
+		return w->ready.first;
+	case CORO_POLICY_PRIORITY:
+		if (w->ready_prio_mask == 0)
+			return NULL;
+		return w->ready_prio[63 -
+			__builtin_clzll(w->ready_prio_mask)].first;
+	case CORO_POLICY_EDF:
+		return w->ready_heap_size > 0 ? w->ready_heap[0] : NULL;
+	}
+	return NULL;
+}
+
+/** Take the ready coroutine to run next. NULL, if none. */
+static inline struct coro *
+coro_ready_pop(struct coro_worker *w)
+{
+	struct coro *c = coro_ready_first(w);
+	if (c != NULL)
+		coro_ready_remove(w, c);
+	return c;
+}
+
+/** Wake up one sleeping worker of @a s, if any. */
+static void
+coro_workers_notify(struct coro_sched *s)
+{
+	/*
+	 * Pairs with the fence in coro_worker_next(): either the
+	 * worker sees the new coroutine, or it is seen idle here.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&s->idle_count, memory_order_relaxed) == 0)
+		return;
+	pthread_mutex_lock(&s->park_lock);
+	pthread_cond_signal(&s->park_cond);
+	pthread_mutex_unlock(&s->park_lock);
+}
+
+/** Put a coroutine into the shared queue of the workers. */
+static void
+coro_inject_push(struct coro_sched *s, struct coro *c)
+{
+	pthread_mutex_lock(&s->park_lock);
+	coro_queue_push(&s->inject, c);
+	atomic_fetch_add(&s->inject_count, 1);
+	pthread_cond_signal(&s->park_cond);
+	pthread_mutex_unlock(&s->park_lock);
+}
+
+/**
+ * Make a coroutine ready to run. Without worker threads it goes
+ * into the queue of the policy. With them - into the run queue of
+ * the current worker, or into the shared one, if the current
+ * thread is not a worker of the scheduler or its queue is full.
+ */
+static void
+coro_make_ready(struct coro *c)
+{
+	struct coro_sched *s = c->sched;
+	if (s->worker_count == 0) {
+		coro_ready_push(&s->main, c);
+		return;
+	}
+	assert(! c->is_ready);
+	c->is_ready = true;
+	struct coro_worker *w = coro_worker();
+	if (w != NULL && w->sched == s && w != &s->main &&
+	    coro_runq_push(&w->runq, c)) {
+		coro_workers_notify(s);
+		return;
+	}
+	coro_inject_push(s, c);
+}
+
+static inline void
+coro_sched_lock_in(struct coro_sched *s)
+{
+	if (s->worker_count > 0)
+		pthread_mutex_lock(&s->lock);
+}
+
+static inline void
+coro_sched_unlock_in(struct coro_sched *s)
+{
+	if (s->worker_count > 0)
+		pthread_mutex_unlock(&s->lock);
+}
+
+void
+coro_sched_lock(void)
+{
+	coro_sched_lock_in(coro_sched_current());
+}
+
+void
+coro_sched_unlock(void)
+{
+	coro_sched_unlock_in(coro_sched_current());
+}
+
+uint64_t
+coro_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Make a blocked coroutine ready. A thread with worker threads
+ * sleeps on the condition variable instead, it is woken up there.
+ */
+static void
+coro_wake(struct coro *c)
+{
+	struct coro_sched *s = c->sched;
+	if (s->worker_count > 0 && c->is_thread)
+		pthread_cond_broadcast(&s->thread_cond);
+	else
+		coro_make_ready(c);
+}
+
+/** Remember, when the wheel of @a s should be advanced next. */
+static void
+coro_timers_update(struct coro_sched *s, uint64_t now)
+{
+	uint64_t next = coro_wheel_next(&s->wheel);
+	uint64_t ticks = UINT64_MAX;
+	if (next != UINT64_MAX) {
+		ticks = coro_arch_ticks();
+		if (next > now) {
+			ticks = coro_ticks_after(ticks,
+						 coro_usec_to_ticks(next - now));
+		}
+	}
+	atomic_store_explicit(&s->timer_next, next, memory_order_relaxed);
+	atomic_store_explicit(&s->timer_next_ticks, ticks,
+			      memory_order_relaxed);
+}
+
+/**
+ * Wake up the coroutines, whose timeouts have expired. Under the
+ * scheduler lock.
+ */
+static void
+coro_timers_run(struct coro_sched *s)
+{
+	uint64_t now = coro_time();
+	struct coro_timer *t = coro_wheel_advance(&s->wheel, now);
+	while (t != NULL) {
+		struct coro_timer *next = t->next;
+		struct coro *c = (struct coro *)
+			((char *)t - offsetof(struct coro, timer));
+		/*
+		 * It could be woken up already, but have not disarmed
+		 * the timer yet.
+		 */
+		if (! c->is_ready && c->queue != NULL) {
+			c->is_timed_out = true;
+			coro_queue_remove(c);
+			coro_wake(c);
+		}
+		t = next;
+	}
+	coro_timers_update(s, now);
+}
+
+/** Expire the due timers, if any. Is cheap, when none are due. */
+static inline void
+coro_timers_check(struct coro_sched *s)
+{
+	uint64_t next = atomic_load_explicit(&s->timer_next_ticks,
+					     memory_order_relaxed);
+	/* Without timers don't even read the clock. */
+	if (next == UINT64_MAX || coro_arch_ticks() < next)
+		return;
+	coro_sched_lock_in(s);
+	coro_timers_run(s);
+	coro_sched_unlock_in(s);
+}
+
+int
+coro_status(const struct coro *c)
+{
+	return c->ret;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->is_finished;
+}
+
+const char *
+coro_name(const struct coro *c)
+{
+	return c->name;
+}
+
+size_t
+coro_stack_high_water(const struct coro *c)
+{
+	return c->stack_high_water;
+}
+
+struct coro_sched *
+coro_sched(const struct coro *c)
+{
+	return c->sched;
+}
+
+int
+coro_set_priority(struct coro *c, int priority)
+{
+	if (priority < CORO_PRIORITY_MIN || priority > CORO_PRIORITY_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct coro_sched *s = c->sched;
+	bool requeue = c->is_ready && s->worker_count == 0 &&
+		       s->policy == CORO_POLICY_PRIORITY;
+	if (requeue)
+		coro_ready_remove(&s->main, c);
+	c->priority = priority;
+	if (requeue)
+		coro_ready_push(&s->main, c);
+	return 0;
+}
+
+void
+coro_set_latency(struct coro *c, uint64_t usec)
+{
+	struct coro_sched *s = c->sched;
+	bool requeue = c->is_ready && s->worker_count == 0 &&
+		       s->policy == CORO_POLICY_EDF;
+	if (requeue)
+		coro_ready_remove(&s->main, c);
+	c->latency_ticks = coro_usec_to_ticks(usec);
+	c->is_deadline_fixed = false;
+	if (requeue)
+		coro_ready_push(&s->main, c);
+}
+
+void
+coro_set_deadline(struct coro *c, uint64_t usec)
+{
+	struct coro_sched *s = c->sched;
+	bool requeue = c->is_ready && s->worker_count == 0 &&
+		       s->policy == CORO_POLICY_EDF;
+	if (requeue)
+		coro_ready_remove(&s->main, c);
+	c->deadline = coro_ticks_after(coro_arch_ticks(),
+				       coro_usec_to_ticks(usec));
+	c->is_deadline_fixed = true;
+	if (requeue)
+		coro_ready_push(&s->main, c);
+}
+
+void
+coro_delete(struct coro *c)
+{
+	struct coro_sched *s = c->sched;
+	coro_sched_lock_in(s);
+	if (c->timer.is_armed)
+		coro_wheel_remove(&s->wheel, &c->timer);
+	if (c->is_ready) {
+		/* The run queues are lock-free and can't remove. */
+		assert(s->worker_count == 0);
+		coro_ready_remove(&s->main, c);
+	} else if (c->queue != NULL) {
+		coro_queue_remove(c);
+	}
+	if (! c->is_finished)
+		--s->count;
+	coro_sched_unlock_in(s);
+	if (c->is_stack_owned)
+		coro_stack_destroy(&c->stack);
+	free(c);
+}
+
+#ifdef CORO_SWITCH_SIGJMP
+static void
+coro_start(struct coro *c);
+#endif
+
+/**
+ * Save the current context into @a from and continue @a to.
+ * Returns, when somebody switches back to @a from.
+ */
+static inline void
+coro_switch(struct coro *from, struct coro *to)
+{
+#ifdef CORO_SWITCH_ASM
+	coro_arch_switch(&from->ctx, &to->ctx);
+#else
+	if (sigsetjmp(from->ctx, 0) == 0) {
+		if (to->is_started)
+			siglongjmp(to->ctx, 1);
+		coro_start(to);
+	}
+#endif
+}
+
+/** Start a new time quantum at @a now. */
+static inline void
+coro_slice_start(struct coro_worker *w, uint64_t now)
+{
+	w->slice_end = coro_ticks_after(now, w->sched->quantum_ticks);
+}
+
+/**
+ * The current slice of @a c on the worker @a w ends at @a now,
+ * record it, if the tracing is on.
+ */
+static inline void
+coro_trace_end(struct coro_worker *w, struct coro *c, uint64_t now,
+	       struct coro *next, enum coro_trace_reason reason)
+{
+	struct coro_trace *t = &w->sched->trace;
+	if (! atomic_load_explicit(&t->is_enabled, memory_order_relaxed) ||
+	    reason == CORO_TRACE_NONE)
+		return;
+	coro_trace_write(t, c->id, c->name, w->tid, w->switch_ticks, now,
+			 next->id, reason);
+}
+
+/**
+ * Switch the current coroutine of the worker @a w to an arbitrary
+ * one. Returns, maybe in another thread.
+ */
+static void
+coro_yield_to(struct coro_worker *w, struct coro *to,
+	      enum coro_trace_reason reason)
+{
+	struct coro *from = w->this;
+	++from->switch_count;
+	uint64_t now = coro_arch_ticks();
+	coro_trace_end(w, from, now, to, reason);
+	from->run_ticks += now - w->switch_ticks;
+	w->switch_ticks = now;
+	coro_slice_start(w, now);
+	/*
+	 * A request for the previous coroutine is not for this one.
+	 * Without the timers each safe point checks the ticks.
+	 */
+	coro_preempt_pending = w->sched->is_preempt_ticks;
+	coro_switch(from, to);
+	coro_worker()->this = from;
+}
+
+/**
+ * Nothing is ready to run. Sleep until the next timeout or an
+ * event of the poller.
+ */
+static void
+coro_sched_idle(struct coro_sched *s)
+{
+	struct coro_poller *p = s->poller;
+	bool has_events = p != NULL && p->pending > 0;
+	if (s->wheel.count == 0 && ! has_events) {
+		printf("Critical error - no coroutine to run!\n");
+		exit(-1);
+	}
+	uint64_t timeout = CORO_TIMEOUT_INFINITE;
+	if (s->wheel.count > 0) {
+		uint64_t now = coro_time();
+		uint64_t next = coro_wheel_next(&s->wheel);
+		timeout = next > now ? next - now : 0;
+	}
+	if (has_events) {
+		p->poll(p, timeout);
+	} else if (timeout > 0) {
+		struct timespec ts;
+		ts.tv_sec = timeout / 1000000;
+		ts.tv_nsec = timeout % 1000000 * 1000;
+		nanosleep(&ts, NULL);
+	}
+	coro_timers_run(s);
+}
+
+/**
+ * Wake up the coroutines, whose timeouts have expired, or whose
+ * events have come. If nothing is ready to run, sleep until
+ * something is.
+ */
+static inline void
+coro_poll(struct coro_worker *w)
+{
+	struct coro_sched *s = w->sched;
+	coro_timers_check(s);
+	struct coro_poller *p = s->poller;
+	if (p != NULL && p->pending > 0)
+		p->poll(p, 0);
+	while (w->ready_count == 0)
+		coro_sched_idle(s);
+}
+
+/**
+ * Mark the coroutine finished and hand it to whoever waits for
+ * it. Under the scheduler lock.
+ */
+static void
+coro_finish(struct coro *c)
+{
+	struct coro_sched *s = c->sched;
+	c->is_finished = true;
+	--s->count;
+	coro_wakeup_all(&c->waiters);
+	if (! c->is_joined) {
+		coro_queue_push(&s->finished, c);
+		coro_wakeup_all(&s->waiters);
+	}
+}
+
+/**
+ * Run one step of a stackless coroutine right on the current
+ * stack. It is not a switch of the current coroutine. The time
+ * since the last switch is the step's, so the caller should
+ * account the current one before the first step.
+ * @return What to do with the stackless one then: queue it again,
+ *         or release the lock, it has blocked or finished under.
+ */
+_Static_assert((int)CORO_STEP_YIELD == (int)CORO_TRACE_YIELD &&
+	       (int)CORO_STEP_WAIT == (int)CORO_TRACE_WAIT &&
+	       (int)CORO_STEP_DONE == (int)CORO_TRACE_FINISH,
+	       "a step result is its trace reason");
+
+static enum coro_worker_after
+coro_step_run(struct coro_worker *w, struct coro *c)
+{
+	struct coro *from = w->this;
+	w->this = c;
+	enum coro_step rc = c->step(c, c->func_arg);
+	w->this = from;
+	/* The clock is not cheap, read once per step. */
+	uint64_t now = coro_arch_ticks();
+	/* Is back in the scheduler, whoever runs next. */
+	coro_trace_end(w, c, now, &w->ctx, (enum coro_trace_reason)rc);
+	c->run_ticks += now - w->switch_ticks;
+	++c->switch_count;
+	w->switch_ticks = now;
+	switch (rc) {
+	case CORO_STEP_YIELD:
+		return CORO_AFTER_READY;
+	case CORO_STEP_WAIT:
+		assert(c->queue != NULL);
+		return CORO_AFTER_UNLOCK;
+	default:
+		assert(rc == CORO_STEP_DONE);
+		coro_sched_lock_in(c->sched);
+		coro_finish(c);
+		return CORO_AFTER_UNLOCK;
+	}
+}
+
+/**
+ * Give the control to the first ready coroutine. The current one
+ * should be already queued somewhere, or it never returns. Only
+ * without worker threads. The stackless coroutines on the way are
+ * run right here, on the stack of the current one.
+ */
+static void
+coro_run_next(struct coro_worker *w, enum coro_trace_reason reason)
+{
+	struct coro *to;
+	bool is_accounted = false;
+	while (true) {
+		coro_poll(w);
+		to = coro_ready_pop(w);
+		assert(to != NULL);
+		if (to->step == NULL)
+			break;
+		if (! is_accounted) {
+			uint64_t now = coro_arch_ticks();
+			coro_trace_end(w, w->this, now, to, reason);
+			w->this->run_ticks += now - w->switch_ticks;
+			w->switch_ticks = now;
+			is_accounted = true;
+		}
+		if (coro_step_run(w, to) == CORO_AFTER_READY)
+			coro_ready_push(w, to);
+	}
+	/*
+	 * With many coroutines each switch is a cache miss on
+	 * another stack. Start loading the one after next already.
+	 */
+	struct coro *next = coro_ready_first(w);
+	if (next != NULL) {
+		__builtin_prefetch(next);
+#ifdef CORO_SWITCH_ASM
+		__builtin_prefetch(next->ctx.sp);
+#endif
+	}
+	/* The slice of the current one has ended before the steps. */
+	if (is_accounted)
+		reason = CORO_TRACE_NONE;
+	if (to != w->this)
+		coro_yield_to(w, to, reason);
+	else
+		coro_slice_start(w, coro_arch_ticks());
+}
+
+/**
+ * Leave the current coroutine for the loop of its worker thread,
+ * which does @a after then.
+ */
+static inline void
+coro_worker_leave(struct coro_worker *w, enum coro_worker_after after,
+		  enum coro_trace_reason reason)
+{
+	w->after = after;
+	coro_yield_to(w, &w->ctx, reason);
+}
+
+void
+coro_yield(void)
+{
+	struct coro_worker *w = coro_worker();
+	assert(w->this->step == NULL);
+	if (w->sched->worker_count > 0) {
+		/* A thread has nobody to give the CPU to. */
+		if (! w->this->is_thread)
+			coro_worker_leave(w, CORO_AFTER_READY,
+					  CORO_TRACE_YIELD);
+		return;
+	}
+	struct coro_sched *s = w->sched;
+	struct coro_poller *p = s->poller;
+	if (w->ready_count == 0 && (p == NULL || p->pending == 0) &&
+	    s->wheel.count == 0) {
+		/* Nobody else wants to run - a new quantum. */
+		coro_slice_start(w, coro_arch_ticks());
+		return;
+	}
+	/*
+	 * The policy can choose the current coroutine again, then
+	 * it just gets a new quantum. The timers and the pending
+	 * events are checked on the way, without blocking, since it
+	 * is ready.
+	 */
+	coro_ready_push(w, w->this);
+	coro_run_next(w, CORO_TRACE_YIELD);
+}
+
+bool
+coro_yield_if_expired(void)
+{
+	if (coro_arch_ticks() < coro_worker()->slice_end)
+		return false;
+	coro_yield();
+	return true;
+}
+
+/**
+ * Workers, which run coroutines of @a s now. The worker threads,
+ * or the waiting thread without them.
+ */
+static struct coro_worker *
+coro_workers_active(struct coro_sched *s, int *count)
+{
+	if (s->worker_count == 0) {
+		*count = 1;
+		return &s->main;
+	}
+	*count = s->worker_count;
+	return s->workers;
+}
+
+static int
+coro_preempt_enable(struct coro_sched *s);
+
+static void
+coro_preempt_disable(struct coro_sched *s);
+
+void
+coro_sched_set_quantum(uint64_t usec)
+{
+	struct coro_sched *s = coro_sched_current();
+	s->quantum_usec = usec;
+	s->quantum_ticks = coro_usec_to_ticks(usec);
+	struct coro_worker *w = coro_worker();
+	if (w != NULL)
+		coro_slice_start(w, w->switch_ticks);
+	if (! s->is_preemptive)
+		return;
+	/* The timers or the tick checks, depending on the quantum. */
+	coro_preempt_disable(s);
+	if (usec != CORO_QUANTUM_INFINITE)
+		coro_preempt_enable(s);
+}
+
+int
+coro_sched_set_policy(enum coro_policy policy)
+{
+	struct coro_sched *s = coro_sched_current();
+	struct coro_worker *w = &s->main;
+	switch (policy) {
+	case CORO_POLICY_RR:
+		break;
+	case CORO_POLICY_PRIORITY:
+	case CORO_POLICY_EDF:
+		/* The run queues of the workers are FIFO only. */
+		if (s->worker_count > 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		/* All the coroutines and the scheduler can be ready. */
+		if (policy == CORO_POLICY_EDF &&
+		    coro_heap_reserve(w, s->count + 1) != 0)
+			return -1;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	struct coro_queue ready;
+	coro_queue_create(&ready);
+	struct coro *c;
+	while ((c = coro_ready_pop(w)) != NULL)
+		coro_queue_push(&ready, c);
+	s->policy = policy;
+	while ((c = coro_queue_pop(&ready)) != NULL)
+		coro_ready_push(w, c);
+	if (policy != CORO_POLICY_EDF)
+		coro_heap_free(w);
+	return 0;
+}
+
+enum coro_policy
+coro_sched_policy(void)
+{
+	return coro_sched_current()->policy;
+}
+
+/** Set the preemption timer period to the current quantum. */
+static int
+coro_preempt_arm(struct coro_worker *w)
+{
+	uint64_t usec = w->sched->quantum_usec;
+	struct itimerspec its;
+	its.it_interval.tv_sec = usec / 1000000;
+	its.it_interval.tv_nsec = usec % 1000000 * 1000;
+	its.it_value = its.it_interval;
+	return timer_settime(w->preempt_timer, 0, &its, NULL);
+}
+
+/** Create and arm the preemption timer of a worker. */
+static int
+coro_preempt_start(struct coro_worker *w)
+{
+	/*
+	 * The signal is delivered to the worker thread, not to any
+	 * in the process, because the flag is checked by it.
+	 */
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = CORO_PREEMPT_SIGNAL;
+	sev._sigev_un._tid = w->tid;
+	if (timer_create(CLOCK_MONOTONIC, &sev, &w->preempt_timer) != 0)
+		return -1;
+	if (coro_preempt_arm(w) != 0) {
+		timer_delete(w->preempt_timer);
+		return -1;
+	}
+	w->is_preemptive = true;
+	return 0;
+}
+
+static void
+coro_preempt_stop(struct coro_worker *w)
+{
+	if (! w->is_preemptive)
+		return;
+	timer_delete(w->preempt_timer);
+	w->is_preemptive = false;
+}
+
+/** Timer signal handler. Only raises the flag of its thread. */
+static void
+coro_preempt_handler(int signum)
+{
+	(void)signum;
+	coro_preempt_pending = 1;
+}
+
+static int
+coro_preempt_enable(struct coro_sched *s)
+{
+	if (s->is_preemptive)
+		return 0;
+	if (s->quantum_usec == CORO_QUANTUM_INFINITE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (s->quantum_usec < CORO_PREEMPT_MIN_USEC) {
+		/*
+		 * The signals would come more often, than the code
+		 * between them runs. The flag just stays raised.
+		 */
+		s->is_preempt_ticks = true;
+		s->is_preemptive = true;
+		coro_preempt_pending = 1;
+		return 0;
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = coro_preempt_handler;
+	/* Don't break syscalls of the coroutines with EINTR. */
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(CORO_PREEMPT_SIGNAL, &sa, NULL) != 0)
+		return -1;
+	int count;
+	struct coro_worker *workers = coro_workers_active(s, &count);
+	for (int i = 0; i < count; ++i) {
+		if (coro_preempt_start(&workers[i]) != 0) {
+			while (--i >= 0)
+				coro_preempt_stop(&workers[i]);
+			return -1;
+		}
+	}
+	s->is_preemptive = true;
+	return 0;
+}
+
+static void
+coro_preempt_disable(struct coro_sched *s)
+{
+	if (! s->is_preemptive)
+		return;
+	int count;
+	struct coro_worker *workers = coro_workers_active(s, &count);
+	for (int i = 0; i < count; ++i)
+		coro_preempt_stop(&workers[i]);
+	s->is_preemptive = false;
+	s->is_preempt_ticks = false;
+	coro_preempt_pending = 0;
+}
+
+int
+coro_sched_enable_preemption(void)
+{
+	return coro_preempt_enable(coro_sched_current());
+}
+
+void
+coro_sched_disable_preemption(void)
+{
+	coro_preempt_disable(coro_sched_current());
+}
+
+void
+coro_preempt_yield(void)
+{
+	struct coro_worker *w = coro_worker();
+	if (w != NULL && w->sched->is_preempt_ticks) {
+		coro_yield_if_expired();
+		return;
+	}
+	coro_preempt_pending = 0;
+	coro_yield();
+}
+
+void
+coro_stats(const struct coro *c, struct coro_stats *stats)
+{
+	uint64_t ticks = c->run_ticks;
+	/* The current one is running right now. */
+	struct coro_worker *w = coro_worker();
+	if (w != NULL && c == w->this)
+		ticks += coro_arch_ticks() - w->switch_ticks;
+	stats->run_time = ticks == 0 ? 0 :
+			  (uint64_t)(ticks * coro_arch_ns_per_tick());
+	stats->switch_count = c->switch_count;
+}
 
-/** Add a new coroutine to the beginning of the list. */
+/** Prepare a scheduler of a thread, before it runs anything. */
 static void
-coro_list_add(struct coro *c)
+coro_worker_create(struct coro_worker *w, struct coro_sched *s)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	memset(w, 0, sizeof(*w));
+	w->sched = s;
+	w->ctx.sched = s;
+	w->ctx.is_started = true;
+	w->ctx.is_thread = true;
+	w->ctx.priority = CORO_PRIORITY_DEFAULT;
+	w->ctx.latency_ticks = UINT64_MAX;
+	coro_timer_create(&w->ctx.timer);
+	w->this = &w->ctx;
+	for (int i = 0; i <= CORO_PRIORITY_MAX; ++i)
+		coro_queue_create(&w->ready_prio[i]);
+	coro_runq_create(&w->runq);
+	w->switch_ticks = coro_arch_ticks();
+	coro_slice_start(w, w->switch_ticks);
 }
 
-/** Remove a coroutine from the list. */
+/** Initialize an empty scheduler without threads. */
 static void
-coro_list_delete(struct coro *c)
+coro_sched_create(struct coro_sched *s)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	memset(s, 0, sizeof(*s));
+	s->quantum_usec = CORO_QUANTUM_INFINITE;
+	s->quantum_ticks = UINT64_MAX;
+	s->policy = CORO_POLICY_RR;
+	coro_worker_create(&s->main, s);
+	/* The thread, which waits for the coroutines, in the traces. */
+	strcpy(s->main.ctx.name, "main");
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->thread_cond, NULL);
+	pthread_mutex_init(&s->park_lock, NULL);
+	/* The idle workers sleep till the next timeout. */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->park_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	coro_wheel_create(&s->wheel, coro_time());
+	atomic_init(&s->timer_next, UINT64_MAX);
+	atomic_init(&s->timer_next_ticks, UINT64_MAX);
+	coro_trace_create(&s->trace);
+	coro_queue_create(&s->waiters);
+	coro_queue_create(&s->finished);
+	coro_queue_create(&s->inject);
+	atomic_init(&s->inject_count, 0);
+	atomic_init(&s->idle_count, 0);
 }
 
-int
-coro_status(const struct coro *c)
+/** Free everything, but the scheduler itself. */
+static void
+coro_sched_destroy(struct coro_sched *s)
 {
-	return c->ret;
+	/* The workers are stopped with coro_sched_set_workers(0). */
+	assert(s->worker_count == 0);
+	coro_preempt_disable(s);
+	if (s->poller != NULL)
+		s->poller->destroy(s->poller);
+	coro_trace_destroy(&s->trace);
+	coro_heap_free(&s->main);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->thread_cond);
+	pthread_mutex_destroy(&s->park_lock);
+	pthread_cond_destroy(&s->park_cond);
 }
 
-long long
-coro_switch_count(const struct coro *c)
+void
+coro_sched_init(void)
 {
-	return c->switch_count;
+	static bool is_created = false;
+	if (is_created)
+		coro_sched_destroy(&coro_sched_default);
+	is_created = true;
+	coro_sched_create(&coro_sched_default);
+	coro_worker_ptr = NULL;
+	coro_sched_enter(&coro_sched_default);
 }
 
-bool
-coro_is_finished(const struct coro *c)
+struct coro_sched *
+coro_sched_new(void)
 {
-	return c->is_finished;
+	struct coro_sched *s = (struct coro_sched *) malloc(sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	coro_sched_create(s);
+	return s;
 }
 
 void
-coro_delete(struct coro *c)
+coro_sched_delete(struct coro_sched *s)
 {
-	free(c->stack);
-	free(c);
+	assert(s != &coro_sched_default);
+	assert(s->count == 0);
+	assert(coro_worker() != &s->main);
+	struct coro *c;
+	while ((c = coro_queue_pop(&s->finished)) != NULL)
+		coro_delete(c);
+	coro_sched_destroy(s);
+	free(s);
+}
+
+struct coro_sched *
+coro_sched_enter(struct coro_sched *s)
+{
+	struct coro_worker *w = coro_worker();
+	struct coro_sched *prev = w != NULL ? w->sched : NULL;
+	if (prev == s)
+		return prev;
+	if (s == NULL) {
+		coro_worker_ptr = NULL;
+		return prev;
+	}
+	/* Only one thread can wait for the coroutines at once. */
+	assert(s->main.this == &s->main.ctx);
+	s->main.tid = gettid();
+	s->main.thread = pthread_self();
+	s->main.switch_ticks = coro_arch_ticks();
+	coro_slice_start(&s->main, s->main.switch_ticks);
+	coro_worker_ptr = &s->main;
+	return prev;
+}
+
+/**
+ * Find a coroutine for the worker: in its own run queue, in the
+ * shared one, or in the run queue of another worker. Sleep, if
+ * there is nothing.
+ * @return The coroutine, or NULL, when the workers are stopped.
+ */
+static struct coro *
+coro_worker_next(struct coro_worker *w)
+{
+	struct coro_sched *s = w->sched;
+	while (true) {
+		coro_timers_check(s);
+		struct coro *c = coro_runq_pop(&w->runq);
+		if (c != NULL)
+			return c;
+		if (atomic_load_explicit(&s->inject_count,
+					 memory_order_relaxed) > 0) {
+			pthread_mutex_lock(&s->park_lock);
+			c = coro_queue_pop(&s->inject);
+			if (c != NULL)
+				atomic_fetch_sub(&s->inject_count, 1);
+			pthread_mutex_unlock(&s->park_lock);
+			if (c != NULL)
+				return c;
+		}
+		/* Start from a random victim to spread the stealing. */
+		int start = rand_r(&w->seed) % s->worker_count;
+		for (int i = 0; i < s->worker_count; ++i) {
+			struct coro_worker *victim =
+				&s->workers[(start + i) % s->worker_count];
+			if (victim == w)
+				continue;
+			c = coro_runq_steal(&w->runq, &victim->runq);
+			if (c != NULL)
+				return c;
+		}
+		pthread_mutex_lock(&s->park_lock);
+		atomic_fetch_add(&s->idle_count, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		bool has_work = s->is_stopping ||
+				! coro_queue_is_empty(&s->inject);
+		for (int i = 0; i < s->worker_count && ! has_work; ++i)
+			has_work = ! coro_runq_is_empty(&s->workers[i].runq);
+		uint64_t next = atomic_load_explicit(&s->timer_next,
+						     memory_order_relaxed);
+		if (has_work) {
+			/* Go take it. */
+		} else if (next == UINT64_MAX) {
+			pthread_cond_wait(&s->park_cond, &s->park_lock);
+		} else {
+			struct timespec ts;
+			ts.tv_sec = next / 1000000;
+			ts.tv_nsec = next % 1000000 * 1000;
+			pthread_cond_timedwait(&s->park_cond, &s->park_lock,
+					       &ts);
+		}
+		atomic_fetch_sub(&s->idle_count, 1);
+		bool is_stopping = s->is_stopping;
+		pthread_mutex_unlock(&s->park_lock);
+		if (is_stopping)
+			return NULL;
+	}
+}
+
+/** Worker thread: run the coroutines until stopped. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = (struct coro_worker *)arg;
+	struct coro_sched *s = w->sched;
+	coro_worker_ptr = w;
+	pthread_mutex_lock(&s->park_lock);
+	w->tid = gettid();
+	pthread_cond_broadcast(&s->park_cond);
+	/* Don't run anything until all the workers are created. */
+	while (s->is_starting)
+		pthread_cond_wait(&s->park_cond, &s->park_lock);
+	/* Some other worker could not be created. */
+	bool is_stopping = s->is_stopping;
+	pthread_mutex_unlock(&s->park_lock);
+	if (is_stopping)
+		return NULL;
+	w->switch_ticks = coro_arch_ticks();
+	struct coro *c;
+	while ((c = coro_worker_next(w)) != NULL) {
+		while (c != NULL) {
+			/* A busy worker can't wait for the idle ones. */
+			coro_timers_check(s);
+			c->is_ready = false;
+			enum coro_worker_after after;
+			if (c->step != NULL) {
+				after = coro_step_run(w, c);
+			} else {
+				coro_yield_to(w, c, CORO_TRACE_RUN);
+				after = w->after;
+				w->after = CORO_AFTER_NOTHING;
+			}
+			if (after == CORO_AFTER_UNLOCK) {
+				pthread_mutex_unlock(&s->lock);
+				c = NULL;
+			} else if (after == CORO_AFTER_READY &&
+				   (! coro_runq_is_empty(&w->runq) ||
+				    atomic_load_explicit(&s->inject_count,
+					memory_order_relaxed) > 0)) {
+				coro_make_ready(c);
+				c = NULL;
+			}
+			/*
+			 * Otherwise nobody else is waiting here, and
+			 * the yielded one continues without queuing.
+			 */
+		}
+	}
+	return NULL;
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+/**
+ * Stop and free the worker threads. The coroutines, which they
+ * have not taken, go back to the waiting thread.
+ */
 static void
-coro_yield_to(struct coro *to)
+coro_workers_stop(struct coro_sched *s)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	pthread_mutex_lock(&s->park_lock);
+	s->is_stopping = true;
+	s->is_starting = false;
+	pthread_cond_broadcast(&s->park_cond);
+	pthread_mutex_unlock(&s->park_lock);
+	for (int i = 0; i < s->worker_count; ++i)
+		pthread_join(s->workers[i].thread, NULL);
+	s->is_stopping = false;
+	for (int i = 0; i < s->worker_count; ++i)
+		assert(coro_runq_is_empty(&s->workers[i].runq));
+	s->worker_count = 0;
+	free(s->workers);
+	s->workers = NULL;
+	struct coro *c;
+	while ((c = coro_queue_pop(&s->inject)) != NULL) {
+		c->is_ready = false;
+		coro_ready_push(&s->main, c);
+	}
+	atomic_store(&s->inject_count, 0);
+}
+
+int
+coro_sched_set_workers(int count)
+{
+	struct coro_sched *s = coro_sched_current();
+	struct coro_worker *mw = &s->main;
+	assert(coro_worker() == mw && mw->this == &mw->ctx);
+	if (count < 0 || (count > 0 && s->policy != CORO_POLICY_RR)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (count == s->worker_count)
+		return 0;
+	if (s->worker_count > 0) {
+		coro_sched_lock_in(s);
+		long long alive = s->count;
+		coro_sched_unlock_in(s);
+		if (alive > 0) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+	bool is_preemptive = s->is_preemptive;
+	coro_preempt_disable(s);
+	if (s->worker_count > 0)
+		coro_workers_stop(s);
+	int rc = 0;
+	if (count > 0) {
+		/* Calibrate the ticks once, before the threads race. */
+		coro_arch_ns_per_tick();
+		s->workers = (struct coro_worker *)
+			calloc(count, sizeof(*s->workers));
+		if (s->workers == NULL) {
+			rc = -1;
+			goto out;
+		}
+		/* Ready coroutines of this thread go to the workers. */
+		struct coro *c;
+		while ((c = coro_ready_pop(mw)) != NULL) {
+			coro_queue_push(&s->inject, c);
+			c->is_ready = true;
+			atomic_fetch_add(&s->inject_count, 1);
+		}
+		for (int i = 0; i < count; ++i) {
+			coro_worker_create(&s->workers[i], s);
+			s->workers[i].seed = i + 1;
+		}
+		s->is_starting = true;
+		s->worker_count = 0;
+		for (int i = 0; i < count; ++i) {
+			int err = pthread_create(&s->workers[i].thread,
+						 NULL, coro_worker_f,
+						 &s->workers[i]);
+			if (err != 0) {
+				coro_workers_stop(s);
+				errno = err;
+				rc = -1;
+				goto out;
+			}
+			++s->worker_count;
+		}
+		/* Their thread IDs are needed for the preemption. */
+		pthread_mutex_lock(&s->park_lock);
+		for (int i = 0; i < count; ++i) {
+			while (s->workers[i].tid == 0)
+				pthread_cond_wait(&s->park_cond,
+						  &s->park_lock);
+		}
+		s->is_starting = false;
+		pthread_cond_broadcast(&s->park_cond);
+		pthread_mutex_unlock(&s->park_lock);
+	}
+out:
+	if (is_preemptive && coro_preempt_enable(s) != 0)
+		rc = -1;
+	return rc;
+}
+
+int
+coro_sched_workers(void)
+{
+	return coro_sched_current()->worker_count;
 }
 
 void
-coro_yield(void)
+coro_sched_set_poller(struct coro_poller *p)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+	coro_sched_current()->poller = p;
+}
+
+struct coro_poller *
+coro_sched_poller(void)
+{
+	return coro_sched_current()->poller;
+}
+
+int
+coro_sched_enable_tracing(size_t capacity)
+{
+	struct coro_sched *s = coro_sched_current();
+	struct coro_trace *t = &s->trace;
+	if (capacity == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* The workers could be writing into the old buffer. */
+	if (s->worker_count > 0 && t->slices != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (coro_trace_start(t, capacity, coro_arch_ticks()) != 0)
+		return -1;
+	atomic_store(&t->is_enabled, true);
+	return 0;
 }
 
 void
-coro_sched_init(void)
+coro_sched_disable_tracing(void)
+{
+	struct coro_sched *s = coro_sched_current();
+	atomic_store(&s->trace.is_enabled, false);
+	if (s->worker_count == 0)
+		coro_trace_destroy(&s->trace);
+}
+
+int
+coro_sched_dump_trace(const char *path)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	struct coro_sched *s = coro_sched_current();
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	int rc = coro_trace_dump(&s->trace, f, coro_arch_ns_per_tick());
+	if (fclose(f) != 0)
+		rc = -1;
+	return rc;
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	struct coro_sched *s = coro_sched_current();
+	coro_sched_lock_in(s);
+	while (coro_queue_is_empty(&s->finished)) {
+		if (s->count == 0) {
+			coro_sched_unlock_in(s);
+			return NULL;
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
+		/*
+		 * Sleep until a coroutine finishes and wakes the
+		 * scheduler up.
+		 */
+		coro_wait(&s->waiters);
 	}
-	return NULL;
+	struct coro *c = coro_queue_pop(&s->finished);
+	coro_sched_unlock_in(s);
+	return c;
+}
+
+struct coro *
+coro_sched_wait_in(struct coro_sched *s)
+{
+	struct coro_sched *prev = coro_sched_enter(s);
+	struct coro *c = coro_sched_wait();
+	coro_sched_enter(prev);
+	return c;
+}
+
+void
+coro_sched_run(struct coro_sched *s)
+{
+	struct coro_sched *prev = coro_sched_enter(s);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_sched_enter(prev);
+}
+
+long long
+coro_sched_count(const struct coro_sched *s)
+{
+	return s->count;
+}
+
+int
+coro_join(struct coro *c)
+{
+	struct coro_sched *s = c->sched;
+	coro_sched_lock_in(s);
+	assert(c != coro_worker()->this);
+	c->is_joined = true;
+	if (! c->is_finished)
+		coro_wait(&c->waiters);
+	else if (c->queue == &s->finished)
+		coro_queue_remove(c);
+	int ret = c->ret;
+	coro_sched_unlock_in(s);
+	return ret;
+}
+
+void
+coro_queue_create(struct coro_queue *q)
+{
+	q->first = q->last = NULL;
+}
+
+void
+coro_wait(struct coro_queue *q)
+{
+	struct coro_worker *w = coro_worker();
+	struct coro *self = w->this;
+	struct coro_sched *s = w->sched;
+	assert(self->step == NULL);
+	coro_queue_push(q, self);
+	if (s->worker_count == 0) {
+		coro_run_next(w, CORO_TRACE_WAIT);
+		return;
+	}
+	if (self->is_thread) {
+		/* The waker takes it out of the queue. */
+		while (self->queue == q)
+			pthread_cond_wait(&s->thread_cond, &s->lock);
+		return;
+	}
+	coro_worker_leave(w, CORO_AFTER_UNLOCK, CORO_TRACE_WAIT);
+	pthread_mutex_lock(&s->lock);
+}
+
+bool
+coro_wait_deadline(struct coro_queue *q, uint64_t deadline)
+{
+	if (deadline == UINT64_MAX) {
+		coro_wait(q);
+		return true;
+	}
+	struct coro_worker *w = coro_worker();
+	struct coro *self = w->this;
+	struct coro_sched *s = w->sched;
+	uint64_t now = coro_time();
+	if (deadline <= now)
+		return false;
+	/* After a long pause the empty wheel just jumps forward. */
+	if (s->wheel.count == 0)
+		coro_wheel_advance(&s->wheel, now);
+	self->is_timed_out = false;
+	uint64_t next = atomic_load_explicit(&s->timer_next,
+					     memory_order_relaxed);
+	coro_wheel_add(&s->wheel, &self->timer, deadline);
+	coro_timers_update(s, now);
+	/* The idle workers should sleep not longer than till then. */
+	if (s->worker_count > 0 && deadline < next)
+		coro_workers_notify(s);
+	coro_wait(q);
+	if (self->timer.is_armed)
+		coro_wheel_remove(&s->wheel, &self->timer);
+	return ! self->is_timed_out;
+}
+
+bool
+coro_wait_timeout(struct coro_queue *q, uint64_t usec)
+{
+	uint64_t deadline = UINT64_MAX;
+	if (usec != CORO_TIMEOUT_INFINITE)
+		deadline = coro_time() + usec;
+	return coro_wait_deadline(q, deadline);
+}
+
+void
+coro_sleep(uint64_t usec)
+{
+	struct coro_queue q;
+	coro_queue_create(&q);
+	uint64_t deadline = UINT64_MAX;
+	if (usec != CORO_TIMEOUT_INFINITE)
+		deadline = coro_time() + usec;
+	coro_sched_lock();
+	/* Nobody else knows the queue to wake it up. */
+	while (coro_wait_deadline(&q, deadline))
+		;
+	coro_sched_unlock();
+}
+
+bool
+coro_wakeup(struct coro_queue *q)
+{
+	struct coro *c = coro_queue_pop(q);
+	if (c == NULL)
+		return false;
+	coro_wake(c);
+	return true;
+}
+
+void
+coro_wakeup_all(struct coro_queue *q)
+{
+	while (coro_wakeup(q))
+		;
 }
 
 struct coro *
 coro_this(void)
 {
-	return coro_this_ptr;
+	return coro_worker()->this;
+}
+
+/**
+ * Coroutine entry point. Works on the coroutine's own stack, runs
+ * the user function, and never returns.
+ */
+static void
+coro_main(void *arg)
+{
+	struct coro *c = (struct coro *) arg;
+	struct coro_sched *s = c->sched;
+	coro_worker()->this = c;
+	c->ret = c->func(c->func_arg);
+	if (c->is_stack_painted) {
+		c->stack_high_water = coro_stack_used(&c->stack);
+		printf("Coroutine '%s': stack high-water mark %zu of %zu "
+		       "bytes\n", c->name, c->stack_high_water,
+		       c->stack.size);
+	}
+	coro_sched_lock_in(s);
+	coro_finish(c);
+	/* Can not return - 'ret' address is invalid already! */
+	struct coro_worker *w = coro_worker();
+	if (s->worker_count > 0)
+		coro_worker_leave(w, CORO_AFTER_UNLOCK, CORO_TRACE_FINISH);
+	else
+		coro_run_next(w, CORO_TRACE_FINISH);
+	abort();
 }
 
+#ifdef CORO_BACKEND_SIGNAL
+
 /**
  * The core part of the coroutines creation - this signal handler
  * is run on a separate stack using sigaltstack. On an invokation
@@ -157,11 +1876,26 @@ coro_this(void)
  * coroutine constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum)
+coro_body(int signum, siginfo_t *info, void *context)
 {
 	(void)signum;
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
+	(void)info;
+	/*
+	 * The handler never returns, and the interrupted frame in
+	 * the constructor soon becomes garbage. Hide it from stack
+	 * unwinders (backtrace() in heap_help, for instance), so
+	 * they stop at the signal frame instead of walking there.
+	 */
+	ucontext_t *uc = (ucontext_t *)context;
+#if defined(__x86_64__)
+	uc->uc_mcontext.gregs[REG_RIP] = 0;
+#elif defined(__aarch64__)
+	uc->uc_mcontext.pc = 0;
+#else
+	(void)uc;
+#endif
+	struct coro *c = start_coro;
+	start_coro = NULL;
 	/*
 	 * On an invokation jump back to the constructor right
 	 * after remembering the context.
@@ -172,30 +1906,17 @@ coro_body(int signum)
 	 * If the execution is here, then the coroutine should
 	 * finaly start work.
 	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
-	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_main(c);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * Prepare the coroutine context right on its stack via a signal
+ * handler called on an alternative stack.
+ */
+static void
+coro_prepare(struct coro *c)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
+	pthread_mutex_lock(&start_lock);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -203,7 +1924,7 @@ coro_new(coro_f func, void *func_arg)
 	sigset_t news, olds, suss;
 	sigemptyset(&news);
 	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+	if (pthread_sigmask(SIG_BLOCK, &news, &olds) != 0)
 		handle_error();
 	/*
 	 * New handler should jump onto a new stack and remember
@@ -211,28 +1932,27 @@ coro_new(coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
+	newsa.sa_sigaction = coro_body;
+	newsa.sa_flags = SA_ONSTACK | SA_SIGINFO;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
+	newst.ss_sp = c->stack.base;
+	newst.ss_size = c->stack.size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
+	start_coro = c;
 	sigemptyset(&suss);
 	if (sigsetjmp(start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
+		/* To this thread, not to any in the process. */
+		pthread_kill(pthread_self(), SIGUSR2);
+		while (start_coro != NULL)
 			sigsuspend(&suss);
 	}
-	coro_this_ptr = old_this;
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
@@ -249,10 +1969,253 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
 		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+	if (pthread_sigmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+	pthread_mutex_unlock(&start_lock);
+	c->is_started = true;
+}
+
+static void
+coro_start(struct coro *c)
+{
+	/* The context is always prepared by the constructor. */
+	(void)c;
+	abort();
+}
+
+#elif defined(CORO_SWITCH_ASM)
+
+/**
+ * Build the initial register frame right on the coroutine stack.
+ * No syscalls, the first switch simply "returns" into the body.
+ */
+static void
+coro_prepare(struct coro *c)
+{
+	coro_arch_prepare(&c->ctx, coro_stack_top(&c->stack),
+			  coro_main, c);
+	c->is_started = true;
+}
+
+#else /* CORO_SWITCH_SIGJMP */
+
+/**
+ * Nothing to prepare - the context is built lazily on the first
+ * switch to the coroutine.
+ */
+static void
+coro_prepare(struct coro *c)
+{
+	(void)c;
+}
+
+/**
+ * Start the coroutine from scratch on its own stack. Called
+ * instead of siglongjmp() on the first switch to it, so the
+ * creation costs no syscalls at all.
+ */
+static void
+coro_start(struct coro *c)
+{
+	c->is_started = true;
+	coro_arch_start(coro_stack_top(&c->stack), coro_main, c);
+}
 
-	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+#endif /* CORO_SWITCH_SIGJMP */
+
+void
+coro_attr_create(struct coro_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->stack_size = CORO_STACK_SIZE_DEFAULT;
+	attr->priority = CORO_PRIORITY_DEFAULT;
+	attr->latency = CORO_LATENCY_INFINITE;
+#ifdef CORO_STACK_DEBUG
+	attr->stack_debug = true;
+#endif
+}
+
+/**
+ * Validate the attributes of a new coroutine in @a s.
+ * @retval 0 Success.
+ * @retval -1 Invalid attributes or no memory, errno is set.
+ */
+static int
+coro_new_check(struct coro_sched *s, const struct coro_attr *attr)
+{
+	if (attr->priority < CORO_PRIORITY_MIN ||
+	    attr->priority > CORO_PRIORITY_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* The coroutine and the scheduler are going to be ready. */
+	if (s->worker_count == 0 && s->policy == CORO_POLICY_EDF &&
+	    coro_heap_reserve(&s->main, s->count + 2) != 0)
+		return -1;
+	return 0;
+}
+
+/** Fill the fields, which don't depend on the coroutine kind. */
+static void
+coro_init(struct coro *c, struct coro_sched *s,
+	  const struct coro_attr *attr)
+{
+	if (attr->name != NULL) {
+		strncpy(c->name, attr->name, CORO_NAME_MAX - 1);
+		c->name[CORO_NAME_MAX - 1] = 0;
+	} else {
+		c->name[0] = 0;
+	}
+	c->ret = 0;
+	c->id = atomic_fetch_add_explicit(&coro_id_last, 1,
+					  memory_order_relaxed) + 1;
+	c->sched = s;
+	c->step = NULL;
+	c->step_point = 0;
+	c->is_started = false;
+	c->is_finished = false;
+	c->is_joined = attr->joinable;
+	c->is_thread = false;
+	coro_timer_create(&c->timer);
+	c->is_timed_out = false;
+	c->waiters.first = c->waiters.last = NULL;
+	c->switch_count = 0;
+	c->run_ticks = 0;
+	c->priority = attr->priority;
+	c->latency_ticks = coro_usec_to_ticks(attr->latency);
+	c->deadline = UINT64_MAX;
+	c->is_deadline_fixed = false;
+	c->is_ready = false;
+	c->queue = NULL;
+}
+
+/** Hand a new coroutine to its scheduler. */
+static void
+coro_add(struct coro *c)
+{
+	struct coro_sched *s = c->sched;
+	coro_sched_lock_in(s);
+	++s->count;
+	coro_make_ready(c);
+	coro_sched_unlock_in(s);
+}
+
+struct coro *
+coro_new_in(struct coro_sched *s, coro_f func, void *func_arg,
+	    const struct coro_attr *attr)
+{
+	struct coro_attr defaults;
+	if (attr == NULL) {
+		coro_attr_create(&defaults);
+		attr = &defaults;
+	}
+	if (coro_new_check(s, attr) != 0)
+		return NULL;
+	size_t stack_size = attr->stack_size;
+	if (attr->stack == NULL) {
+		if (stack_size < CORO_STACK_SIZE_MIN)
+			stack_size = CORO_STACK_SIZE_MIN;
+#ifdef CORO_BACKEND_SIGNAL
+		if (stack_size < (size_t)SIGSTKSZ)
+			stack_size = SIGSTKSZ;
+#endif
+	}
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	if (attr->stack != NULL) {
+		c->stack.base = attr->stack;
+		c->stack.size = stack_size;
+		c->is_stack_owned = false;
+	} else if (coro_stack_create(&c->stack, stack_size) != 0) {
+		free(c);
+		return NULL;
+	} else {
+		c->is_stack_owned = true;
+	}
+	c->is_stack_painted = attr->stack_debug;
+	if (c->is_stack_painted)
+		coro_stack_paint(&c->stack);
+	c->stack_high_water = 0;
+	coro_init(c, s, attr);
+	c->func = func;
+	c->func_arg = func_arg;
+	coro_prepare(c);
+	coro_add(c);
+	return c;
+}
+
+struct coro *
+coro_new_stackless_in(struct coro_sched *s, coro_step_f func,
+		      void *func_arg, const struct coro_attr *attr)
+{
+	struct coro_attr defaults;
+	if (attr == NULL) {
+		coro_attr_create(&defaults);
+		attr = &defaults;
+	}
+	if (coro_new_check(s, attr) != 0)
+		return NULL;
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	memset(&c->stack, 0, sizeof(c->stack));
+	memset(&c->ctx, 0, sizeof(c->ctx));
+	c->is_stack_owned = false;
+	c->is_stack_painted = false;
+	c->stack_high_water = 0;
+	coro_init(c, s, attr);
+	c->func = NULL;
+	c->func_arg = func_arg;
+	c->step = func;
+	/* Is never switched to, so counts as started. */
+	c->is_started = true;
+	coro_add(c);
+	return c;
+}
+
+struct coro *
+coro_new_stackless(coro_step_f func, void *func_arg,
+		   const struct coro_attr *attr)
+{
+	return coro_new_stackless_in(coro_sched_current(), func, func_arg,
+				     attr);
+}
+
+int *
+coro_step_point(struct coro *c)
+{
+	return &c->step_point;
+}
+
+void
+coro_step_wait(struct coro_queue *q)
+{
+	struct coro *self = coro_worker()->this;
+	assert(self->step != NULL);
+	coro_queue_push(q, self);
+}
+
+enum coro_step
+coro_step_exit(struct coro *c, int status)
+{
+	c->ret = status;
+	return CORO_STEP_DONE;
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	return coro_new_in(coro_sched_current(), func, func_arg, attr);
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	struct coro *c = coro_new_ex(func, func_arg, &attr);
+	if (c == NULL)
+		handle_error();
 	return c;
 }
@@ -1,14 +1,81 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
 
 struct coro;
+struct coro_sched;
 typedef int (*coro_f)(void *);
 
-/** Make current context scheduler. */
+/**
+ * Intrusive FIFO of coroutines. The blocked coroutines are kept in
+ * a queue of the object they wait for. Each coroutine is in one
+ * queue at most, so the links are stored right in it.
+ */
+struct coro_queue {
+	struct coro *first, *last;
+};
+
+/**
+ * Make current context scheduler. It is the default one, used by
+ * the threads which have not entered another with
+ * coro_sched_enter().
+ */
 void
 coro_sched_init(void);
 
+/**
+ * Create a scheduler. It is an independent group of coroutines
+ * with its own ready and finished queues, policy, quantum,
+ * preemption timers, and worker threads. Only the stack pool is
+ * shared by all of them.
+ *
+ * The functions without a scheduler argument work with the
+ * current one: of the running coroutine, or entered by the thread,
+ * or the default one. So coro_new() from a coroutine creates a
+ * sibling in the same scheduler. The queues of coro_wait() and the
+ * synchronization primitives should be used within one scheduler.
+ * @retval NULL Error, errno is set.
+ */
+struct coro_sched *
+coro_sched_new(void);
+
+/**
+ * Free a scheduler created by coro_sched_new(). It must have no
+ * not finished coroutines and no workers. The finished ones, not
+ * returned by coro_sched_wait(), are deleted.
+ */
+void
+coro_sched_delete(struct coro_sched *s);
+
+/**
+ * Make @a s the current scheduler of the calling thread, so it
+ * waits for the coroutines of @a s and runs them, unless @a s has
+ * worker threads. Only one thread can be in a scheduler at once.
+ * NULL leaves the current one.
+ * @return The previous scheduler of the thread, to return to.
+ */
+struct coro_sched *
+coro_sched_enter(struct coro_sched *s);
+
+/** coro_sched_wait() for the coroutines of @a s. */
+struct coro *
+coro_sched_wait_in(struct coro_sched *s);
+
+/** Run the coroutines of @a s until all finish and delete them. */
+void
+coro_sched_run(struct coro_sched *s);
+
+/** Number of not finished coroutines of @a s. */
+long long
+coro_sched_count(const struct coro_sched *s);
+
+/** Scheduler the coroutine belongs to. */
+struct coro_sched *
+coro_sched(const struct coro *c);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
  * if no coroutines.
@@ -16,6 +83,212 @@ coro_sched_init(void);
 struct coro *
 coro_sched_wait(void);
 
+/**
+ * Block the current coroutine until @a c finishes, and return
+ * its status. Works from any coroutine, including the scheduler.
+ * A joined coroutine is never returned by coro_sched_wait() - the
+ * joiner owns it and should delete it. When several coroutines
+ * join the same one, only one of them should delete it, after all
+ * have returned. To join a coroutine, which can finish before the
+ * join is called, create it with attr.joinable.
+ */
+int
+coro_join(struct coro *c);
+
+/** Coroutines are never forced to yield by the quantum. */
+#define CORO_QUANTUM_INFINITE UINT64_MAX
+
+/**
+ * Set the time quantum in microseconds. After that much time a
+ * running coroutine is considered expired by
+ * coro_yield_if_expired(). By default it is infinite.
+ */
+void
+coro_sched_set_quantum(uint64_t usec);
+
+/** How the scheduler chooses the next ready coroutine to run. */
+enum coro_policy {
+	/** In the order of becoming ready. The default. */
+	CORO_POLICY_RR,
+	/**
+	 * The highest priority first, round-robin among coroutines
+	 * of the same priority. Lower priorities can starve.
+	 */
+	CORO_POLICY_PRIORITY,
+	/**
+	 * Earliest deadline first. A coroutine gets the deadline of
+	 * its target latency after each wakeup or yield, unless it
+	 * was set explicitly with coro_set_deadline(). Equal
+	 * deadlines are served in the order of becoming ready.
+	 */
+	CORO_POLICY_EDF,
+};
+
+/**
+ * Change the scheduling policy. The ready coroutines are moved
+ * into the new order right away.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_sched_set_policy(enum coro_policy policy);
+
+/** Current scheduling policy. */
+enum coro_policy
+coro_sched_policy(void);
+
+/**
+ * Run the coroutines in @a count worker threads instead of the
+ * current one. Each worker has its own run queue, and an idle one
+ * steals a half of another's queue. The ready coroutines are given
+ * to the workers right away, the new ones - as they are created.
+ * The calling thread does not run coroutines anymore, it only
+ * waits for them in coro_sched_wait() or coro_join().
+ *
+ * Only the round-robin policy is supported with the workers. The
+ * wait queues are protected by a lock then, see coro_sched_lock().
+ *
+ * Must be called from the thread of coro_sched_init(), not from a
+ * coroutine. 0 stops the workers, and everything runs in the
+ * calling thread again.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EBUSY - the workers still have
+ *         not finished coroutines. EINVAL - the policy is not
+ *         round-robin.
+ */
+int
+coro_sched_set_workers(int count);
+
+/** Number of worker threads. 0, if they are not used. */
+int
+coro_sched_workers(void);
+
+/** No timeout, wait until woken up. */
+#define CORO_TIMEOUT_INFINITE UINT64_MAX
+
+/**
+ * Source of events for the blocked coroutines, like I/O
+ * completions. The scheduler polls it on each switch while it has
+ * pending events, and sleeps in it when nothing else is ready to
+ * run. Only without worker threads.
+ */
+struct coro_poller {
+	/**
+	 * Wake up the coroutines, whose events have come, with
+	 * coro_wakeup(). If @a timeout is not 0, nothing is ready,
+	 * and it should wait for an event up to @a timeout
+	 * microseconds, maybe CORO_TIMEOUT_INFINITE. It can return
+	 * earlier, then it is called again.
+	 */
+	void (*poll)(struct coro_poller *p, uint64_t timeout);
+	/** Free the poller. Is called with its scheduler. */
+	void (*destroy)(struct coro_poller *p);
+	/** Number of coroutines waiting for the events. */
+	long long pending;
+};
+
+/** Set the poller of the current scheduler. It owns it then. */
+void
+coro_sched_set_poller(struct coro_poller *p);
+
+/** Poller of the current scheduler. NULL, if none. */
+struct coro_poller *
+coro_sched_poller(void);
+
+/**
+ * Record the switches of the current scheduler: which coroutine
+ * ran in which thread, since when and till when, why it stopped,
+ * and who ran next. The last @a capacity slices are kept, the
+ * capacity is rounded up to a power of 2. A slice takes 72
+ * bytes, and recording it is an atomic increment. When disabled,
+ * a switch only checks a flag. The old slices are dropped.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EBUSY - with worker threads the
+ *         buffer can't be replaced, disable it without them first.
+ */
+int
+coro_sched_enable_tracing(size_t capacity);
+
+/**
+ * Stop recording and free the slices, unless worker threads could
+ * still be writing them. Then they are freed with the scheduler.
+ */
+void
+coro_sched_disable_tracing(void);
+
+/**
+ * Write the recorded slices into @a path as JSON of the Chrome
+ * trace event format, which chrome://tracing and ui.perfetto.dev
+ * show as a timeline per thread. Can be called while recording.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_sched_dump_trace(const char *path);
+
+/**
+ * Lock of the coroutine wait queues, when there are worker
+ * threads. coro_wait() and coro_wakeup() are called under it, and
+ * coro_wait() releases it while waiting. The synchronization
+ * primitives take it inside. Without workers does nothing.
+ */
+void
+coro_sched_lock(void);
+
+void
+coro_sched_unlock(void);
+
+/** Signal used by the preemption timer. */
+#define CORO_PREEMPT_SIGNAL (SIGRTMIN + 1)
+
+/** The shortest period of the preemption timer. */
+#define CORO_PREEMPT_MIN_USEC 100
+
+/**
+ * Arm a per-thread interval timer with period of the quantum. On
+ * each expiration it only raises a flag, and the running
+ * coroutine yields at its next CORO_SAFE_POINT(). So the latency
+ * is bounded even for the loops, which don't check time, and the
+ * check itself is one memory load. The quantum must be set.
+ *
+ * The timer is periodic and not rearmed on switches, so a
+ * coroutine, which got the CPU in the middle of a period, is
+ * preempted sooner than in a full quantum.
+ *
+ * A quantum shorter than CORO_PREEMPT_MIN_USEC gets no timer, the
+ * signals would take all the time. Then each CORO_SAFE_POINT()
+ * calls coro_yield_if_expired(), and with the quantum 0 yields
+ * every time.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_sched_enable_preemption(void);
+
+/** Stop the preemption timer. */
+void
+coro_sched_disable_preemption(void);
+
+/**
+ * Set by the preemption timer, cleared on each switch. Each
+ * worker thread has its own timer and flag.
+ */
+extern __thread volatile sig_atomic_t coro_preempt_pending;
+
+/** Yield because of preemption. Use CORO_SAFE_POINT() instead. */
+void
+coro_preempt_yield(void);
+
+/**
+ * A point in a long-running loop, where the coroutine can be
+ * preempted. Costs one load and a not taken branch, unless the
+ * preemption timer has expired, or the quantum is too short for it.
+ */
+#define CORO_SAFE_POINT() do {						\
+	if (__builtin_expect(coro_preempt_pending, 0))			\
+		coro_preempt_yield();					\
+} while (0)
+
 /** Currently working coroutine. */
 struct coro *
 coro_this(void);
@@ -27,6 +300,217 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+enum {
+	/** Stack size used by coro_new(). */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Smaller stacks are rounded up to that. */
+	CORO_STACK_SIZE_MIN = 16 * 1024,
+	/** Longer names are truncated. */
+	CORO_NAME_MAX = 32,
+	/** Priorities for CORO_POLICY_PRIORITY, the higher wins. */
+	CORO_PRIORITY_MIN = 0,
+	CORO_PRIORITY_DEFAULT = 32,
+	CORO_PRIORITY_MAX = 63,
+};
+
+/** No deadline, the coroutine runs after all the urgent ones. */
+#define CORO_LATENCY_INFINITE UINT64_MAX
+
+/** Coroutine creation attributes. */
+struct coro_attr {
+	/**
+	 * Stack size in bytes. When a stack is taken from the
+	 * pool, it is rounded up to a power of 2.
+	 */
+	size_t stack_size;
+	/** Name for diagnostics. Is copied. Can be NULL. */
+	const char *name;
+	/**
+	 * User provided memory of stack_size bytes to use as the
+	 * stack. It has no guard page and is not freed by
+	 * coro_delete(). NULL - take a stack from the pool.
+	 */
+	void *stack;
+	/**
+	 * Paint the stack at creation and print its high-water
+	 * mark when the coroutine finishes. Costs all the stack
+	 * memory committed, so it is for debugging. Enabled by
+	 * default when built with CORO_STACK_DEBUG.
+	 */
+	bool stack_debug;
+	/**
+	 * The coroutine is going to be joined with coro_join(), so
+	 * it is never returned by coro_sched_wait(). Without that
+	 * the scheduler can take it, if it finishes before the
+	 * join.
+	 */
+	bool joinable;
+	/**
+	 * Priority for CORO_POLICY_PRIORITY, from CORO_PRIORITY_MIN
+	 * to CORO_PRIORITY_MAX. CORO_PRIORITY_DEFAULT by default.
+	 */
+	int priority;
+	/**
+	 * Target latency in microseconds for CORO_POLICY_EDF - how
+	 * soon the coroutine should run after it becomes ready.
+	 * CORO_LATENCY_INFINITE by default.
+	 */
+	uint64_t latency;
+};
+
+/** Initialize attributes with the defaults used by coro_new(). */
+void
+coro_attr_create(struct coro_attr *attr);
+
+/**
+ * Create a new coroutine with the given attributes. It is not
+ * started, just added to the scheduler.
+ * @retval NULL Error, errno is set.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
+/**
+ * Create a new coroutine in the scheduler @a s. NULL @a attr means
+ * the defaults.
+ * @retval NULL Error, errno is set.
+ */
+struct coro *
+coro_new_in(struct coro_sched *s, coro_f func, void *func_arg,
+	    const struct coro_attr *attr);
+
+/**
+ * Stackless coroutines. Such a coroutine has no stack and no
+ * context, only a resume point. Its function is called anew on
+ * each resume, and jumps to where the previous call has stopped,
+ * like protothreads do:
+ *
+ *     static enum coro_step
+ *     counter_f(struct coro *c, void *arg)
+ *     {
+ *             struct counter *cnt = arg;
+ *             CORO_BEGIN(c);
+ *             while (++cnt->value < 10)
+ *                     CORO_YIELD(c);
+ *             CORO_END(c);
+ *     }
+ *
+ * The local variables don't survive a yield, the state should be
+ * kept in the argument. Otherwise these are the same coroutines:
+ * they are scheduled by the same policies, joined, woken up, and
+ * counted in the statistics. A call of the function is one switch.
+ *
+ * The function runs on the stack of whoever has switched to it: a
+ * stackful coroutine, which gave the CPU away, or the loop of a
+ * worker thread. So it should use little stack, and it must not
+ * call the functions, which switch the stack: coro_yield(),
+ * coro_wait(), coro_join(), the coro_sync primitives, coro_sleep(),
+ * and the coro_io calls.
+ */
+enum coro_step {
+	/** Is ready to continue, but lets the others run. */
+	CORO_STEP_YIELD,
+	/** Is blocked in a wait queue by CORO_WAIT(). */
+	CORO_STEP_WAIT,
+	/** Has finished, the status is set by coro_step_exit(). */
+	CORO_STEP_DONE,
+};
+
+typedef enum coro_step (*coro_step_f)(struct coro *c, void *arg);
+
+/**
+ * Create a stackless coroutine in the scheduler @a s. The stack
+ * attributes are ignored, NULL @a attr means the defaults.
+ * @retval NULL Error, errno is set.
+ */
+struct coro *
+coro_new_stackless_in(struct coro_sched *s, coro_step_f func,
+		      void *func_arg, const struct coro_attr *attr);
+
+/** Create a stackless coroutine in the current scheduler. */
+struct coro *
+coro_new_stackless(coro_step_f func, void *func_arg,
+		   const struct coro_attr *attr);
+
+/** Resume point of a stackless coroutine, for the macros below. */
+int *
+coro_step_point(struct coro *c);
+
+/**
+ * Put the current stackless coroutine into @a q under the
+ * scheduler lock. Its function should return CORO_STEP_WAIT right
+ * after, which CORO_WAIT() does.
+ */
+void
+coro_step_wait(struct coro_queue *q);
+
+/** Finish a stackless coroutine with the given status. */
+enum coro_step
+coro_step_exit(struct coro *c, int status);
+
+/** Start of a stackless coroutine function. */
+#define CORO_BEGIN(c) switch (*coro_step_point(c)) { case 0:
+
+/** Let the others run, continue from here next time. */
+#define CORO_YIELD(c) do {						\
+	*coro_step_point(c) = __LINE__;					\
+	return CORO_STEP_YIELD;						\
+	case __LINE__:;							\
+} while (0)
+
+/**
+ * The same as coro_wait(): is called with the scheduler lock and
+ * continues with it, when the coroutine is woken up.
+ */
+#define CORO_WAIT(c, q) do {						\
+	*coro_step_point(c) = __LINE__;					\
+	coro_step_wait(q);						\
+	return CORO_STEP_WAIT;						\
+	case __LINE__:							\
+	coro_sched_lock();						\
+} while (0)
+
+/** Finish with the given status. */
+#define CORO_RETURN(c, status) return coro_step_exit(c, status)
+
+/** End of a stackless coroutine function, finishes it with 0. */
+#define CORO_END(c) } return coro_step_exit(c, 0)
+
+/** Name of the coroutine. Empty, if it was not given. */
+const char *
+coro_name(const struct coro *c);
+
+/**
+ * The deepest stack usage of the coroutine in bytes. Is known
+ * only when stack_debug was enabled, otherwise returns 0.
+ */
+size_t
+coro_stack_high_water(const struct coro *c);
+
+/**
+ * Change priority of the coroutine, see attr.priority.
+ * @retval 0 Success.
+ * @retval -1 The priority is out of range, errno is EINVAL.
+ */
+int
+coro_set_priority(struct coro *c, int priority);
+
+/**
+ * Change the target latency of the coroutine in microseconds, see
+ * attr.latency. Cancels the deadline set by coro_set_deadline().
+ */
+void
+coro_set_latency(struct coro *c, uint64_t usec);
+
+/**
+ * Set an absolute deadline @a usec microseconds from now. It stays
+ * the same over all the wakeups and yields, until another deadline
+ * or latency is set. A missed deadline stays the earliest one, so
+ * the coroutine keeps winning until it gets a new deadline.
+ */
+void
+coro_set_deadline(struct coro *c, uint64_t usec);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -38,10 +522,125 @@ coro_switch_count(const struct coro *c);
 bool
 coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/**
+ * Free coroutine stack and it itself. With worker threads only
+ * finished coroutines can be deleted.
+ */
 void
 coro_delete(struct coro *c);
 
 /** Switch to another not finished coroutine. */
 void
 coro_yield(void);
+
+/**
+ * Yield, if the current coroutine has used up its quantum. The
+ * check is just one read of the CPU tick counter, so it can be
+ * called on every iteration of a hot loop.
+ * @retval true The coroutine has yielded.
+ * @retval false The quantum is not over yet.
+ */
+bool
+coro_yield_if_expired(void);
+
+/** Accounting of a coroutine. */
+struct coro_stats {
+	/**
+	 * Time the coroutine was running in nanoseconds. Waiting
+	 * in the ready queue or blocked is not counted. Updated on
+	 * each switch.
+	 */
+	uint64_t run_time;
+	/** How many times the coroutine gave the CPU away. */
+	long long switch_count;
+};
+
+/** Get statistics of the coroutine. */
+void
+coro_stats(const struct coro *c, struct coro_stats *stats);
+
+/** Statistics of the coroutine stack pool. */
+struct coro_stack_stats {
+	/** Stacks reused from the pool. */
+	long long hits;
+	/** Stacks mapped anew, because the pool was empty. */
+	long long misses;
+	/** Idle stacks kept in the pool now. */
+	long long idle;
+	/** Stacks owned by coroutines now. */
+	long long used;
+	/** Stacks without a guard page, mapping limit was hit. */
+	long long unguarded;
+};
+
+/** Get stack pool statistics. */
+void
+coro_stack_pool_stats(struct coro_stack_stats *stats);
+
+/**
+ * Set how many idle stacks of one size the pool can keep. The
+ * rest are unmapped right away. 0 disables the pooling and
+ * releases all the idle stacks.
+ */
+void
+coro_stack_pool_set_max_idle(int count);
+
+/** Initialize an empty coroutine queue. */
+void
+coro_queue_create(struct coro_queue *q);
+
+static inline bool
+coro_queue_is_empty(const struct coro_queue *q)
+{
+	return q->first == NULL;
+}
+
+/**
+ * Suspend the current coroutine in the queue @a q. It does not
+ * consume CPU until somebody wakes it up with coro_wakeup().
+ * This is a building block for synchronization primitives. With
+ * worker threads it is called under coro_sched_lock(), which is
+ * released while waiting, like with a condition variable.
+ */
+void
+coro_wait(struct coro_queue *q);
+
+/**
+ * Move the first coroutine from @a q into the ready queue. With
+ * worker threads it is called under coro_sched_lock().
+ * @retval true A coroutine was woken up.
+ * @retval false The queue is empty.
+ */
+bool
+coro_wakeup(struct coro_queue *q);
+
+/** Wake up all the coroutines of @a q. */
+void
+coro_wakeup_all(struct coro_queue *q);
+
+/** Monotonic time in microseconds, the deadlines are in. */
+uint64_t
+coro_time(void);
+
+/**
+ * coro_wait() until the coro_time() @a deadline at most. The
+ * timeouts are kept in a timer wheel of the scheduler, so arming
+ * and cancelling them is O(1), and a scheduler with nothing to run
+ * sleeps till the nearest one. UINT64_MAX means no deadline.
+ * @retval true Woken up.
+ * @retval false The deadline has passed, the coroutine is removed
+ *         from the queue.
+ */
+bool
+coro_wait_deadline(struct coro_queue *q, uint64_t deadline);
+
+/** coro_wait_deadline() in @a usec microseconds from now. */
+bool
+coro_wait_timeout(struct coro_queue *q, uint64_t usec);
+
+/**
+ * Sleep for @a usec microseconds. The other coroutines run
+ * meanwhile, or the thread sleeps, if there are none.
+ */
+void
+coro_sleep(uint64_t usec);
@@ -1,19 +1,106 @@
 #include <stdio.h>
 #include <string.h>
 #include "libcoro.h"
+#include "coro_sync.h"
+#include "coro_io.h"
 #include "coro_util.h"
+#include "ext_sort.h"
+#include "int_io.h"
 #include <limits.h>
 #include "heap_help.h"
 #include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 /**
  * You can compile and run this code using the commands:
  *
- * $> gcc solution.c libcoro.c coro_util.c
- * $> ./a.out
+ * $> make
+ * $> ./a.out test1.txt test2.txt
+ *
+ * The Makefile has the full list of the sources and the flags.
  */
 
 
+// Taken from the -b budget for the program itself: the code, the stacks
+// of the libraries and the allocator
+#define EXT_RESERVE (4 << 20)
+// The largest chunk of a text file, read at once in the external sort
+#define EXT_READ_BUF (1 << 20)
+// Taken for each worker thread: its stack, and the arena of its allocator
+// for the small allocations
+#define EXT_THREAD_RESERVE (128 << 10)
+
+// Parses the size with an optional K, M or G suffix. Returns 0, if it is
+// not a positive number of bytes.
+static size_t
+parse_size(const char *str)
+{
+    if(*str < '0' || *str > '9')
+        return 0;
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(str, &end, 10);
+    int shift = 0;
+    if(*end == 'K' || *end == 'k')
+        shift = 10;
+    else if(*end == 'M' || *end == 'm')
+        shift = 20;
+    else if(*end == 'G' || *end == 'g')
+        shift = 30;
+    if(shift != 0)
+        ++end;
+    if(errno != 0 || *end != '\0' || size > (SIZE_MAX >> shift))
+        return 0;
+    return (size_t)size << shift;
+}
+
+// The chunk, the scratch of its sort, and the read buffer of a coroutine
+static size_t
+ext_mem_size(const coro_arg *arg)
+{
+    return 2 * sizeof(long) * arg->chunk + arg->read_buf;
+}
+
+// Sorts the file by chunks, which are spilled as runs, so only a chunk
+// of it is in memory at a time
+static int
+sort_file_external(coro_arg *arg, int idx, long *chunk)
+{
+    long *scratch = chunk + arg->chunk;
+    int_reader reader;
+    if(int_reader_open_buf(&reader, arg->filenames[idx], (char *)(scratch + arg->chunk),
+                           arg->read_buf) != 0)
+        return -1;
+    // The other coroutines sort, while this one waits for the disk
+    reader.read = coro_read;
+    long count;
+    int rc = 0;
+    while(rc == 0 && (count = int_reader_read(&reader, chunk, arg->chunk)) > 0) {
+        arg->sort_scratch(chunk, count, scratch);
+        ext_run *runs = realloc(arg->runs[idx], sizeof(ext_run) * (arg->run_counts[idx] + 1));
+        if(runs == NULL) {
+            errno = ENOMEM;
+            rc = -1;
+            break;
+        }
+        arg->runs[idx] = runs;
+        runs[arg->run_counts[idx]++] = (ext_run) {
+            .fd = arg->spill->fd,
+            .offset = arg->spill->size,
+            .count = count
+        };
+        rc = ext_spill_append(arg->spill, chunk, count);
+        CORO_SAFE_POINT();
+    }
+    if(count < 0)
+        rc = -1;
+    int_reader_close(&reader);
+    return rc;
+}
+
 /**
  * Coroutine body. This code is executed by all the coroutines. Here you
  * implement your solution, sort each individual file.
@@ -24,49 +111,52 @@ coroutine_func_f(void *context)
 	/* IMPLEMENT SORTING OF INDIVIDUAL FILES HERE. */
 	// struct coro *this = coro_this(); 
 	coro_arg *arg = (coro_arg*) context;
-    char *cur_filename = NULL;
-    if(*arg->q_size > 0)
-        cur_filename = arg->queue[--(*arg->q_size)];
-    arg->ctx->start_time = coro_gettime();
-    while(cur_filename) {
-        FILE *file = fopen(cur_filename, "r");
-        if(!file) {
-            free(cur_filename);
-            return -1;
-        } 
-        long arr_cnt = 0, raw_size = 10;
-        long *raw_arr = (long *) malloc(sizeof(long) * 10);
-        while(!feof(file)) {
-            if(arr_cnt == raw_size - 1)
-                raw_size *= 2, raw_arr = realloc(raw_arr, sizeof(long) * raw_size);
-            fscanf(file, "%ld", &raw_arr[arr_cnt++]);
+    int ret = 0;
+    void *msg;
+    long *chunk = NULL;
+    while(coro_channel_recv(arg->queue, &msg) == 0) {
+        int idx = (int)(intptr_t) msg;
+        char *cur_filename = arg->filenames[idx];
+        if(arg->chunk != 0) {
+            // Mapped once for all the files, and unmapped in the end. The
+            // allocator of each thread, which ran the coroutine, would keep
+            // a freed copy.
+            if(chunk == NULL) {
+                chunk = mmap(NULL, ext_mem_size(arg), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(chunk == MAP_FAILED)
+                    chunk = NULL;
+            }
+            if(chunk == NULL || sort_file_external(arg, idx, chunk) != 0) {
+                printf("Can't sort %s: %s\n", cur_filename, strerror(chunk == NULL ? ENOMEM : errno));
+                ret = -1;
+            }
+            continue;
         }
-        fclose(file);
-        arg->arrays[(*arg->q_size)] = (long*) malloc(sizeof(long) * arr_cnt);
-        arg->arr_sizes[(*arg->q_size)] = arr_cnt;
-        for(int i = 0; i < arr_cnt; ++i)
-            arg->arrays[(*arg->q_size)][i] = raw_arr[i];
-        free(raw_arr);
-        // Quick sort is much more quicker, but it is too painful to measure recursive function's working time
-        iter_merge_sort(arg->ctx, arg->arrays[(*arg->q_size)], arr_cnt);
-        // quick_sort(arg->ctx, arg->arrays[(*arg->q_size)], 0, arr_cnt - 1);
-        uint64_t w_time = coro_gettime() - arg->ctx->start_time;
-        // printf("%s, #%d, %lu ms, %lu ms.\n", cur_filename, arg->ctx->id, arg->ctx->timeout, w_time);
-        if(w_time > arg->ctx->timeout) {
-            arg->ctx->total_time += w_time;
-            ++arg->ctx->s_cnt;
-            coro_yield();
-            arg->ctx->start_time = coro_gettime();
+        int_parser parser;
+        if(int_parser_open(&parser, cur_filename) != 0) {
+            printf("Can't read %s\n", cur_filename);
+            ret = -1;
+            continue;
         }
-        if(!*arg->q_size)
-            break;
-        cur_filename = arg->queue[--(*arg->q_size)];
+        // The others can run between the chunks, when the quantum is over
+        while(!int_parser_step(&parser, 64 * 1024))
+            CORO_SAFE_POINT();
+        long arr_cnt;
+        arg->arrays[idx] = int_parser_finish(&parser, &arr_cnt);
+        arg->arr_sizes[idx] = arr_cnt;
+        // Quick sort is recursive and would need much bigger stacks
+        arg->sort(arg->arrays[idx], arr_cnt);
+        CORO_SAFE_POINT();
     }
-    printf("Coroutine %lu: total working time - %lu mcs, switch count - %d\n", (unsigned long)arg->ctx->id, (unsigned long)arg->ctx->total_time, arg->ctx->s_cnt);
-    free(arg->ctx);
+    if(chunk != NULL)
+        munmap(chunk, ext_mem_size(arg));
+    struct coro_stats stats;
+    coro_stats(coro_this(), &stats);
+    printf("Coroutine %d: total working time - %lu mcs, switch count - %lld\n", arg->id, (unsigned long)(stats.run_time / 1000), stats.switch_count);
     free(arg);
 	/* This will be returned from coro_status(). */
-	return 0;
+	return ret;
 }
 
 int
@@ -80,19 +170,30 @@ main(int argc, char **argv)
 	/* Initialize our coroutine global cooperative scheduler. */
 	coro_sched_init();
     int opt,
-        coro_num = 1;
+        coro_num = 1,
+        threads = 0;
 
     uint64_t timeout = INT_MAX,
             main_start = coro_gettime();
+    const char *trace_path = NULL;
+    bool is_mmap_output = false;
+    size_t budget = 0;
+    void (*sort)(long arr[], long size) = iter_merge_sort;
+    void (*sort_scratch)(long arr[], long size, long scratch[]) = iter_merge_sort_scratch;
 
-    while((opt = getopt(argc, argv, "hn:T:")) != -1) {
+    while((opt = getopt(argc, argv, "hn:T:s:t:r:mb:")) != -1) {
         switch (opt) {
             case 'h':
-                printf("Use: <PROGRAM_PATH> [-h] [-n] <CORO_NUM> [-T] <TARGET_LATENCY> <FILE1> <FILE2> ...\n");
+                printf("Use: <PROGRAM_PATH> [-h] [-n] <CORO_NUM> [-T] <TARGET_LATENCY> [-s] <SORT> [-t] <THREADS> [-r] <TRACE_JSON> [-m] [-b] <BUDGET> <FILE1> <FILE2> ...\n");
                 printf("Options: \n");
                 printf("[-h]: Help message\n");
                 printf("[-n]: Numbers of coroutines\n");
                 printf("[-T]: Target latency for coroutines (in mсs)\n");
+                printf("[-s]: Sorting algorithm, merge (default), tim for partly sorted files or radix for the numbers fitting in int\n");
+                printf("[-t]: Worker threads to run coroutines in, 0 - the main thread\n");
+                printf("[-r]: Record the coroutine switches into a Chrome trace JSON file\n");
+                printf("[-m]: Write the result through a shared mapping instead of write()\n");
+                printf("[-b]: Memory budget with K, M or G suffix, the files are sorted in chunks spilled to $TMPDIR\n");
                 exit(EXIT_SUCCESS);
             case 'n':
                 coro_num = atoi(optarg);
@@ -100,36 +201,155 @@ main(int argc, char **argv)
             case 'T':
                 timeout = atoi(optarg);
                 break;
+            case 's':
+                if(strcmp(optarg, "merge") == 0) {
+                    sort = iter_merge_sort;
+                    sort_scratch = iter_merge_sort_scratch;
+                } else if(strcmp(optarg, "tim") == 0) {
+                    sort = tim_sort;
+                    sort_scratch = tim_sort_scratch;
+                } else if(strcmp(optarg, "radix") == 0) {
+                    sort = radix_sort;
+                    sort_scratch = radix_sort_scratch;
+                } else {
+                    printf("Unknown sort %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'r':
+                trace_path = optarg;
+                break;
+            case 'm':
+                is_mmap_output = true;
+                break;
+            case 'b':
+                budget = parse_size(optarg);
+                if(budget == 0) {
+                    printf("Invalid budget %s, a positive number with K, M or G suffix is expected\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
                 break;
         }
     }
+    if(coro_num < 1) {
+        printf("The number of coroutines must be positive\n");
+        exit(EXIT_FAILURE);
+    }
     int filenames_size = argc - optind,
         f_size_copy = filenames_size;
+    // External sort: each working coroutine takes an equal part of the
+    // budget, for a chunk, the scratch of the sort, and the read buffer
+    long chunk = 0;
+    size_t read_buf = 0,
+        merge_budget = 0,
+        stack_size = 64 * 1024;
+    if(budget != 0 && filenames_size > 0) {
+        size_t workers = coro_num < filenames_size ? coro_num : filenames_size,
+            reserve = EXT_RESERVE + (size_t)(threads > 0 ? threads : 0) * EXT_THREAD_RESERVE,
+            share = budget > reserve ? (budget - reserve) / workers : 0;
+        share = share > stack_size ? share - stack_size : 0;
+        read_buf = share / 8 < EXT_READ_BUF ? share / 8 : EXT_READ_BUF;
+        chunk = share > read_buf ? (share - read_buf) / (2 * sizeof(long)) : 0;
+        merge_budget = budget > EXT_RESERVE + INT_WRITER_BUF_SIZE ?
+                       budget - EXT_RESERVE - INT_WRITER_BUF_SIZE : 0;
+        if(read_buf < EXT_MIN_BUF || chunk < EXT_MIN_BUF / (long)sizeof(long) ||
+           merge_budget < 3 * EXT_MIN_BUF) {
+            printf("The budget is too small for %zu coroutines\n", workers);
+            exit(EXIT_FAILURE);
+        }
+        // The mapping of the result would be in memory
+        is_mmap_output = false;
+    }
     char **filenames = calloc(filenames_size, sizeof(char *));
     for(int i = 0; optind < argc; ++optind, ++i)
         filenames[i] = argv[optind];
-    long **all_arrays = (long **) malloc(sizeof(long *) * filenames_size);
+    // Coroutines take the files from the channel until it is empty
+    struct coro_channel queue;
+    if(coro_channel_create(&queue, filenames_size) != 0) {
+        printf("Please provide files to sort.\n");
+        free(filenames);
+        exit(EXIT_FAILURE);
+    }
+    for(int i = filenames_size - 1; i >= 0; --i)
+        coro_channel_send(&queue, (void *)(intptr_t) i);
+    coro_channel_close(&queue);
+    long **all_arrays = (long **) calloc(filenames_size, sizeof(long *));
     long *all_sizes = calloc(filenames_size, sizeof(long));
+    ext_spill *spills = NULL;
+    ext_run **all_runs = NULL;
+    int *all_run_counts = NULL;
+    if(budget != 0) {
+        spills = calloc(coro_num, sizeof(ext_spill));
+        all_runs = calloc(filenames_size, sizeof(ext_run *));
+        all_run_counts = calloc(filenames_size, sizeof(int));
+        for(int i = 0; i < coro_num; ++i) {
+            if(ext_spill_open(&spills[i]) == 0)
+                continue;
+            printf("Can't create a temporary file: %s\n", strerror(errno));
+            while(--i >= 0)
+                ext_spill_close(&spills[i]);
+            free(spills);
+            free(all_runs);
+            free(all_run_counts);
+            free(all_arrays);
+            free(all_sizes);
+            coro_channel_destroy(&queue);
+            free(filenames);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // The last switches are kept, open the file in chrome://tracing or Perfetto
+    if(trace_path != NULL && coro_sched_enable_tracing(1 << 16) != 0) {
+        printf("Can't start tracing: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // Files are sorted in parallel, each coroutine writes only its own slots
+    if(coro_sched_set_workers(threads) != 0) {
+        printf("Can't start %d worker threads: %s\n", threads, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // Each of N coroutines is given T / N microseconds
+    if(timeout != INT_MAX) {
+        coro_sched_set_quantum(timeout / coro_num);
+        // The timer makes the sorting loops yield without polling the clock
+        if(coro_sched_enable_preemption() != 0) {
+            printf("Can't start the preemption timer: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
 	/* Start several coroutines. */
 	for (int i = 0; i < coro_num; ++i) {
-        coro_ctx *new_ctx = (coro_ctx *) malloc(sizeof(coro_ctx));
-        *new_ctx = (coro_ctx) {
-            .id = i,
-            .start_time = 0,
-            .total_time = 0,
-            .timeout = timeout / coro_num,
-            .s_cnt = 0
-        };
         coro_arg *new_arg = (coro_arg *) malloc(sizeof(coro_arg));
         *new_arg = (coro_arg) {
-            .ctx = new_ctx,
-            .q_size = &filenames_size,
-            .queue = filenames,
+            .id = i,
+            .queue = &queue,
+            .filenames = filenames,
             .arrays = all_arrays,
-            .arr_sizes = all_sizes
+            .arr_sizes = all_sizes,
+            .sort = sort,
+            .sort_scratch = sort_scratch,
+            .chunk = chunk,
+            .read_buf = read_buf,
+            .spill = spills != NULL ? &spills[i] : NULL,
+            .runs = all_runs,
+            .run_counts = all_run_counts
         };
-		coro_new(coroutine_func_f, new_arg);
+        char name[CORO_NAME_MAX];
+        snprintf(name, sizeof(name), "sort-%d", i);
+        struct coro_attr attr;
+        coro_attr_create(&attr);
+        attr.name = name;
+        // Sorting is iterative and keeps the arrays on the heap
+        attr.stack_size = stack_size;
+		if (coro_new_ex(coroutine_func_f, new_arg, &attr) == NULL) {
+            printf("Can't create a coroutine\n");
+            return -1;
+        }
 	}
     printf("Coroutine creation time - %lu mcs.\n", (unsigned long)(coro_gettime() - main_start));
 	/* Wait for all the coroutines to end. */
@@ -144,38 +364,90 @@ main(int argc, char **argv)
 		coro_delete(c);
 	}
 	/* All coroutines have finished. */
-    free(filenames);    
+    coro_sched_disable_preemption();
+    coro_sched_set_workers(0);
+    if(trace_path != NULL) {
+        if(coro_sched_dump_trace(trace_path) != 0)
+            printf("Can't write the trace: %s\n", strerror(errno));
+        coro_sched_disable_tracing();
+    }
+    coro_io_destroy();
+    coro_channel_destroy(&queue);
+    free(filenames);
 	/* IMPLEMENT MERGING OF THE SORTED ARRAYS HERE. */
     uint64_t merge_s_time = coro_gettime();
-    FILE *output = fopen("result.txt", "w");
-    long pivot = all_sizes[0];
-    long *sorted_arr = (long *) malloc(sizeof(long) * pivot);
-    memcpy(sorted_arr, all_arrays[0], pivot * sizeof(long));
-    for(int i = 1; i < f_size_copy; ++i) {
-        // Reallocate some more memory
-        sorted_arr = realloc(sorted_arr, (all_sizes[i] + pivot) * sizeof(long));
-        if(!sorted_arr) {
+    int_writer output;
+    int rc;
+    if(budget != 0) {
+        // The runs of all the files are merged at once, reading them
+        // through the buffers of the budget
+        int run_count = 0;
+        for(int i = 0; i < f_size_copy; ++i)
+            run_count += all_run_counts[i];
+        ext_run *runs = malloc(sizeof(ext_run) * (run_count > 0 ? run_count : 1));
+        for(int i = 0, j = 0; i < f_size_copy && runs != NULL; ++i) {
+            memcpy(runs + j, all_runs[i], sizeof(ext_run) * all_run_counts[i]);
+            j += all_run_counts[i];
+            free(all_runs[i]);
+        }
+        if(runs == NULL) {
+            printf("Not enough memory\n");
+            return -1;
+        }
+        rc = int_writer_open(&output, "result.txt");
+        if(rc == 0) {
+            rc = ext_merge(runs, run_count, merge_budget, &output);
+            if(int_writer_close(&output) != 0)
+                rc = -1;
+        }
+        if(rc != 0)
+            printf("Can't write result.txt: %s\n", strerror(errno));
+        free(runs);
+        for(int i = 0; i < coro_num; ++i)
+            ext_spill_close(&spills[i]);
+        free(spills);
+        free(all_runs);
+        free(all_run_counts);
+    } else {
+        // All the files are merged at once, straight into the output
+        loser_tree tree;
+        if(loser_tree_create(&tree, all_arrays, all_sizes, f_size_copy) != 0) {
             printf("Not enough memory\n");
             return -1;
         }
-        // Concatenate arrays
-        for(int j = 0; j < all_sizes[i]; ++j)
-            sorted_arr[pivot + j] = all_arrays[i][j];
-        // Merge them
-        merge(sorted_arr, 0, pivot - 1, pivot + all_sizes[i] - 1);
-        // Update total length
-        pivot += all_sizes[i];
+        if(is_mmap_output) {
+            size_t size = 0;
+            for(int i = 0; i < f_size_copy; ++i)
+                size += int_text_size(all_arrays[i], all_sizes[i]);
+            rc = int_writer_open_mmap(&output, "result.txt", size);
+        } else {
+            rc = int_writer_open(&output, "result.txt");
+        }
+        if(rc == 0) {
+            long value;
+            while(loser_tree_pop(&tree, &value))
+                int_writer_put(&output, value);
+            rc = int_writer_close(&output);
+        }
+        if(rc != 0)
+            printf("Can't write result.txt: %s\n", strerror(errno));
+        loser_tree_destroy(&tree);
     }
-    // Output
-    for(int i = 0; i < pivot; ++i)
-        fprintf(output, "%ld ", sorted_arr[i]);
     // printf("%d.\n", f_size_copy);
     for(int i = 0; i < f_size_copy; ++i)
         free(all_arrays[i]);
-    free(sorted_arr);
     free(all_arrays);
     free(all_sizes);
-    fclose(output);
     printf("Program working time - %lu mcs, merging time - %lu mcs.\n", (unsigned long)(coro_gettime() - main_start), (unsigned long)(coro_gettime() - merge_s_time));
+    if(budget != 0) {
+        // The peak of the whole process, with all the threads, in KB
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("Peak memory - %ld KB of %zu KB budget.\n", usage.ru_maxrss, budget >> 10);
+        if((size_t)usage.ru_maxrss > budget >> 10) {
+            printf("The budget is exceeded\n");
+            return EXIT_FAILURE;
+        }
+    }
 	return 0;
 }
@@ -0,0 +1,237 @@
+#include "sort_kernel.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+// The kernels are written once with the vector extension of GCC and
+// built for each instruction set. 4 longs take one AVX2 register, or
+// two SSE ones.
+typedef long v4 __attribute__((vector_size(32)));
+
+#define KERNEL static inline __attribute__((always_inline))
+
+static enum sort_isa sort_isa_max(void) {
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return SORT_ISA_AVX2;
+    if(__builtin_cpu_supports("sse4.2"))
+        return SORT_ISA_SSE42;
+    return SORT_ISA_SCALAR;
+}
+
+// -1 until the CPU is checked. The worker threads sort at once, so it is
+// atomic: the first ones may all check the CPU, and store the same value.
+static atomic_int sort_isa = -1;
+
+enum sort_isa sort_get_isa(void) {
+    int isa = atomic_load_explicit(&sort_isa, memory_order_relaxed);
+    if(isa < 0) {
+        isa = sort_isa_max();
+        atomic_store_explicit(&sort_isa, isa, memory_order_relaxed);
+    }
+    return isa;
+}
+
+void sort_set_isa(enum sort_isa isa) {
+    enum sort_isa max = sort_isa_max();
+    atomic_store_explicit(&sort_isa, isa < max ? isa : max, memory_order_relaxed);
+}
+
+// The vectors are passed by pointers, the default ABI has no AVX
+KERNEL void load4(v4 *v, const long *p) {
+    memcpy(v, p, sizeof(*v));
+}
+
+KERNEL void store4(long *p, const v4 *v) {
+    memcpy(p, v, sizeof(*v));
+}
+
+// Minimums into a, maximums into b, lane by lane, without branches
+KERNEL void minmax(v4 *a, v4 *b) {
+    v4 gt = *a > *b;
+    v4 min = (*a & ~gt) | (*b & gt);
+    *b = (*b & ~gt) | (*a & gt);
+    *a = min;
+}
+
+KERNEL void reverse4(v4 *v) {
+    *v = __builtin_shuffle(*v, (v4){3, 2, 1, 0});
+}
+
+// Sorts a bitonic 4: compares the lanes 2 apart, then 1 apart
+KERNEL void clean4(v4 *v) {
+    v4 min = *v, max = __builtin_shuffle(*v, (v4){2, 3, 0, 1});
+    minmax(&min, &max);
+    *v = __builtin_shuffle(min, max, (v4){0, 1, 6, 7});
+    min = *v;
+    max = __builtin_shuffle(*v, (v4){1, 0, 3, 2});
+    minmax(&min, &max);
+    *v = __builtin_shuffle(min, max, (v4){0, 5, 2, 7});
+}
+
+// Merges the sorted a and b: the lower half into a, the upper into b
+KERNEL void merge8(v4 *a, v4 *b) {
+    reverse4(b);
+    minmax(a, b);
+    clean4(a);
+    clean4(b);
+}
+
+// Sorts 16 elements in 4 registers: the columns with a network of 4,
+// a transposition makes 4 sorted rows, then two levels of bitonic merges
+KERNEL void sort16(long *p) {
+    v4 r0, r1, r2, r3;
+    load4(&r0, p);
+    load4(&r1, p + 4);
+    load4(&r2, p + 8);
+    load4(&r3, p + 12);
+    minmax(&r0, &r1);
+    minmax(&r2, &r3);
+    minmax(&r0, &r2);
+    minmax(&r1, &r3);
+    minmax(&r1, &r2);
+    v4 t0 = __builtin_shuffle(r0, r1, (v4){0, 4, 2, 6}),
+        t1 = __builtin_shuffle(r0, r1, (v4){1, 5, 3, 7}),
+        t2 = __builtin_shuffle(r2, r3, (v4){0, 4, 2, 6}),
+        t3 = __builtin_shuffle(r2, r3, (v4){1, 5, 3, 7});
+    r0 = __builtin_shuffle(t0, t2, (v4){0, 1, 4, 5});
+    r1 = __builtin_shuffle(t1, t3, (v4){0, 1, 4, 5});
+    r2 = __builtin_shuffle(t0, t2, (v4){2, 3, 6, 7});
+    r3 = __builtin_shuffle(t1, t3, (v4){2, 3, 6, 7});
+    merge8(&r0, &r1);
+    merge8(&r2, &r3);
+    // 8 + 8, the second 8 reversed makes all 16 bitonic
+    reverse4(&r2);
+    reverse4(&r3);
+    minmax(&r0, &r3);
+    minmax(&r1, &r2);
+    minmax(&r0, &r1);
+    minmax(&r3, &r2);
+    clean4(&r0);
+    clean4(&r1);
+    clean4(&r3);
+    clean4(&r2);
+    store4(p, &r0);
+    store4(p + 4, &r1);
+    store4(p + 8, &r3);
+    store4(p + 12, &r2);
+}
+
+static void insertion_sort(long arr[], long size) {
+    for(long i = 1; i < size; ++i) {
+        long v = arr[i], j = i;
+        for(; j > 0 && arr[j - 1] > v; --j)
+            arr[j] = arr[j - 1];
+        arr[j] = v;
+    }
+}
+
+KERNEL void sort_blocks_vec(long arr[], long size) {
+    long i = 0;
+    for(; i + SORT_BLOCK <= size; i += SORT_BLOCK)
+        sort16(arr + i);
+    insertion_sort(arr + i, size - i);
+}
+
+static void merge_runs_scalar(const long *a, const long *a_end, const long *b,
+                              const long *b_end, long *out) {
+    while(a < a_end && b < b_end) {
+        if(*a <= *b)
+            *out++ = *a++;
+        else
+            *out++ = *b++;
+    }
+    memcpy(out, a, sizeof(long) * (a_end - a));
+    out += a_end - a;
+    memcpy(out, b, sizeof(long) * (b_end - b));
+}
+
+// Takes 4 from the run with the smaller head, merges them with the 4
+// kept from the last step, and stores the lower 4. The run is chosen
+// without a branch, the loop exits are the only ones.
+KERNEL void merge_runs_vec(const long *a, const long *a_end, const long *b,
+                           const long *b_end, long *out) {
+    if(a_end - a < 4 || b_end - b < 4) {
+        merge_runs_scalar(a, a_end, b, b_end, out);
+        return;
+    }
+    v4 next, kept;
+    load4(&next, a);
+    load4(&kept, b);
+    a += 4;
+    b += 4;
+    while(true) {
+        merge8(&next, &kept);
+        store4(out, &next);
+        out += 4;
+        if(a == a_end || b == b_end)
+            break;
+        bool is_a = *a <= *b;
+        const long *src = is_a ? a : b, *src_end = is_a ? a_end : b_end;
+        if(src_end - src < 4)
+            break;
+        load4(&next, src);
+        a += is_a ? 4 : 0;
+        b += is_a ? 0 : 4;
+    }
+    // The kept ones and both the tails are all above the stored ones
+    long rest[4];
+    store4(rest, &kept);
+    const long *r = rest, *r_end = rest + 4;
+    while(r < r_end && a < a_end && b < b_end) {
+        if(*r <= *a && *r <= *b)
+            *out++ = *r++;
+        else if(*a <= *b)
+            *out++ = *a++;
+        else
+            *out++ = *b++;
+    }
+    if(r == r_end)
+        merge_runs_scalar(a, a_end, b, b_end, out);
+    else if(a == a_end)
+        merge_runs_scalar(r, r_end, b, b_end, out);
+    else
+        merge_runs_scalar(r, r_end, a, a_end, out);
+}
+
+__attribute__((target("avx2")))
+static void sort_blocks_avx2(long arr[], long size) {
+    sort_blocks_vec(arr, size);
+}
+
+__attribute__((target("sse4.2")))
+static void sort_blocks_sse42(long arr[], long size) {
+    sort_blocks_vec(arr, size);
+}
+
+__attribute__((target("avx2")))
+static void merge_runs_avx2(const long *a, long size_a, const long *b, long size_b,
+                            long *out) {
+    merge_runs_vec(a, a + size_a, b, b + size_b, out);
+}
+
+long sort_blocks(long arr[], long size) {
+    switch(sort_get_isa()) {
+        case SORT_ISA_AVX2:
+            sort_blocks_avx2(arr, size);
+            return SORT_BLOCK;
+        case SORT_ISA_SSE42:
+            sort_blocks_sse42(arr, size);
+            return SORT_BLOCK;
+        default:
+            return 1;
+    }
+}
+
+// The SSE version takes two registers for 4, and is slower than the
+// scalar one
+void merge_runs(const long *a, long size_a, const long *b, long size_b, long *out) {
+    switch(sort_get_isa()) {
+        case SORT_ISA_AVX2:
+            merge_runs_avx2(a, size_a, b, size_b, out);
+            break;
+        default:
+            merge_runs_scalar(a, a + size_a, b, b + size_b, out);
+            break;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef SYSPROG_SORT_KERNEL_H
+#define SYSPROG_SORT_KERNEL_H
+
+// Vectorized parts of iter_merge_sort(). They are built for AVX2 and
+// SSE4.2, and the best one the CPU has is chosen at runtime. The merge
+// is vectorized only with AVX2. Without either iter_merge_sort() stays
+// scalar.
+
+// Elements, which sort_blocks() sorts with one network
+#define SORT_BLOCK 16
+
+enum sort_isa {
+    SORT_ISA_SCALAR,
+    SORT_ISA_SSE42,
+    SORT_ISA_AVX2,
+};
+
+// The best one of the CPU, unless lowered with sort_set_isa()
+enum sort_isa sort_get_isa(void);
+
+// Lowers the instruction set for the benchmarks and the tests, a higher
+// one than the CPU has is ignored
+void sort_set_isa(enum sort_isa isa);
+
+// Sorts each SORT_BLOCK elements of arr, and the shorter tail. Returns
+// the length of the sorted runs, 1 when it has done nothing.
+long sort_blocks(long arr[], long size);
+
+// Merges two sorted runs into out, which doesn't overlap them
+void merge_runs(const long *a, long size_a, const long *b, long size_b, long *out);
+
+#endif //SYSPROG_SORT_KERNEL_H
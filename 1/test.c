@@ -0,0 +1,1937 @@
+#include "libcoro.h"
+#include "coro_arch.h"
+#include "coro_sync.h"
+#include "coro_io.h"
+#include "coro_wheel.h"
+#include "int_io.h"
+#include "coro_util.h"
+#include "sort_kernel.h"
+#include "ext_sort.h"
+#include "unit.h"
+#include <string.h>
+#include <errno.h>
+#include <fenv.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** Wall clock in nanoseconds. */
+static uint64_t
+test_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+test_yield_f(void *arg)
+{
+	int *counter = (int *)arg;
+	for (int i = 0; i < 10; ++i) {
+		++*counter;
+		coro_yield();
+	}
+	return *counter;
+}
+
+static void
+test_basic(void)
+{
+	unit_test_start();
+
+	int counter = 0;
+	struct coro *c1 = coro_new(test_yield_f, &counter);
+	struct coro *c2 = coro_new(test_yield_f, &counter);
+	unit_check(! coro_is_finished(c1) && ! coro_is_finished(c2),
+		   "not started before wait");
+	unit_check(counter == 0, "nothing is done yet");
+	int finished = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		unit_fail_if(c != c1 && c != c2);
+		unit_fail_if(! coro_is_finished(c));
+		unit_fail_if(coro_switch_count(c) < 10);
+		coro_delete(c);
+		++finished;
+	}
+	unit_check(finished == 2, "both finished");
+	unit_check(counter == 20, "both did all the work");
+	unit_check(coro_sched_wait() == NULL, "nothing to wait");
+
+	unit_test_finish();
+}
+
+#ifdef CORO_SWITCH_ASM
+
+/** The rounding of x87 by fegetround(), and of SSE by a sum. */
+static bool
+test_is_round_up(void)
+{
+	volatile double one = 1, tiny = 1e-30;
+	return fegetround() == FE_UPWARD && one + tiny > one;
+}
+
+static bool
+test_is_round_nearest(void)
+{
+	volatile double one = 1, tiny = 1e-30;
+	return fegetround() == FE_TONEAREST && one + tiny == one;
+}
+
+static int
+test_round_up_f(void *arg)
+{
+	bool *is_kept = arg;
+	fesetround(FE_UPWARD);
+	coro_yield();
+	*is_kept = test_is_round_up();
+	fesetround(FE_TONEAREST);
+	return 0;
+}
+
+static int
+test_round_nearest_f(void *arg)
+{
+	bool *is_nearest = arg;
+	*is_nearest = test_is_round_nearest();
+	return 0;
+}
+
+/**
+ * The rounding mode is callee-saved, so it belongs to a coroutine.
+ * Only the asm switch keeps it, sigsetjmp() doesn't save it.
+ */
+static void
+test_fpu_modes(void)
+{
+	unit_test_start();
+
+	bool is_kept = false, is_nearest = false;
+	coro_new(test_round_up_f, &is_kept);
+	coro_new(test_round_nearest_f, &is_nearest);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(is_nearest, "rounding mode doesn't leak into others");
+	unit_check(is_kept, "rounding mode is kept across a switch");
+	unit_check(test_is_round_nearest(), "main's rounding mode");
+
+	unit_test_finish();
+}
+
+#endif
+
+struct test_order {
+	int log[32];
+	int size;
+};
+
+static struct test_order test_order;
+
+static int
+test_order_f(void *arg)
+{
+	int id = (int)(long)arg;
+	for (int i = 0; i < 3; ++i) {
+		test_order.log[test_order.size++] = id;
+		coro_yield();
+	}
+	return id;
+}
+
+static void
+test_round_robin(void)
+{
+	unit_test_start();
+
+	test_order.size = 0;
+	for (long i = 0; i < 3; ++i)
+		coro_new(test_order_f, (void *)i);
+	struct coro *victim = coro_new(test_order_f, (void *)3);
+	coro_delete(victim);
+	struct coro *c;
+	int finished = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		unit_fail_if(coro_status(c) != finished);
+		++finished;
+		coro_delete(c);
+	}
+	unit_check(finished == 3, "deleted not started coroutine is "\
+		   "not waited");
+	bool ok = test_order.size == 9;
+	for (int i = 0; i < test_order.size && ok; ++i)
+		ok = test_order.log[i] == i % 3;
+	unit_check(ok, "round-robin in the creation order");
+
+	unit_test_finish();
+}
+
+/** Check the run order log against a string of ids. */
+static bool
+test_order_is(const char *expected)
+{
+	if (test_order.size != (int)strlen(expected))
+		return false;
+	for (int i = 0; i < test_order.size; ++i) {
+		if (test_order.log[i] != expected[i] - '0')
+			return false;
+	}
+	return true;
+}
+
+static void
+test_order_run(void)
+{
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+}
+
+static void
+test_policy(void)
+{
+	unit_test_start();
+
+	unit_check(coro_sched_policy() == CORO_POLICY_RR,
+		   "round-robin by default");
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.priority = CORO_PRIORITY_MAX + 1;
+	unit_check(coro_new_ex(test_order_f, NULL, &attr) == NULL &&
+		   errno == EINVAL, "priority is checked");
+
+	int priorities[] = {CORO_PRIORITY_MIN, CORO_PRIORITY_MAX,
+			    CORO_PRIORITY_DEFAULT};
+	test_order.size = 0;
+	for (long i = 0; i < 3; ++i) {
+		attr.priority = priorities[i];
+		unit_fail_if(coro_new_ex(test_order_f, (void *)i,
+					 &attr) == NULL);
+	}
+	unit_fail_if(coro_sched_set_policy(CORO_POLICY_PRIORITY) != 0);
+	test_order_run();
+	unit_check(test_order_is("111222000"), "ready coroutines are "\
+		   "reordered, the higher priority runs first even after "\
+		   "a yield");
+
+	unit_fail_if(coro_sched_set_policy(CORO_POLICY_EDF) != 0);
+	coro_attr_create(&attr);
+	/* Large enough to not depend on the machine speed. */
+	uint64_t latencies[] = {300000, 100000, 200000};
+	test_order.size = 0;
+	for (long i = 0; i < 3; ++i) {
+		attr.latency = latencies[i];
+		unit_fail_if(coro_new_ex(test_order_f, (void *)i,
+					 &attr) == NULL);
+	}
+	test_order_run();
+	unit_check(test_order_is("111222000"), "the shortest latency "\
+		   "runs first");
+
+	coro_attr_create(&attr);
+	struct coro *last = NULL;
+	test_order.size = 0;
+	for (long i = 0; i < 3; ++i)
+		last = coro_new_ex(test_order_f, (void *)i, &attr);
+	coro_set_deadline(last, 0);
+	test_order_run();
+	unit_check(test_order_is("222010101"), "explicit deadline is "\
+		   "kept, no deadlines are served in order");
+
+	unit_check(coro_sched_set_policy((enum coro_policy)100) != 0 &&
+		   errno == EINVAL, "policy is checked");
+	unit_fail_if(coro_sched_set_policy(CORO_POLICY_RR) != 0);
+
+	unit_test_finish();
+}
+
+static int
+test_child_f(void *arg)
+{
+	int n = (int)(long)arg;
+	for (int i = 0; i < n; ++i)
+		coro_yield();
+	return n;
+}
+
+static int
+test_parent_f(void *arg)
+{
+	(void)arg;
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.joinable = true;
+	struct coro *c1 = coro_new_ex(test_child_f, (void *)5, &attr);
+	struct coro *c2 = coro_new_ex(test_child_f, (void *)2, &attr);
+	int sum = coro_join(c1);
+	unit_fail_if(! coro_is_finished(c2));
+	sum += coro_join(c2);
+	coro_delete(c1);
+	coro_delete(c2);
+	return sum;
+}
+
+static void
+test_join(void)
+{
+	unit_test_start();
+
+	struct coro *parent = coro_new(test_parent_f, NULL);
+	struct coro *c = coro_sched_wait();
+	unit_check(c == parent, "only the parent is waited");
+	unit_check(coro_status(c) == 7, "children are joined");
+	coro_delete(c);
+
+	c = coro_new(test_child_f, (void *)3);
+	unit_check(coro_join(c) == 3, "scheduler can join");
+	coro_delete(c);
+
+	c = coro_new(test_child_f, (void *)0);
+	struct coro *other = coro_new(test_child_f, (void *)3);
+	unit_check(coro_sched_wait() == c, "finished");
+	unit_check(coro_join(other) == 3 && coro_join(c) == 0,
+		   "join a finished coroutine");
+	unit_check(coro_sched_wait() == NULL, "nothing to wait");
+	coro_delete(c);
+	coro_delete(other);
+
+	unit_test_finish();
+}
+
+struct test_shared {
+	struct coro_mutex mutex;
+	struct coro_cond cond;
+	struct coro_channel channel;
+	struct coro_wait_group wg;
+	int value;
+	bool flag;
+};
+
+static int
+test_mutex_f(void *arg)
+{
+	struct test_shared *sh = (struct test_shared *)arg;
+	for (int i = 0; i < 10; ++i) {
+		coro_mutex_lock(&sh->mutex);
+		int v = sh->value;
+		/* Others can't enter while it sleeps with the lock. */
+		coro_yield();
+		sh->value = v + 1;
+		coro_mutex_unlock(&sh->mutex);
+	}
+	return 0;
+}
+
+static int
+test_cond_f(void *arg)
+{
+	struct test_shared *sh = (struct test_shared *)arg;
+	coro_mutex_lock(&sh->mutex);
+	while (! sh->flag)
+		coro_cond_wait(&sh->cond, &sh->mutex);
+	++sh->value;
+	coro_mutex_unlock(&sh->mutex);
+	coro_wait_group_done(&sh->wg);
+	return 0;
+}
+
+static int
+test_producer_f(void *arg)
+{
+	struct test_shared *sh = (struct test_shared *)arg;
+	for (long i = 1; i <= 100; ++i)
+		unit_fail_if(coro_channel_send(&sh->channel, (void *)i) != 0);
+	coro_channel_close(&sh->channel);
+	return 0;
+}
+
+static int
+test_consumer_f(void *arg)
+{
+	struct test_shared *sh = (struct test_shared *)arg;
+	void *msg;
+	int sum = 0;
+	while (coro_channel_recv(&sh->channel, &msg) == 0) {
+		unit_fail_if(sh->channel.size > sh->channel.capacity);
+		sum += (int)(long)msg;
+	}
+	return sum;
+}
+
+static void
+test_sync(void)
+{
+	unit_test_start();
+
+	struct test_shared sh;
+	coro_mutex_create(&sh.mutex);
+	coro_cond_create(&sh.cond);
+	coro_wait_group_create(&sh.wg);
+	sh.value = 0;
+	sh.flag = false;
+	for (int i = 0; i < 3; ++i)
+		coro_new(test_mutex_f, &sh);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(sh.value == 30, "mutex protects the critical section");
+
+	sh.value = 0;
+	coro_wait_group_add(&sh.wg, 3);
+	for (int i = 0; i < 3; ++i)
+		coro_new(test_cond_f, &sh);
+	for (int i = 0; i < 5; ++i)
+		coro_yield();
+	unit_check(sh.value == 0, "waiters are blocked on the condition");
+	coro_mutex_lock(&sh.mutex);
+	sh.flag = true;
+	coro_cond_broadcast(&sh.cond);
+	coro_mutex_unlock(&sh.mutex);
+	coro_wait_group_wait(&sh.wg);
+	unit_check(sh.value == 3, "broadcast woke everyone, wait group "\
+		   "waited for all");
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+
+	unit_check(coro_channel_create(&sh.channel, 0) != 0,
+		   "zero capacity channel");
+	unit_fail_if(coro_channel_create(&sh.channel, 4) != 0);
+	struct coro *consumers[2];
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.joinable = true;
+	consumers[0] = coro_new_ex(test_consumer_f, &sh, &attr);
+	consumers[1] = coro_new_ex(test_consumer_f, &sh, &attr);
+	struct coro *producer = coro_new_ex(test_producer_f, &sh, &attr);
+	coro_join(producer);
+	int sum = coro_join(consumers[0]) + coro_join(consumers[1]);
+	unit_check(sum == 5050, "all messages are received once");
+	unit_check(coro_channel_send(&sh.channel, NULL) != 0,
+		   "can't send into a closed channel");
+	coro_delete(producer);
+	coro_delete(consumers[0]);
+	coro_delete(consumers[1]);
+	coro_channel_destroy(&sh.channel);
+
+	coro_wait_group_destroy(&sh.wg);
+	coro_cond_destroy(&sh.cond);
+	coro_mutex_destroy(&sh.mutex);
+
+	unit_test_finish();
+}
+
+static int
+test_spin_f(void *arg)
+{
+	int *yields = (int *)arg;
+	struct coro_stats stats;
+	do {
+		if (coro_yield_if_expired())
+			++*yields;
+		coro_stats(coro_this(), &stats);
+	} while (stats.run_time < 20 * 1000 * 1000);
+	return 0;
+}
+
+static void
+test_quantum(void)
+{
+	unit_test_start();
+
+	int yields = 0;
+	coro_sched_set_quantum(1000);
+	struct coro *c1 = coro_new(test_spin_f, &yields);
+	struct coro *c2 = coro_new(test_spin_f, &yields);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		struct coro_stats stats;
+		coro_stats(c, &stats);
+		unit_fail_if(c != c1 && c != c2);
+		unit_check(stats.run_time >= 20 * 1000 * 1000 &&
+			   stats.run_time < 30 * 1000 * 1000,
+			   "run time doesn't include waiting");
+		coro_delete(c);
+	}
+	unit_check(yields >= 10 && yields <= 200,
+		   "coroutines yielded once per quantum");
+	coro_sched_set_quantum(CORO_QUANTUM_INFINITE);
+	unit_check(! coro_yield_if_expired(), "infinite quantum");
+
+	unit_test_finish();
+}
+
+static int
+test_preempt_f(void *arg)
+{
+	volatile long *progress = (volatile long *)arg;
+	uint64_t start = test_now_ns();
+	/* Never yields explicitly, only at the safe points. */
+	while (test_now_ns() - start < 20 * 1000 * 1000) {
+		++*progress;
+		CORO_SAFE_POINT();
+	}
+	return 0;
+}
+
+/** Two coroutines, which never yield, should take turns. */
+static void
+test_preempt_run(void)
+{
+	long progress[2] = {0, 0};
+	struct coro *c1 = coro_new(test_preempt_f, &progress[0]);
+	struct coro *c2 = coro_new(test_preempt_f, &progress[1]);
+	unit_check(coro_join(c1) == 0 && progress[1] > 0,
+		   "the second coroutine worked before the first finished");
+	coro_join(c2);
+	unit_check(coro_switch_count(c1) > 2 && coro_switch_count(c2) > 2,
+		   "coroutines were preempted");
+	coro_delete(c1);
+	coro_delete(c2);
+}
+
+static void
+test_preemption(void)
+{
+	unit_test_start();
+
+	unit_check(coro_sched_enable_preemption() != 0,
+		   "can't preempt without a quantum");
+	coro_sched_set_quantum(1000);
+	unit_check(coro_sched_enable_preemption() == 0, "timer is armed");
+	test_preempt_run();
+	/* Too short for the timer, the safe points check the ticks. */
+	coro_sched_set_quantum(10);
+	unit_check(coro_sched_enable_preemption() == 0,
+		   "short quantum is taken");
+	test_preempt_run();
+	coro_sched_set_quantum(0);
+	unit_check(coro_sched_enable_preemption() == 0, "zero quantum is taken");
+	long progress[2] = {0, 0};
+	struct coro *c1 = coro_new(test_preempt_f, &progress[0]);
+	struct coro *c2 = coro_new(test_preempt_f, &progress[1]);
+	coro_join(c1);
+	coro_join(c2);
+	unit_check(coro_switch_count(c1) >= progress[0] - 1,
+		   "zero quantum yields at each safe point");
+	coro_delete(c1);
+	coro_delete(c2);
+	coro_sched_disable_preemption();
+	coro_sched_set_quantum(CORO_QUANTUM_INFINITE);
+
+	unit_test_finish();
+}
+
+struct test_workers {
+	struct coro_mutex mutex;
+	long value;
+	/** Protects the threads, they are seen without the mutex. */
+	pthread_mutex_t threads_lock;
+	/** Distinct threads the coroutines have run in. */
+	pthread_t threads[4];
+	int thread_count;
+	struct coro_queue sleepers;
+	bool is_woken;
+};
+
+/** Remember the current thread. Returns how many are seen. */
+static int
+test_workers_seen(struct test_workers *tw)
+{
+	pthread_t self = pthread_self();
+	pthread_mutex_lock(&tw->threads_lock);
+	bool is_new = true;
+	for (int i = 0; i < tw->thread_count && is_new; ++i)
+		is_new = ! pthread_equal(tw->threads[i], self);
+	if (is_new && tw->thread_count < 4)
+		tw->threads[tw->thread_count++] = self;
+	int count = tw->thread_count;
+	pthread_mutex_unlock(&tw->threads_lock);
+	return count;
+}
+
+static int
+test_workers_f(void *arg)
+{
+	struct test_workers *tw = (struct test_workers *)arg;
+	/*
+	 * Hold the worker, until another one takes a coroutine too.
+	 * With one CPU a single worker could run them all otherwise.
+	 */
+	uint64_t deadline = test_now_ns() + 1000000000;
+	while (test_workers_seen(tw) < 2 && test_now_ns() < deadline)
+		sched_yield();
+	for (int i = 0; i < 1000; ++i) {
+		coro_mutex_lock(&tw->mutex);
+		test_workers_seen(tw);
+		long v = tw->value;
+		coro_yield();
+		tw->value = v + 1;
+		coro_mutex_unlock(&tw->mutex);
+	}
+	return 0;
+}
+
+static int
+test_sleeper_f(void *arg)
+{
+	struct test_workers *tw = (struct test_workers *)arg;
+	coro_sched_lock();
+	while (! tw->is_woken)
+		coro_wait(&tw->sleepers);
+	coro_sched_unlock();
+	return 1;
+}
+
+static void
+test_workers(void)
+{
+	unit_test_start();
+
+	struct test_workers tw;
+	memset(&tw, 0, sizeof(tw));
+	coro_mutex_create(&tw.mutex);
+	pthread_mutex_init(&tw.threads_lock, NULL);
+	coro_queue_create(&tw.sleepers);
+	/* Created before the workers, runs in them. */
+	struct coro *sleeper = coro_new(test_sleeper_f, &tw);
+	unit_check(coro_sched_set_workers(2) == 0 &&
+		   coro_sched_workers() == 2, "workers are started");
+	unit_check(coro_sched_set_policy(CORO_POLICY_EDF) != 0 &&
+		   errno == EINVAL, "only round-robin with workers");
+	for (int i = 0; i < 8; ++i)
+		coro_new(test_workers_f, &tw);
+	unit_check(coro_sched_set_workers(0) != 0 && errno == EBUSY,
+		   "can't stop the busy workers");
+	int finished = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		unit_fail_if(c == sleeper && finished < 8);
+		coro_delete(c);
+		if (++finished == 8) {
+			/* Wake the sleeper from a non-worker thread. */
+			coro_sched_lock();
+			tw.is_woken = true;
+			coro_wakeup_all(&tw.sleepers);
+			coro_sched_unlock();
+		}
+	}
+	unit_check(finished == 9, "all finished");
+	unit_check(tw.value == 8000, "mutex works across the threads");
+	unit_check(tw.thread_count >= 2, "coroutines ran in many threads");
+	unit_check(coro_sched_set_workers(0) == 0 &&
+		   coro_sched_workers() == 0, "workers are stopped");
+	coro_mutex_destroy(&tw.mutex);
+	pthread_mutex_destroy(&tw.threads_lock);
+
+	c = coro_new(test_yield_f, &finished);
+	unit_check(coro_sched_wait() == c, "main thread runs coroutines "\
+		   "again");
+	coro_delete(c);
+
+	unit_test_finish();
+}
+
+struct test_spawn {
+	struct coro *child;
+	int counter;
+};
+
+static int
+test_spawner_f(void *arg)
+{
+	struct test_spawn *sp = (struct test_spawn *)arg;
+	sp->child = coro_new(test_yield_f, &sp->counter);
+	coro_yield();
+	return 0;
+}
+
+static void
+test_sched(void)
+{
+	unit_test_start();
+
+	struct coro_sched *s = coro_sched_new();
+	unit_fail_if(s == NULL);
+	int counter = 0, other = 0;
+	struct coro *c1 = coro_new_in(s, test_yield_f, &counter, NULL);
+	struct coro *c2 = coro_new_in(s, test_yield_f, &counter, NULL);
+	struct coro *d = coro_new(test_yield_f, &other);
+	unit_check(coro_sched(c1) == s && coro_sched(d) != s,
+		   "coroutines are in their schedulers");
+	unit_check(coro_sched_count(s) == 2, "count of the scheduler");
+	int finished = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait_in(s)) != NULL) {
+		unit_fail_if(c != c1 && c != c2);
+		coro_delete(c);
+		++finished;
+	}
+	unit_check(finished == 2 && counter == 20, "wait in the scheduler "\
+		   "runs only its coroutines");
+	unit_check(other == 0 && ! coro_is_finished(d), "the default one "\
+		   "is not touched");
+
+	/* A child of a coroutine is in the same scheduler. */
+	struct test_spawn sp = {NULL, 0};
+	coro_new_in(s, test_spawner_f, &sp, NULL);
+	coro_sched_run(s);
+	unit_check(sp.child != NULL && sp.counter == 10 &&
+		   coro_sched_count(s) == 0, "the children are run too");
+	coro_sched_delete(s);
+
+	unit_check(coro_sched_wait() == d && other == 10, "the default one "\
+		   "works after");
+	coro_delete(d);
+	unit_check(coro_sched_wait() == NULL, "nothing to wait");
+
+	unit_test_finish();
+}
+
+struct test_io {
+	int fds[2];
+	/** Steps done by the writer, while the reader waits. */
+	int steps;
+	int steps_seen;
+	char buf[16];
+	int listen_fd;
+	struct sockaddr_in addr;
+};
+
+static int
+test_io_reader_f(void *arg)
+{
+	struct test_io *ti = (struct test_io *)arg;
+	ssize_t rc = coro_read(ti->fds[0], ti->buf, sizeof(ti->buf));
+	ti->steps_seen = ti->steps;
+	return (int)rc;
+}
+
+static int
+test_io_writer_f(void *arg)
+{
+	struct test_io *ti = (struct test_io *)arg;
+	for (; ti->steps < 5; ++ti->steps)
+		coro_yield();
+	return (int)coro_write(ti->fds[1], "hello", 5);
+}
+
+static int
+test_io_server_f(void *arg)
+{
+	struct test_io *ti = (struct test_io *)arg;
+	int fd = coro_accept(ti->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return -1;
+	ssize_t rc = coro_read(fd, ti->buf, sizeof(ti->buf));
+	close(fd);
+	return (int)rc;
+}
+
+static int
+test_io_client_f(void *arg)
+{
+	struct test_io *ti = (struct test_io *)arg;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	int rc = -1;
+	if (coro_connect(fd, (struct sockaddr *)&ti->addr,
+			 sizeof(ti->addr)) == 0)
+		rc = (int)coro_write(fd, "world", 5);
+	close(fd);
+	return rc;
+}
+
+enum {
+	TEST_IO_CHUNK = 80000,
+	TEST_IO_CHUNKS = 32,
+	TEST_IO_FILES = 8,
+};
+
+/** Writes and reads back a file, while the signals interrupt it. */
+static int
+test_io_file_f(void *arg)
+{
+	int fd = *(int *)arg;
+	char *buf = malloc(TEST_IO_CHUNK);
+	int ok = 0;
+	for (int i = 0; i < TEST_IO_CHUNKS; ++i) {
+		memset(buf, 'a' + i % 26, TEST_IO_CHUNK);
+		ok += coro_write(fd, buf, TEST_IO_CHUNK) == TEST_IO_CHUNK;
+	}
+	/* The reads should go to the disk, not to the page cache. */
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	lseek(fd, 0, SEEK_SET);
+	for (int i = 0; i < TEST_IO_CHUNKS; ++i) {
+		ok += coro_read(fd, buf, TEST_IO_CHUNK) == TEST_IO_CHUNK &&
+		      buf[0] == 'a' + i % 26 &&
+		      buf[TEST_IO_CHUNK - 1] == 'a' + i % 26;
+	}
+	free(buf);
+	return ok;
+}
+
+static int
+test_io_spin_f(void *arg)
+{
+	volatile bool *is_done = (volatile bool *)arg;
+	while (! *is_done)
+		CORO_SAFE_POINT();
+	return 0;
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	struct test_io ti;
+	memset(&ti, 0, sizeof(ti));
+	unit_check(coro_io_engine() != CORO_IO_BLOCKING, "async engine");
+	/*
+	 * The file operations go to the workers of io_uring. They are
+	 * canceled, if a signal comes, while a worker is created, so
+	 * this goes before the other tests create them. The extra
+	 * timer is much faster, than the preemption one can be, to
+	 * make it likely, and a coroutine keeps the CPU busy.
+	 */
+	coro_sched_set_quantum(CORO_PREEMPT_MIN_USEC);
+	unit_fail_if(coro_sched_enable_preemption() != 0);
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = CORO_PREEMPT_SIGNAL;
+	sev._sigev_un._tid = syscall(SYS_gettid);
+	timer_t storm;
+	unit_fail_if(timer_create(CLOCK_MONOTONIC, &sev, &storm) != 0);
+	struct itimerspec its = {{0, 10000}, {0, 10000}};
+	unit_fail_if(timer_settime(storm, 0, &its, NULL) != 0);
+	int files[TEST_IO_FILES];
+	struct coro *writers[TEST_IO_FILES];
+	for (int i = 0; i < TEST_IO_FILES; ++i) {
+		char file_path[] = "/tmp/test_coro_XXXXXX";
+		files[i] = mkstemp(file_path);
+		unit_fail_if(files[i] < 0);
+		unlink(file_path);
+		writers[i] = coro_new(test_io_file_f, &files[i]);
+	}
+	bool is_done = false;
+	struct coro *spin = coro_new(test_io_spin_f, &is_done);
+	bool is_file_ok = true;
+	for (int i = 0; i < TEST_IO_FILES; ++i) {
+		is_file_ok &= coro_join(writers[i]) == 2 * TEST_IO_CHUNKS;
+		coro_delete(writers[i]);
+		close(files[i]);
+	}
+	is_done = true;
+	coro_join(spin);
+	coro_delete(spin);
+	timer_delete(storm);
+	coro_sched_disable_preemption();
+	coro_sched_set_quantum(CORO_QUANTUM_INFINITE);
+	unit_check(is_file_ok, "file I/O is not canceled by the signals");
+
+	unit_fail_if(pipe(ti.fds) != 0);
+	struct coro *r = coro_new(test_io_reader_f, &ti);
+	struct coro *w = coro_new(test_io_writer_f, &ti);
+	unit_check(coro_sched_wait() == w && coro_status(w) == 5,
+		   "writer is done");
+	unit_check(coro_sched_wait() == r && coro_status(r) == 5 &&
+		   memcmp(ti.buf, "hello", 5) == 0, "reader got the data");
+	unit_check(ti.steps_seen == 5, "others ran during the read");
+	coro_delete(r);
+	coro_delete(w);
+	close(ti.fds[0]);
+	close(ti.fds[1]);
+
+	/* The scheduler itself can wait for I/O too. */
+	char path[] = "/tmp/test_coro_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	unlink(path);
+	unit_check(coro_write(fd, "0123456789", 10) == 10, "file write");
+	unit_fail_if(lseek(fd, 2, SEEK_SET) != 2);
+	memset(ti.buf, 0, sizeof(ti.buf));
+	unit_check(coro_read(fd, ti.buf, 4) == 4 &&
+		   memcmp(ti.buf, "2345", 4) == 0, "file read from the "\
+		   "current position");
+	unit_check(coro_read(fd, ti.buf, sizeof(ti.buf)) == 4 &&
+		   coro_read(fd, ti.buf, sizeof(ti.buf)) == 0, "file end");
+	close(fd);
+	unit_check(coro_read(-1, ti.buf, 1) == -1 && errno == EBADF,
+		   "errors are reported in errno");
+
+	ti.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	ti.addr.sin_family = AF_INET;
+	ti.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(ti.addr);
+	unit_fail_if(ti.listen_fd < 0 ||
+		     bind(ti.listen_fd, (struct sockaddr *)&ti.addr, len) != 0 ||
+		     listen(ti.listen_fd, 1) != 0 ||
+		     getsockname(ti.listen_fd, (struct sockaddr *)&ti.addr,
+				 &len) != 0);
+	memset(ti.buf, 0, sizeof(ti.buf));
+	struct coro *server = coro_new(test_io_server_f, &ti);
+	struct coro *client = coro_new(test_io_client_f, &ti);
+	unit_check(coro_join(client) == 5, "connected and sent");
+	unit_check(coro_join(server) == 5 &&
+		   memcmp(ti.buf, "world", 5) == 0, "accepted and received");
+	coro_delete(client);
+	coro_delete(server);
+	close(ti.listen_fd);
+	coro_io_destroy();
+
+	unit_test_finish();
+}
+
+struct test_step {
+	/** Yields left. */
+	int count;
+	/** Shared run order log. */
+	struct test_order *order;
+	int id;
+	struct coro_queue *queue;
+	bool *flag;
+	atomic_long *sum;
+};
+
+static enum coro_step
+test_step_yield_f(struct coro *c, void *arg)
+{
+	struct test_step *st = (struct test_step *)arg;
+	CORO_BEGIN(c);
+	while (st->count-- > 0) {
+		st->order->log[st->order->size++] = st->id;
+		CORO_YIELD(c);
+	}
+	CORO_RETURN(c, st->id);
+	CORO_END(c);
+}
+
+static enum coro_step
+test_step_wait_f(struct coro *c, void *arg)
+{
+	struct test_step *st = (struct test_step *)arg;
+	CORO_BEGIN(c);
+	coro_sched_lock();
+	while (! *st->flag)
+		CORO_WAIT(c, st->queue);
+	coro_sched_unlock();
+	CORO_RETURN(c, 7);
+	CORO_END(c);
+}
+
+static int
+test_step_waker_f(void *arg)
+{
+	struct test_step *st = (struct test_step *)arg;
+	coro_yield();
+	coro_sched_lock();
+	*st->flag = true;
+	coro_wakeup_all(st->queue);
+	coro_sched_unlock();
+	return 0;
+}
+
+static enum coro_step
+test_step_count_f(struct coro *c, void *arg)
+{
+	struct test_step *st = (struct test_step *)arg;
+	CORO_BEGIN(c);
+	while (st->count-- > 0) {
+		atomic_fetch_add(st->sum, 1);
+		CORO_YIELD(c);
+	}
+	CORO_END(c);
+}
+
+static void
+test_stackless(void)
+{
+	unit_test_start();
+
+	memset(&test_order, 0, sizeof(test_order));
+	struct test_step st[2];
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.joinable = true;
+	struct coro *c[3];
+	for (int i = 0; i < 2; ++i) {
+		memset(&st[i], 0, sizeof(st[i]));
+		st[i].count = 3;
+		st[i].order = &test_order;
+		st[i].id = i + 1;
+		c[i] = coro_new_stackless(test_step_yield_f, &st[i], &attr);
+		unit_fail_if(c[i] == NULL);
+	}
+	c[2] = coro_new_ex(test_order_f, (void *)0, &attr);
+	unit_check(coro_join(c[0]) == 1 && coro_join(c[1]) == 2,
+		   "stackless coroutines finish with a status");
+	coro_join(c[2]);
+	unit_check(test_order_is("120120120"), "stackless and stackful "\
+		   "ones share the round-robin");
+	unit_check(coro_switch_count(c[0]) == 4, "each step is a switch");
+	for (int i = 0; i < 3; ++i)
+		coro_delete(c[i]);
+
+	struct coro_queue q;
+	coro_queue_create(&q);
+	bool flag = false;
+	st[0].queue = &q;
+	st[0].flag = &flag;
+	c[0] = coro_new_stackless(test_step_wait_f, &st[0], &attr);
+	c[1] = coro_new_stackless(test_step_wait_f, &st[0], &attr);
+	c[2] = coro_new(test_step_waker_f, &st[0]);
+	unit_check(coro_join(c[0]) == 7 && coro_join(c[1]) == 7,
+		   "stackless coroutines wait in the queues");
+	unit_check(coro_sched_wait() == c[2], "stackful waker finished");
+	for (int i = 0; i < 3; ++i)
+		coro_delete(c[i]);
+
+	unit_fail_if(coro_sched_set_workers(2) != 0);
+	atomic_long sum = 0;
+	struct test_step counters[100];
+	for (int i = 0; i < 100; ++i) {
+		memset(&counters[i], 0, sizeof(counters[i]));
+		counters[i].count = 50;
+		counters[i].sum = &sum;
+		unit_fail_if(coro_new_stackless(test_step_count_f,
+						&counters[i], NULL) == NULL);
+	}
+	int finished = 0;
+	struct coro *done;
+	while ((done = coro_sched_wait()) != NULL) {
+		coro_delete(done);
+		++finished;
+	}
+	unit_check(finished == 100 && sum == 5000, "worker threads run "\
+		   "stackless coroutines");
+	unit_fail_if(coro_sched_set_workers(0) != 0);
+
+	unit_test_finish();
+}
+
+static int
+test_sleep_f(void *arg)
+{
+	uint64_t usec = (uint64_t)(uintptr_t)arg;
+	coro_sleep(usec);
+	test_order.log[test_order.size++] = usec / 1000;
+	return 0;
+}
+
+static int
+test_timeouts_f(void *arg)
+{
+	struct test_shared *sh = (struct test_shared *)arg;
+	int ok = 0;
+	uint64_t start = coro_time();
+	if (! coro_mutex_lock_timeout(&sh->mutex, 1000) &&
+	    coro_time() - start >= 1000)
+		++ok;
+	void *msg;
+	errno = 0;
+	if (coro_channel_recv_timeout(&sh->channel, &msg, 1000) != 0 &&
+	    errno == ETIMEDOUT)
+		++ok;
+	if (coro_channel_send_timeout(&sh->channel, NULL, 0) == 0 &&
+	    coro_channel_send_timeout(&sh->channel, NULL, 1000) != 0 &&
+	    errno == ETIMEDOUT)
+		++ok;
+	if (! coro_wait_group_wait_timeout(&sh->wg, 1000))
+		++ok;
+	/* Main unlocks the mutex meanwhile. */
+	if (coro_mutex_lock_timeout(&sh->mutex, CORO_TIMEOUT_INFINITE)) {
+		if (! coro_cond_wait_timeout(&sh->cond, &sh->mutex, 1000) &&
+		    sh->mutex.owner == coro_this())
+			++ok;
+		coro_mutex_unlock(&sh->mutex);
+	}
+	return ok;
+}
+
+static void
+test_wheel(void)
+{
+	enum { COUNT = 512 };
+	static struct coro_timer timers[COUNT];
+	struct coro_wheel w;
+	uint64_t now = UINT64_C(1) << 40;
+	coro_wheel_create(&w, now);
+	for (int i = 0; i < COUNT; ++i)
+		coro_timer_create(&timers[i]);
+	srand(13);
+	bool ok = true;
+	for (int step = 0; step < 20000 && ok; ++step) {
+		struct coro_timer *t = &timers[rand() % COUNT];
+		if (t->is_armed) {
+			coro_wheel_remove(&w, t);
+		} else {
+			/* From the near to the very far future. */
+			uint64_t delay = 1 + ((uint64_t)rand() >> (rand() % 31));
+			coro_wheel_add(&w, t, now + delay);
+		}
+		if (rand() % 4 != 0)
+			continue;
+		uint64_t to = now + ((uint64_t)rand() >> (rand() % 31));
+		uint64_t next = coro_wheel_next(&w);
+		for (t = coro_wheel_advance(&w, to); t != NULL; t = t->next)
+			ok = ok && t->deadline <= to && t->deadline >= next;
+		now = to;
+		for (int i = 0; i < COUNT; ++i) {
+			ok = ok && (! timers[i].is_armed ||
+				    timers[i].deadline > now);
+		}
+	}
+	unit_check(ok, "timer wheel expires the timers exactly in time");
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	test_wheel();
+
+	memset(&test_order, 0, sizeof(test_order));
+	coro_new(test_sleep_f, (void *)(uintptr_t)3000);
+	coro_new(test_sleep_f, (void *)(uintptr_t)1000);
+	coro_new(test_sleep_f, (void *)(uintptr_t)2000);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(test_order_is("123"), "sleepers wake up by deadline");
+
+	struct coro_queue q;
+	coro_queue_create(&q);
+	uint64_t start = coro_time();
+	coro_sched_lock();
+	bool is_woken = coro_wait_timeout(&q, 2000);
+	coro_sched_unlock();
+	unit_check(! is_woken && coro_time() - start >= 2000,
+		   "wait times out");
+	start = coro_time();
+	coro_sleep(1000);
+	unit_check(coro_time() - start >= 1000, "main sleeps with nothing "\
+		   "else to run");
+
+	struct test_shared sh;
+	coro_mutex_create(&sh.mutex);
+	coro_cond_create(&sh.cond);
+	coro_wait_group_create(&sh.wg);
+	unit_fail_if(coro_channel_create(&sh.channel, 1) != 0);
+	coro_wait_group_add(&sh.wg, 1);
+	coro_mutex_lock(&sh.mutex);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.joinable = true;
+	c = coro_new_ex(test_timeouts_f, &sh, &attr);
+	coro_sleep(1500);
+	coro_mutex_unlock(&sh.mutex);
+	unit_check(coro_join(c) == 5, "sync primitives time out");
+	coro_delete(c);
+	coro_wait_group_done(&sh.wg);
+	coro_channel_destroy(&sh.channel);
+	coro_wait_group_destroy(&sh.wg);
+	coro_cond_destroy(&sh.cond);
+	coro_mutex_destroy(&sh.mutex);
+
+	unit_fail_if(coro_sched_set_workers(2) != 0);
+	memset(&test_order, 0, sizeof(test_order));
+	coro_new(test_sleep_f, (void *)(uintptr_t)2000);
+	coro_new(test_sleep_f, (void *)(uintptr_t)1000);
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_check(test_order.size == 2, "workers wake up the sleepers");
+	unit_fail_if(coro_sched_set_workers(0) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_trace(void)
+{
+	unit_test_start();
+
+	char path[] = "/tmp/test_coro_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	close(fd);
+	unit_check(coro_sched_enable_tracing(0) != 0 && errno == EINVAL,
+		   "tracing needs a buffer");
+	unit_fail_if(coro_sched_enable_tracing(4) != 0);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.name = "traced \"one\"";
+	memset(&test_order, 0, sizeof(test_order));
+	coro_new_ex(test_order_f, (void *)0, &attr);
+	struct test_step st;
+	memset(&st, 0, sizeof(st));
+	st.count = 3;
+	st.order = &test_order;
+	st.id = 1;
+	coro_new_stackless(test_step_yield_f, &st, NULL);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_fail_if(coro_sched_dump_trace(path) != 0);
+	char buf[4096];
+	FILE *f = fopen(path, "r");
+	unit_fail_if(f == NULL);
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[size] = 0;
+	fclose(f);
+	int slices = 0;
+	for (char *pos = buf; (pos = strstr(pos, "\"ph\":\"X\"")) != NULL;
+	     ++pos)
+		++slices;
+	unit_check(slices == 4, "only the last slices are kept");
+	unit_check(strstr(buf, "{\"displayTimeUnit\"") == buf &&
+		   strstr(buf, "]}\n") != NULL, "trace is a JSON object");
+	unit_check(strstr(buf, "\"end\":\"finish\"") != NULL,
+		   "finish is traced");
+
+	unit_fail_if(coro_sched_enable_tracing(1024) != 0);
+	test_order.size = 0;
+	coro_new_ex(test_order_f, (void *)0, &attr);
+	coro_new_ex(test_order_f, (void *)1, NULL);
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_fail_if(coro_sched_dump_trace(path) != 0);
+	f = fopen(path, "r");
+	unit_fail_if(f == NULL);
+	size = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[size] = 0;
+	fclose(f);
+	unit_check(strstr(buf, "\"name\":\"traced \\\"one\\\"\"") != NULL &&
+		   strstr(buf, "\"end\":\"yield\"") != NULL,
+		   "names are escaped, yields are traced");
+	unit_check(strstr(buf, "\"name\":\"main\",") != NULL &&
+		   strstr(buf, "\"end\":\"wait\"") != NULL,
+		   "the waiting thread is traced");
+	coro_sched_disable_tracing();
+	unlink(path);
+
+	unit_test_finish();
+}
+
+static int
+test_deep_f(void *arg)
+{
+	(void)arg;
+	volatile char buf[8 * 1024];
+	memset((char *)buf, 1, sizeof(buf));
+	coro_yield();
+	return buf[100];
+}
+
+static void
+test_attr(void)
+{
+	unit_test_start();
+
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	unit_check(attr.stack_size == CORO_STACK_SIZE_DEFAULT,
+		   "default stack size");
+	attr.name = "small";
+	attr.stack_size = 1;
+	attr.stack_debug = true;
+	struct coro *c = coro_new_ex(test_deep_f, NULL, &attr);
+	unit_check(c != NULL, "tiny stack is rounded up");
+	unit_check(strcmp(coro_name(c), "small") == 0, "name");
+	unit_check(coro_sched_wait() == c, "finished");
+	unit_check(coro_status(c) == 1, "status");
+	size_t used = coro_stack_high_water(c);
+	unit_check(used >= 8 * 1024 && used <= CORO_STACK_SIZE_MIN,
+		   "high-water mark");
+	coro_delete(c);
+
+	static char stack[64 * 1024];
+	attr.name = "a name which is too long to fit into a coroutine";
+	attr.stack = stack;
+	attr.stack_size = sizeof(stack);
+	attr.stack_debug = false;
+	c = coro_new_ex(test_deep_f, NULL, &attr);
+	unit_check(c != NULL, "user stack");
+	unit_check(strlen(coro_name(c)) == CORO_NAME_MAX - 1,
+		   "long name is truncated");
+	unit_check(coro_sched_wait() == c && coro_status(c) == 1,
+		   "finished on the user stack");
+	unit_check(coro_stack_high_water(c) == 0, "no high-water mark");
+	unit_check(stack[sizeof(stack) - 4096] == 1, "user stack was used");
+	coro_delete(c);
+
+	unit_test_finish();
+}
+
+static void
+test_stack_pool(void)
+{
+	unit_test_start();
+
+	struct coro_stack_stats before, after;
+	coro_stack_pool_stats(&before);
+	for (int i = 0; i < 10; ++i) {
+		coro_new(test_deep_f, NULL);
+		coro_delete(coro_sched_wait());
+	}
+	coro_stack_pool_stats(&after);
+	unit_check(after.misses - before.misses <= 1, "stacks are reused");
+	unit_check(after.hits - before.hits >= 9, "pool hits are counted");
+	unit_check(after.used == 0, "no used stacks");
+	coro_stack_pool_set_max_idle(0);
+	coro_stack_pool_stats(&after);
+	unit_check(after.idle == 0, "idle stacks are released");
+
+	unit_test_finish();
+}
+
+/** Text into a new file, the path is returned in @a path. */
+static void
+test_text_file(char *path, const char *text)
+{
+	strcpy(path, "/tmp/test_coro_XXXXXX");
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	size_t len = strlen(text);
+	unit_fail_if(write(fd, text, len) != (ssize_t)len);
+	close(fd);
+}
+
+/** The numbers, as a strtol() loop takes them, until it can't. */
+static long
+test_strtol_all(const char *text, long *values)
+{
+	long count = 0;
+	while (true) {
+		char *end;
+		errno = 0;
+		long v = strtol(text, &end, 10);
+		if (end == text)
+			return count;
+		values[count++] = v;
+		text = end;
+	}
+}
+
+/** Parses @a text with int_parser and int_reader, compares to strtol(). */
+static bool
+test_int_text(const char *text, size_t buf_size, long max)
+{
+	long expected[256];
+	long count = test_strtol_all(text, expected);
+	char path[32];
+	test_text_file(path, text);
+	bool is_ok = true;
+
+	int_parser p;
+	unit_fail_if(int_parser_open(&p, path) != 0);
+	/* Small steps, to stop and continue in the middle. */
+	while (! int_parser_step(&p, 3))
+		;
+	long parsed_count;
+	long *parsed = int_parser_finish(&p, &parsed_count);
+	is_ok &= parsed_count == count &&
+		 memcmp(parsed, expected, sizeof(long) * count) == 0;
+	free(parsed);
+
+	int_reader r;
+	unit_fail_if(int_reader_open(&r, path, buf_size) != 0);
+	long read[256], read_count = 0, rc;
+	while ((rc = int_reader_read(&r, read + read_count, max)) > 0)
+		read_count += rc;
+	int_reader_close(&r);
+	unlink(path);
+	is_ok &= rc == 0 && read_count == count &&
+		 memcmp(read, expected, sizeof(long) * count) == 0;
+	return is_ok;
+}
+
+static void
+test_int_io(void)
+{
+	unit_test_start();
+
+	const char *texts[] = {
+		"",
+		"   \n\t ",
+		"1 -2 +3 -0 +0 007",
+		"\t\n 12\r\n-34\v\f56 ",
+		"9223372036854775807 -9223372036854775808",
+		"99999999999999999999 -99999999999999999999 "
+		"00000000000000000000000001",
+		"1 2 x 3",
+		"1 2 - 3",
+		"1 -+2 3",
+		"12abc 4",
+		"1 2 3-4 5",
+	};
+	bool is_ok = true;
+	for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i)
+		is_ok &= test_int_text(texts[i], 32, 256);
+	unit_check(is_ok, "signs, saturation and stops are like strtol()");
+
+	/* Random numbers and spaces, cut by the buffer everywhere. */
+	char text[2048];
+	srand(3);
+	is_ok = true;
+	for (int round = 0; round < 20; ++round) {
+		size_t len = 0;
+		for (int n = 0; n < 100 && len < sizeof(text) - 32; ++n) {
+			const char *spaces[] = {" ", "  ", "\n", "\t \r\n"};
+			long v = ((long)rand() << 31 ^ rand()) >> rand() % 62;
+			len += sprintf(text + len, "%s%ld", spaces[rand() % 4],
+				       rand() % 2 ? v : -v);
+		}
+		for (size_t buf_size = 24; buf_size <= 40; ++buf_size)
+			is_ok &= test_int_text(text, buf_size, 1 + rand() % 8);
+	}
+	unit_check(is_ok, "numbers across the reader's buffer ends");
+
+	char path[32];
+	test_text_file(path, "1 123456789012345678901234567890 2");
+	int_reader r;
+	unit_fail_if(int_reader_open(&r, path, 16) != 0);
+	long values[4];
+	unit_check(int_reader_read(&r, values, 4) == -1 && errno == ERANGE,
+		   "a number longer than the buffer is an error");
+	int_reader_close(&r);
+	unlink(path);
+
+	/*
+	 * Each length of the numbers, the edges of the 8 digit groups and
+	 * the extremes. They are repeated past the buffer of the writer.
+	 */
+	long edges[80];
+	int edge_count = 0;
+	edges[edge_count++] = 0;
+	edges[edge_count++] = LONG_MIN;
+	edges[edge_count++] = LONG_MAX;
+	for (long p = 10; true; p *= 10) {
+		edges[edge_count++] = p - 1;
+		edges[edge_count++] = p;
+		edges[edge_count++] = 1 - p;
+		edges[edge_count++] = -p;
+		/* 10^18 is the last power of 10 in long. */
+		if (p > LONG_MAX / 10)
+			break;
+	}
+	enum { REPEAT = 2000 };
+	long count = (long)edge_count * REPEAT;
+	long *numbers = malloc(sizeof(long) * count);
+	for (long i = 0; i < count; ++i)
+		numbers[i] = edges[i % edge_count];
+	char *expected = malloc(24 * count + 1), *got = malloc(24 * count);
+	size_t len = 0;
+	for (long i = 0; i < count; ++i)
+		len += snprintf(expected + len, 25, "%ld ", numbers[i]);
+	unit_check(len > INT_WRITER_BUF_SIZE, "more than the writer buffer");
+	unit_check(int_text_size(numbers, count) == len,
+		   "text size is the length of the text");
+	for (int is_mmap = 0; is_mmap <= 1; ++is_mmap) {
+		test_text_file(path, "");
+		int_writer w;
+		int rc = is_mmap ? int_writer_open_mmap(&w, path, len) :
+				   int_writer_open(&w, path);
+		unit_fail_if(rc != 0);
+		for (long i = 0; i < count; ++i)
+			int_writer_put(&w, numbers[i]);
+		unit_fail_if(int_writer_close(&w) != 0);
+		int fd = open(path, O_RDONLY);
+		ssize_t size = read(fd, got, 24 * count);
+		close(fd);
+		unlink(path);
+		unit_check(size == (ssize_t)len && memcmp(got, expected, len) == 0,
+			   is_mmap ? "mapped output is as printf() prints" :
+				     "output is as printf() prints");
+	}
+	free(got);
+	free(expected);
+	free(numbers);
+
+	unit_test_finish();
+}
+
+static int
+test_long_cmp(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+/** Sorts a copy of @a arr with @a sort, compares to qsort(). */
+static bool
+test_sort_like_qsort(void (*sort)(long *, long), const long *arr, long size)
+{
+	long *got = malloc(sizeof(long) * (size + 1));
+	long *expected = malloc(sizeof(long) * (size + 1));
+	memcpy(got, arr, sizeof(long) * size);
+	memcpy(expected, arr, sizeof(long) * size);
+	sort(got, size);
+	qsort(expected, size, sizeof(long), test_long_cmp);
+	bool is_ok = memcmp(got, expected, sizeof(long) * size) == 0;
+	free(got);
+	free(expected);
+	return is_ok;
+}
+
+static void
+test_sort_isa(void)
+{
+	unit_test_start();
+
+	enum sort_isa isa = sort_get_isa();
+	sort_set_isa(SORT_ISA_AVX2 + 1);
+	unit_check(sort_get_isa() == isa, "not more than the CPU has");
+
+	long sizes[] = {0, 1, 2, 15, 16, 17, 31, 33, 47, 100, 257, 4099};
+	long arr[4099];
+	srand(7);
+	bool is_ok = true;
+	for (int i = SORT_ISA_SCALAR; i <= SORT_ISA_AVX2; ++i) {
+		sort_set_isa(i);
+		for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); ++j) {
+			long size = sizes[j];
+			for (long k = 0; k < size; ++k)
+				arr[k] = (long)((unsigned long)rand() << 33 ^
+						(unsigned long)rand() << 2);
+			/* The extremes, and the duplicates of them. */
+			for (long k = 0; k < size / 8; ++k) {
+				arr[rand() % size] = LONG_MIN;
+				arr[rand() % size] = LONG_MAX;
+			}
+			if (size > 2) {
+				arr[0] = LONG_MAX;
+				arr[size - 1] = LONG_MIN;
+			}
+			is_ok &= test_sort_like_qsort(iter_merge_sort, arr,
+						      size);
+		}
+	}
+	sort_set_isa(isa);
+	unit_check(is_ok, "each instruction set sorts like qsort()");
+
+	unit_test_finish();
+}
+
+/** Ascending runs of the given lengths, each one starts lower. */
+static void
+test_fill_runs(long *arr, const long *lens, int count, int dups)
+{
+	long pos = 0, start = 1000000000;
+	for (int i = 0; i < count; ++i) {
+		start -= 1000;
+		for (long k = 0; k < lens[i]; ++k)
+			arr[pos++] = start + (rand() % 3 == 0 ? 0 : k / dups);
+		/* The equal ones in a row are the run. */
+		for (long k = pos - lens[i] + 1; k < pos; ++k)
+			if (arr[k] < arr[k - 1])
+				arr[k] = arr[k - 1];
+	}
+}
+
+static void
+test_tim_sort(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 100000 };
+	long *arr = malloc(sizeof(long) * SIZE);
+	srand(11);
+
+	bool is_ok = true;
+	long sizes[] = {0, 1, 2, 3, 63, 64, 65, 1000, SIZE};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		long size = sizes[i];
+		for (long k = 0; k < size; ++k)
+			arr[k] = k;
+		is_ok &= test_sort_like_qsort(tim_sort, arr, size);
+		for (long k = 0; k < size; ++k)
+			arr[k] = size - k;
+		is_ok &= test_sort_like_qsort(tim_sort, arr, size);
+		/* Descending, but not strictly, is many runs. */
+		for (long k = 0; k < size; ++k)
+			arr[k] = (size - k) / 3;
+		is_ok &= test_sort_like_qsort(tim_sort, arr, size);
+		for (long k = 0; k < size; ++k)
+			arr[k] = 5;
+		is_ok &= test_sort_like_qsort(tim_sort, arr, size);
+		for (long k = 0; k < size; ++k)
+			arr[k] = k < size * 9 / 10 ? k : rand() - RAND_MAX / 2;
+		is_ok &= test_sort_like_qsort(tim_sort, arr, size);
+		for (long k = 0; k < size; ++k)
+			arr[k] = rand() % 50;
+		is_ok &= test_sort_like_qsort(tim_sort, arr, size);
+	}
+	unit_check(is_ok, "sorted, reversed, equal and random tail");
+
+	/*
+	 * Two runs, which take turns in the long chunks, so the merge
+	 * gallops, and in the short ones, so it stops galloping.
+	 */
+	is_ok = true;
+	long chunks[] = {1, 3, 7, 8, 50, 1000};
+	for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+		long chunk = chunks[i], half = SIZE / 2;
+		for (long k = 0; k < half; ++k) {
+			long c = k / chunk;
+			arr[k] = 2 * c * chunk + k % chunk;
+			arr[half + k] = (2 * c + 1) * chunk + k % chunk;
+		}
+		/* Some short stretches in the long ones. */
+		for (long k = 0; k < SIZE; k += 997)
+			arr[k] = k == 0 ? arr[k] : arr[k - 1];
+		is_ok &= test_sort_like_qsort(tim_sort, arr, SIZE);
+	}
+	unit_check(is_ok, "galloping merges");
+
+	/*
+	 * The lengths of the runs grow, fall like Fibonacci numbers, and are
+	 * random, for each branch of the merges on the stack.
+	 */
+	is_ok = true;
+	long lens[256];
+	for (int pattern = 0; pattern < 4; ++pattern) {
+		long total = 0;
+		int count = 0;
+		while (count < 256) {
+			long len;
+			if (pattern == 0)
+				len = 64 + count * 10;
+			else if (pattern == 1)
+				len = count < 2 ? 64 : 0;
+			else
+				len = 64 + rand() % (pattern == 2 ? 2000 : 100);
+			if (pattern == 1 && count >= 2)
+				len = lens[count - 1] + lens[count - 2];
+			if (total + len > SIZE)
+				break;
+			lens[count++] = len;
+			total += len;
+		}
+		if (pattern == 1) {
+			for (int k = 0; k < count / 2; ++k) {
+				long tmp = lens[k];
+				lens[k] = lens[count - 1 - k];
+				lens[count - 1 - k] = tmp;
+			}
+		}
+		test_fill_runs(arr, lens, count, 1 + pattern);
+		is_ok &= test_sort_like_qsort(tim_sort, arr, total);
+	}
+	unit_check(is_ok, "runs of the growing, falling and random lengths");
+
+	/*
+	 * The merge buffer can't be allocated under the limit of the address
+	 * space, and qsort() is taken.
+	 */
+	long size = 1 << 22;
+	long *big = malloc(sizeof(long) * size);
+	for (long k = 0; k < size; ++k)
+		big[k] = k < size / 2 ? 2 * k : 2 * (k - size / 2) + 1;
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	unit_fail_if(f == NULL || fscanf(f, "%ld", &pages) != 1);
+	fclose(f);
+	struct rlimit old_limit, limit;
+	unit_fail_if(getrlimit(RLIMIT_AS, &old_limit) != 0);
+	limit = old_limit;
+	limit.rlim_cur = pages * sysconf(_SC_PAGESIZE) + (1 << 20);
+	unit_fail_if(setrlimit(RLIMIT_AS, &limit) != 0);
+	tim_sort(big, size);
+	unit_fail_if(setrlimit(RLIMIT_AS, &old_limit) != 0);
+	is_ok = true;
+	for (long k = 0; k < size; ++k)
+		is_ok &= big[k] == k;
+	unit_check(is_ok, "sorted by qsort() without the memory for a merge");
+	free(big);
+
+	free(arr);
+	unit_test_finish();
+}
+
+/** The rest of each run, given by @a step numbers on a refill. */
+struct test_refill {
+	const long *rest[8];
+	long left[8];
+	long step;
+	int calls;
+};
+
+static bool
+test_refill_f(void *ctx, int run, loser_run *r)
+{
+	struct test_refill *rf = ctx;
+	long n = rf->left[run] < rf->step ? rf->left[run] : rf->step;
+	++rf->calls;
+	r->pos = rf->rest[run];
+	r->end = rf->rest[run] + n;
+	rf->rest[run] += n;
+	rf->left[run] -= n;
+	return n > 0;
+}
+
+/**
+ * Runs of the given sizes with random numbers and the duplicates
+ * across them, popped from the tree and compared to qsort() of all.
+ */
+static bool
+test_loser_tree_runs(const long *sizes, int k, long step)
+{
+	long *arrays[8], total = 0;
+	long all[4096];
+	for (int i = 0; i < k; ++i) {
+		/* The empty runs are NULL, as the tree allows. */
+		arrays[i] = NULL;
+		if (sizes[i] == 0)
+			continue;
+		arrays[i] = malloc(sizeof(long) * sizes[i]);
+		for (long j = 0; j < sizes[i]; ++j)
+			arrays[i][j] = rand() % 20;
+		qsort(arrays[i], sizes[i], sizeof(long), test_long_cmp);
+		memcpy(all + total, arrays[i], sizeof(long) * sizes[i]);
+		total += sizes[i];
+	}
+	qsort(all, total, sizeof(long), test_long_cmp);
+	/* With a step the tree gets only the first ones, the rest by refill. */
+	struct test_refill rf = {.step = step};
+	long firsts[8];
+	for (int i = 0; i < k; ++i) {
+		firsts[i] = step == 0 || sizes[i] < step ? sizes[i] : step;
+		rf.rest[i] = arrays[i] + firsts[i];
+		rf.left[i] = sizes[i] - firsts[i];
+	}
+	loser_tree t;
+	unit_fail_if(loser_tree_create(&t, arrays, firsts, k) != 0);
+	if (step != 0) {
+		t.refill = test_refill_f;
+		t.refill_ctx = &rf;
+	}
+	long count = 0, value;
+	bool is_ok = true;
+	while (loser_tree_pop(&t, &value)) {
+		is_ok &= count < total && value == all[count];
+		++count;
+	}
+	is_ok &= count == total && ! loser_tree_pop(&t, &value);
+	is_ok &= step == 0 || rf.calls > 0;
+	loser_tree_destroy(&t);
+	for (int i = 0; i < k; ++i)
+		free(arrays[i]);
+	return is_ok;
+}
+
+/** radix_sort_scratch() with the scratch of the test. */
+static void
+test_radix_scratch(long arr[], long size)
+{
+	long *scratch = malloc(sizeof(long) * (size + 1));
+	radix_sort_scratch(arr, size, scratch);
+	free(scratch);
+}
+
+static void
+test_radix_sort(void)
+{
+	unit_test_start();
+
+	/* Around the block, between which the passes yield. */
+	long sizes[] = {0, 1, 2, 16383, 16384, 16385, 40000};
+	long *arr = malloc(sizeof(long) * 40000);
+	srand(19);
+	bool is_ok[4] = {true, true, true, true};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		long size = sizes[i];
+		for (int s = 0; s < 2; ++s) {
+			void (*sort)(long *, long) = s == 0 ? radix_sort :
+							      test_radix_scratch;
+			for (long k = 0; k < size; ++k)
+				arr[k] = (int)((unsigned)rand() << 1 ^ rand());
+			if (size > 2) {
+				arr[0] = INT_MAX;
+				arr[size / 2] = INT_MIN;
+				arr[size - 1] = -1;
+			}
+			is_ok[0] &= test_sort_like_qsort(sort, arr, size);
+			/* As generator.py -m makes, the high digits are 0. */
+			for (long k = 0; k < size; ++k)
+				arr[k] = rand() % 101;
+			is_ok[1] &= test_sort_like_qsort(sort, arr, size);
+			for (long k = 0; k < size; ++k)
+				arr[k] = rand() % 10001;
+			is_ok[1] &= test_sort_like_qsort(sort, arr, size);
+			for (long k = 0; k < size; ++k)
+				arr[k] = -7;
+			is_ok[2] &= test_sort_like_qsort(sort, arr, size);
+			/* One is out of int, the merge sort takes them. */
+			for (long k = 0; k < size; ++k)
+				arr[k] = rand() - RAND_MAX / 2;
+			if (size > 0)
+				arr[size / 3] = (long)INT_MAX + 1;
+			if (size > 1)
+				arr[size / 2] = (long)INT_MIN - 1;
+			is_ok[3] &= test_sort_like_qsort(sort, arr, size);
+		}
+	}
+	unit_check(is_ok[0], "negatives, INT_MIN and INT_MAX");
+	unit_check(is_ok[1], "small numbers, the passes are skipped");
+	unit_check(is_ok[2], "equal numbers");
+	unit_check(is_ok[3], "out of int, sorted by the merge sort");
+	free(arr);
+
+	unit_test_finish();
+}
+
+static void
+test_loser_tree(void)
+{
+	unit_test_start();
+
+	loser_tree t;
+	long value;
+	unit_check(loser_tree_create(&t, NULL, NULL, 0) == 0 &&
+		   ! loser_tree_pop(&t, &value), "no runs");
+	loser_tree_destroy(&t);
+
+	srand(17);
+	long one[] = {0}, single[] = {100};
+	unit_check(test_loser_tree_runs(one, 1, 0) &&
+		   test_loser_tree_runs(single, 1, 0), "one run");
+
+	/* The empty runs first, in the middle and last. */
+	long three[][3] = {{50, 60, 70}, {0, 40, 40}, {40, 0, 40},
+			   {40, 40, 0}, {0, 0, 0}, {0, 0, 1}};
+	long five[][5] = {{100, 1, 200, 30, 7}, {0, 100, 0, 100, 0},
+			  {100, 0, 0, 0, 100}, {1, 1, 1, 1, 1}};
+	bool is_ok = true;
+	for (size_t i = 0; i < sizeof(three) / sizeof(three[0]); ++i)
+		is_ok &= test_loser_tree_runs(three[i], 3, 0);
+	for (size_t i = 0; i < sizeof(five) / sizeof(five[0]); ++i)
+		is_ok &= test_loser_tree_runs(five[i], 5, 0);
+	unit_check(is_ok, "3 and 5 runs, the empty ones anywhere");
+
+	is_ok = true;
+	for (long step = 1; step <= 16; step *= 2) {
+		for (size_t i = 0; i < sizeof(five) / sizeof(five[0]); ++i)
+			is_ok &= test_loser_tree_runs(five[i], 5, step);
+		is_ok &= test_loser_tree_runs(three[0], 3, step);
+	}
+	unit_check(is_ok, "runs are refilled, when they are empty");
+
+	unit_test_finish();
+}
+
+static void
+test_ext_merge(void)
+{
+	unit_test_start();
+
+	/*
+	 * Runs of many lengths, the empty ones too, in one spill. The budget
+	 * takes 4 of them at once, so the merge makes several passes.
+	 */
+	enum { RUNS = 40, MAX_RUN = 30000 };
+	size_t budget = 4 * EXT_MIN_BUF;
+	long *all = malloc(sizeof(long) * RUNS * MAX_RUN);
+	long *run = malloc(sizeof(long) * MAX_RUN);
+	ext_run runs[RUNS];
+	long total = 0;
+	int fd_before = dup(0);
+	close(fd_before);
+	ext_spill spill;
+	unit_fail_if(ext_spill_open(&spill) != 0);
+	srand(13);
+	for (int i = 0; i < RUNS; ++i) {
+		long count = i % 7 == 3 ? 0 : rand() % MAX_RUN;
+		for (long k = 0; k < count; ++k)
+			run[k] = rand() % 1000 - (i % 2 == 0 ? 500 : rand());
+		qsort(run, count, sizeof(long), test_long_cmp);
+		memcpy(all + total, run, sizeof(long) * count);
+		total += count;
+		runs[i] = (ext_run) {.fd = spill.fd, .offset = spill.size,
+				     .count = count};
+		unit_fail_if(ext_spill_append(&spill, run, count) != 0);
+	}
+	unit_check(RUNS > (int)(budget / EXT_MIN_BUF), "more runs than a pass takes");
+
+	char path[32];
+	test_text_file(path, "");
+	int_writer w;
+	unit_fail_if(int_writer_open(&w, path) != 0);
+	int rc = ext_merge(runs, RUNS, budget, &w);
+	unit_fail_if(int_writer_close(&w) != 0);
+	unit_check(rc == 0, "merged in several passes");
+
+	qsort(all, total, sizeof(long), test_long_cmp);
+	int_reader r;
+	unit_fail_if(int_reader_open(&r, path, 4096) != 0);
+	long count = 0, n;
+	bool is_ok = true;
+	while ((n = int_reader_read(&r, run, MAX_RUN)) > 0) {
+		is_ok &= count + n <= total &&
+			 memcmp(run, all + count, sizeof(long) * n) == 0;
+		count += n;
+	}
+	int_reader_close(&r);
+	unlink(path);
+	unit_check(is_ok && n == 0 && count == total, "all the numbers in order");
+
+	unit_fail_if(int_writer_open(&w, "/dev/null") != 0);
+	unit_check(ext_merge(runs, RUNS, 2 * EXT_MIN_BUF, &w) == -1 &&
+		   errno == EINVAL, "a pass needs 3 buffers");
+	int_writer_close(&w);
+	ext_spill_close(&spill);
+	int fd_after = dup(0);
+	close(fd_after);
+	unit_check(fd_after == fd_before, "the spills of the passes are closed");
+
+	free(run);
+	free(all);
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	test_basic();
+#ifdef CORO_SWITCH_ASM
+	test_fpu_modes();
+#endif
+	test_round_robin();
+	test_policy();
+	test_join();
+	test_sync();
+	test_quantum();
+	test_preemption();
+	test_workers();
+	test_sched();
+	test_io();
+	test_timers();
+	test_stackless();
+	test_trace();
+	test_attr();
+	test_stack_pool();
+	test_int_io();
+	test_sort_isa();
+	test_tim_sort();
+	test_radix_sort();
+	test_loser_tree();
+	test_ext_merge();
+
+	unit_test_finish();
+	return 0;
+}